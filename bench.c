@@ -0,0 +1,494 @@
+/*
+ * bench - metadata operation benchmark for PlainFS.
+ *
+ * This file is released under the GPL.
+ *
+ * Runs create, lookup, stat, readdir, statfs and unlink over a fixed number of
+ * files and prints one CSV line per workload: operations per second and latency
+ * percentiles. An image file is driven through libplainfs, a mounted directory
+ * (-m) through system calls, so the module, plainfs-fuse and other file systems
+ * are measured the same way. bench.sh runs it over images of several sizes.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include "libplainfs.h"
+
+#define BENCH_VER "0.1"
+#define BENCH_NAME "bench"
+#define THREADS_MAX 64
+#define READDIR_SCANS 4		// whole directory listings per thread
+#define NAME_FMT "bench%07u"
+
+/*
+ * workload, ops() runs its share of operations for one thread
+ */
+struct workload {
+    const char *name;
+    void (*ops)(int);
+};
+
+void die(const char *, ...);
+void show_usage();
+unsigned long long now_ns();
+void run(struct workload *);
+void *run_thread(void *);
+void record(int, unsigned long long);
+int ns_cmp(const void *, const void *);
+void report(const char *, double);
+void do_create(int);
+void do_lookup(int);
+void do_stat(int);
+void do_readdir(int);
+void do_statfs(int);
+void do_unlink(int);
+void file_name(unsigned int, char *);
+int selected(const char *, const char *);
+
+struct workload workloads[] = {
+    {"create", do_create},
+    {"lookup", do_lookup},
+    {"stat", do_stat},
+    {"readdir", do_readdir},
+    {"statfs", do_statfs},
+    {"unlink", do_unlink},
+    {NULL, NULL}
+};
+
+char *target;			// image or mounted directory
+int mounted = 0;		// -m option
+int nthreads = 1;		// -t option
+unsigned int nfiles = 10000;	// -n option
+unsigned int nops = 0;		// -o option, lookups, stats and statfs calls, default nfiles
+int header = 1;			// -q clears it
+struct pfs *fs;
+unsigned int nnodes;		// inode slots of file system
+__u32 *inos;			// inode numbers of created files, for stat in image
+pthread_mutex_t change_lock = PTHREAD_MUTEX_INITIALIZER;	// image: changes need handle alone
+struct workload *cur;
+pthread_barrier_t start;
+unsigned long long **lat;	// per thread latencies, ns
+unsigned int *nlat;
+unsigned int *maxlat;
+unsigned long long *t_start, *t_end;	// per thread, workload takes from first start to last end
+int errors;
+
+
+
+/***********************************************************/
+int main(int argc, char *argv[])
+{
+    struct workload *w;
+    struct pfs_statfs pst;
+    struct statvfs vst;
+    char *only = NULL;
+    int rc, i;
+
+    while ((rc = getopt(argc, argv, "mt:n:o:w:q")) != -1) {
+	switch (rc) {
+	case 'm':
+	    mounted = 1;
+	    break;
+	case 't':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'n':
+	    nfiles = atoi(optarg);
+	    break;
+	case 'o':
+	    nops = atoi(optarg);
+	    break;
+	case 'w':
+	    only = optarg;
+	    break;
+	case 'q':
+	    header = 0;
+	    break;
+	default:
+	    show_usage();
+	    return 1;
+	}
+    }
+    if (optind != argc - 1 || nthreads < 1 || nthreads > THREADS_MAX || !nfiles) {
+	show_usage();
+	return 1;
+    }
+    target = argv[optind];
+    if (!nops)
+	nops = nfiles;
+
+    if (mounted) {
+	if (statvfs(target, &vst) < 0)
+	    die("unable to stat '%s'", target);
+	nnodes = vst.f_files;
+    } else {
+	fs = pfs_open(target, 0, &rc);
+	if (!fs)
+	    die("unable to open '%s': %s", target, strerror(-rc));
+	pfs_statfs(fs, &pst);
+	nnodes = pst.files;
+    }
+    if (nfiles > nnodes)
+	die("%u files do not fit in %u inodes", nfiles, nnodes);
+
+    inos = calloc(nfiles, sizeof(__u32));
+    lat = calloc(nthreads, sizeof(*lat));
+    nlat = calloc(nthreads, sizeof(*nlat));
+    maxlat = calloc(nthreads, sizeof(*maxlat));
+    t_start = calloc(nthreads, sizeof(*t_start));
+    t_end = calloc(nthreads, sizeof(*t_end));
+    if (!inos || !lat || !nlat || !maxlat || !t_start || !t_end)
+	die("out of memory");
+    for (i=0; i < nthreads; i++) {
+	maxlat[i] = (nops > nfiles ? nops : nfiles)/nthreads + READDIR_SCANS + 1;
+	lat[i] = malloc(maxlat[i]*sizeof(unsigned long long));
+	if (!lat[i])
+	    die("out of memory");
+    }
+
+    if (header)
+	printf("mode,nnodes,files,threads,op,ops,seconds,ops_per_sec,p50_us,p90_us,p99_us,max_us\n");
+    for (w = workloads; w->name; w++) {
+	// create and unlink always run, the others need files and leave none
+	if (only && w->ops != do_create && w->ops != do_unlink && !selected(only, w->name))
+	    continue;
+	run(w);
+    }
+
+    if (!mounted && (rc = pfs_close(fs)) < 0)
+	die("unable to close '%s': %s", target, strerror(-rc));
+    if (errors)
+	fprintf(stderr, BENCH_NAME": %d operations failed\n", errors);
+    return errors ? 1 : 0;
+}
+
+
+
+/***********************************************************/
+void die(const char *format, ...)
+{
+    va_list arg;
+
+    va_start(arg, format);
+    fprintf(stderr, BENCH_NAME": ");
+    vfprintf(stderr, format, arg);
+    fprintf(stderr, "\n");
+    va_end(arg);
+    exit(1);
+}
+
+
+
+/***********************************************************/
+void show_usage()
+{
+    printf(BENCH_NAME " (version "BENCH_VER")\n");
+    printf("Usage: " BENCH_NAME " [-m] [-t threads] [-n files] [-o ops] [-w workloads] [-q] image\n");
+    printf("  -m  target is a mounted directory, not an image\n");
+    printf("  -t  threads running each workload (1..%d)\n", THREADS_MAX);
+    printf("  -n  files created, looked up and unlinked\n");
+    printf("  -o  lookups, stats and statfs calls, files by default\n");
+    printf("  -w  comma separated workloads to run besides create and unlink:\n");
+    printf("      lookup,stat,readdir,statfs\n");
+    printf("  -q  no CSV header\n");
+}
+
+
+
+/***********************************************************/
+// Returns whether name is one of comma separated list
+int selected(const char *list, const char *name)
+{
+    size_t len = strlen(name), n;
+
+    for (; *list; list += n + (list[n] == ',')) {
+	n = strcspn(list, ",");
+	if (n == len && !strncmp(list, name, n))
+	    return 1;
+    }
+    return 0;
+}
+
+
+
+/***********************************************************/
+unsigned long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+
+
+/***********************************************************/
+// Runs workload on all threads at once, reports it
+void run(struct workload *w)
+{
+    pthread_t threads[THREADS_MAX];
+    unsigned long long first = ~0ULL, last = 0;
+    long i;
+
+    cur = w;
+    memset(nlat, 0, nthreads*sizeof(*nlat));
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (i=0; i < nthreads; i++)
+	if (pthread_create(&threads[i], NULL, run_thread, (void *)i))
+	    die("unable to start threads");
+    pthread_barrier_wait(&start);
+    for (i=0; i < nthreads; i++) {
+	pthread_join(threads[i], NULL);
+	if (t_start[i] < first)
+	    first = t_start[i];
+	if (t_end[i] > last)
+	    last = t_end[i];
+    }
+    pthread_barrier_destroy(&start);
+    report(w->name, (last - first)/1e9);
+}
+
+
+
+/***********************************************************/
+void *run_thread(void *arg)
+{
+    long th = (long)arg;
+
+    pthread_barrier_wait(&start);
+    t_start[th] = now_ns();
+    cur->ops(th);
+    t_end[th] = now_ns();
+    return NULL;
+}
+
+
+
+/***********************************************************/
+void record(int th, unsigned long long t)
+{
+    if (nlat[th] < maxlat[th])
+	lat[th][nlat[th]++] = now_ns() - t;
+}
+
+
+
+/***********************************************************/
+int ns_cmp(const void *a, const void *b)
+{
+    const unsigned long long *x = a, *y = b;
+
+    return *x < *y ? -1 : *x > *y;
+}
+
+
+
+/***********************************************************/
+// Merges latencies of threads, prints CSV line
+void report(const char *name, double secs)
+{
+    unsigned long long *all;
+    unsigned int n = 0, i;
+
+    for (i=0; i < nthreads; i++)
+	n += nlat[i];
+    all = malloc((n + 1)*sizeof(unsigned long long));
+    if (!all)
+	die("out of memory");
+    for (n=0, i=0; i < nthreads; i++) {
+	memcpy(all + n, lat[i], nlat[i]*sizeof(unsigned long long));
+	n += nlat[i];
+    }
+    qsort(all, n, sizeof(unsigned long long), ns_cmp);
+    if (!n)
+	all[n++] = 0;
+    printf("%s,%u,%u,%d,%s,%u,%.6f,%.0f,%.2f,%.2f,%.2f,%.2f\n", mounted ? "mount" : "image",
+	nnodes, nfiles, nthreads, name, n, secs, n/secs, all[n/2]/1e3, all[n*9/10]/1e3,
+	all[n*99/100]/1e3, all[n - 1]/1e3);
+    fflush(stdout);
+    free(all);
+}
+
+
+
+/***********************************************************/
+void file_name(unsigned int i, char *name)
+{
+    if (mounted)
+	sprintf(name, "%s/"NAME_FMT, target, i);
+    else
+	sprintf(name, NAME_FMT, i);
+}
+
+
+
+/***********************************************************/
+// Thread th creates files th, th + threads, ...
+void do_create(int th)
+{
+    char name[PATH_MAX];
+    unsigned long long t;
+    unsigned int i;
+    int rc;
+
+    for (i = th; i < nfiles; i += nthreads) {
+	file_name(i, name);
+	t = now_ns();
+	if (mounted) {
+	    rc = open(name, O_CREAT | O_EXCL | O_WRONLY, 0644);
+	    if (rc >= 0)
+		close(rc);
+	} else {
+	    pthread_mutex_lock(&change_lock);
+	    rc = pfs_create(fs, name, S_IFREG | 0644);
+	    pthread_mutex_unlock(&change_lock);
+	    if (rc > 0)
+		inos[i] = rc;
+	}
+	record(th, t);
+	if (rc < 0)
+	    __sync_fetch_and_add(&errors, 1);
+    }
+}
+
+
+
+/***********************************************************/
+// Looks up random files
+void do_lookup(int th)
+{
+    char name[PATH_MAX];
+    unsigned long long t;
+    unsigned int i, seed = th + 1;
+    int rc;
+
+    for (i = th; i < nops; i += nthreads) {
+	file_name(rand_r(&seed)%nfiles, name);
+	t = now_ns();
+	rc = mounted ? access(name, F_OK) : pfs_lookup(fs, name);
+	record(th, t);
+	if (rc < 0)
+	    __sync_fetch_and_add(&errors, 1);
+    }
+}
+
+
+
+/***********************************************************/
+// Gets attributes of random files, by path when mounted and by
+// inode number in image
+void do_stat(int th)
+{
+    char name[PATH_MAX];
+    struct stat st;
+    struct pfs_stat pst;
+    unsigned long long t;
+    unsigned int i, f, seed = th + 1;
+    int rc;
+
+    for (i = th; i < nops; i += nthreads) {
+	f = rand_r(&seed)%nfiles;
+	file_name(f, name);
+	t = now_ns();
+	rc = mounted ? stat(name, &st) : pfs_stat(fs, inos[f], &pst);
+	record(th, t);
+	if (rc < 0)
+	    __sync_fetch_and_add(&errors, 1);
+    }
+}
+
+
+
+/***********************************************************/
+// Lists whole directory READDIR_SCANS times, operation is one
+// listing
+void do_readdir(int th)
+{
+    char name[FS_NAME_MAX + 1];
+    unsigned long long t;
+    unsigned int n, i;
+    __u32 pos, ino;
+    DIR *dir;
+    struct dirent *de;
+
+    for (i=0; i < READDIR_SCANS; i++) {
+	n = 0;
+	t = now_ns();
+	if (mounted) {
+	    dir = opendir(target);
+	    if (!dir) {
+		__sync_fetch_and_add(&errors, 1);
+		return;
+	    }
+	    while ((de = readdir(dir)) != NULL)
+		if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+		    n++;
+	    closedir(dir);
+	} else {
+	    pos = 0;
+	    while (pfs_readdir(fs, &pos, name, &ino) > 0)
+		n++;
+	}
+	record(th, t);
+	if (n < nfiles)
+	    __sync_fetch_and_add(&errors, 1);
+    }
+}
+
+
+
+/***********************************************************/
+void do_statfs(int th)
+{
+    struct statvfs vst;
+    struct pfs_statfs pst;
+    unsigned long long t;
+    unsigned int i;
+    int rc;
+
+    for (i = th; i < nops; i += nthreads) {
+	t = now_ns();
+	rc = mounted ? statvfs(target, &vst) : pfs_statfs(fs, &pst);
+	record(th, t);
+	if (rc < 0)
+	    __sync_fetch_and_add(&errors, 1);
+    }
+}
+
+
+
+/***********************************************************/
+void do_unlink(int th)
+{
+    char name[PATH_MAX];
+    unsigned long long t;
+    unsigned int i;
+    int rc;
+
+    for (i = th; i < nfiles; i += nthreads) {
+	file_name(i, name);
+	t = now_ns();
+	if (mounted)
+	    rc = unlink(name);
+	else {
+	    pthread_mutex_lock(&change_lock);
+	    rc = pfs_unlink(fs, name);
+	    pthread_mutex_unlock(&change_lock);
+	}
+	record(th, t);
+	if (rc < 0)
+	    __sync_fetch_and_add(&errors, 1);
+    }
+}
@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# bench.sh - runs bench over file systems of several sizes
+#
+# Usage: bench.sh [-m image|module|fuse|ext2] [-n files] [-t "threads"] [-d dir] [size...]
+#   -m  image: libplainfs on image file (default), module: kernel module on loop device,
+#       fuse: plainfs-fuse, ext2: ext2 on loop device for comparison
+#   -n  files each run creates (default 10000), -t thread counts (default "1 2 4 8")
+#   -d  directory for image and mount point (default $TMPDIR or /tmp)
+# Sizes are as truncate(1) takes them, default 64M 256M 1G 4G. The number of files stays the
+# same so lines differ in inode count only. One CSV header, then a line per workload.
+# module and ext2 need root.
+
+set -e
+mode=image
+files=10000
+threads="1 2 4 8"
+dir=${TMPDIR:-/tmp}
+while getopts m:n:t:d: opt; do
+    case $opt in
+    m) mode=$OPTARG ;;
+    n) files=$OPTARG ;;
+    t) threads=$OPTARG ;;
+    d) dir=$OPTARG ;;
+    *) sed -n 5,12p "$0"; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] || set -- 64M 256M 1G 4G
+case $mode in
+image|module|fuse|ext2) ;;
+*) echo "bench.sh: unknown mode $mode" >&2; exit 1 ;;
+esac
+
+here=$(dirname "$0")
+img=$dir/plainfs-bench.img
+mnt=$dir/plainfs-bench.mnt
+quiet=
+trap 'umount "$mnt" 2>/dev/null || true; rm -f "$img"' EXIT
+[ $mode = image ] || mkdir -p "$mnt"
+
+for size in "$@"; do
+    for t in $threads; do
+	# every run starts from a fresh file system
+	rm -f "$img"
+	truncate -s "$size" "$img"
+	if [ $mode = ext2 ]; then
+	    mke2fs -q -F -t ext2 "$img"
+	else
+	    "$here/mkfs" "$img" >/dev/null
+	fi
+	case $mode in
+	image)
+	    "$here/bench" $quiet -t "$t" -n "$files" "$img"
+	    ;;
+	module|ext2)
+	    [ $mode = module ] && type=plainfs || type=ext2
+	    mount -o loop -t $type "$img" "$mnt"
+	    "$here/bench" -m $quiet -t "$t" -n "$files" "$mnt"
+	    umount "$mnt"
+	    ;;
+	fuse)
+	    "$here/plainfs-fuse" "$img" "$mnt"
+	    "$here/bench" -m $quiet -t "$t" -n "$files" "$mnt"
+	    fusermount3 -u "$mnt"
+	    ;;
+	esac
+	quiet=-q
+    done
+done
@@ -0,0 +1,761 @@
+/*
+ * fsck - checks and repairs a PlainFS file system.
+ *
+ * This file is released under the GPL.
+ *
+ * Image is mapped into memory and inode table blocks are handed out to threads
+ * in chunks. Every block a file refers to is claimed in a shared bitmap with an
+ * atomic test-and-set, so a block claimed twice is seen by whichever thread comes
+ * second. Files sharing blocks are then sorted out in one pass in slot order, the
+ * lowest slot keeps the block. Committed journal transactions are taken into
+ * account: -y replays them, a plain check reads through them.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <mntent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include "plainfs.h"
+
+#define FSCK_VER "0.1"
+#define FSCK_NAME "fsck.plainfs"
+#define THREADS_MAX 16		// threads checking inode table
+#define SCAN_CHUNK 64		// inode table blocks a thread takes at a time
+#define WORD_BITS (8*sizeof(unsigned long))
+// Exit codes, as fsck(8) has them
+#define EXIT_CLEAN 0
+#define EXIT_FIXED 1
+#define EXIT_LEFT 4
+#define EXIT_ERROR 8
+// Passes over inode table
+#define PASS_CHECK 0		// checks inodes and claims their blocks
+#define PASS_SHARED 1		// finds files using blocks claimed earlier
+
+/*
+ * block image of a committed transaction, read instead of the block itself
+ */
+struct jblock {
+    unsigned int blk;
+    unsigned int seq;		// position in journal, later images win
+    char *data;
+};
+
+/*
+ * live inode in name check
+ */
+struct name_ent {
+    __u32 hash;
+    __u32 slot;
+};
+
+void die(const char *, ...);
+void problem(const char *, ...);
+void show_usage();
+void check_mount();
+void open_image();
+void load_journal();
+int jblock_cmp(const void *, const void *);
+char *block(unsigned int);
+int in_data(unsigned int, unsigned int);
+void run_pass(int);
+void *check_thread(void *);
+void check_inode(unsigned int, int, struct d_extent *);
+int read_runs(struct d_ino *, unsigned int, int, struct d_extent *);
+int claim(unsigned int, unsigned int, int);
+void cut_runs(struct d_ino *, unsigned int, struct d_extent *);
+int take_meta(unsigned int, unsigned int, int, const char *);
+void clear_slot(struct d_ino *);
+char *inode_name(struct d_ino *);
+void check_names();
+int name_cmp(const void *, const void *);
+void check_bitmap();
+
+int fd = -1;
+int repair = 0;		// -y option
+int nthreads = 0;	// -j option, 0 - one per CPU
+char dev_name[100];
+char die_buf[200];
+char *img;		// mapped image
+size_t img_len;
+struct d_sb *sb;
+unsigned int bsize, ino_p_blk, ext_p_blk, ptr_p_blk, max_ext, itable_blks;
+struct jblock *jblocks;	// pending journal, sorted by block
+int njblocks;
+unsigned long *owned;	// data zone blocks claimed by files
+unsigned long *shared;	// claimed more than once
+unsigned long *assigned;	// PASS_SHARED: shared blocks given to a file
+int nshared;
+unsigned int next_chunk;	// next table block for threads
+unsigned int live;		// inodes in use
+struct name_ent *names;
+unsigned int nnames;
+int nproblems, changed;
+pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/***********************************************************/
+int main(int argc, char *argv[])
+{
+    int rc, pass;
+
+    while ((rc = getopt(argc, argv, "nyj:")) != -1) {
+	switch (rc) {
+	case 'n':
+	    repair = 0;
+	    break;
+	case 'y':
+	    repair = 1;
+	    break;
+	case 'j':
+	    nthreads = atoi(optarg);
+	    break;
+	default:
+	    show_usage();
+	    return EXIT_ERROR;
+	}
+    }
+    if (optind != argc - 1) {
+	show_usage();
+	return EXIT_ERROR;
+    }
+    strncpy(dev_name, argv[optind], sizeof(dev_name) - 1);
+    if (nthreads < 1)
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1)
+	nthreads = 1;
+    if (nthreads > THREADS_MAX)
+	nthreads = THREADS_MAX;
+    if (repair)
+	check_mount();
+
+    open_image();
+    printf("%s: %u inodes, %u data blocks of %u bytes\n", dev_name, sb->s_nnodes, sb->s_ndata, bsize);
+    load_journal();
+
+    owned = calloc(sb->s_ndata/WORD_BITS + 1, sizeof(long));
+    shared = calloc(sb->s_ndata/WORD_BITS + 1, sizeof(long));
+    names = malloc(sb->s_nnodes*sizeof(struct name_ent) + 1);
+    if (!owned || !shared || !names)
+	die("out of memory");
+
+    // Repairs free blocks and slots, ownership is collected again after them
+    for (pass = 0; pass < 3; pass++) {
+	changed = 0;
+	run_pass(PASS_CHECK);
+	if (nshared)
+	    run_pass(PASS_SHARED);
+	check_names();
+	if (!changed)
+	    break;
+	memset(owned, 0, (sb->s_ndata/WORD_BITS + 1)*sizeof(long));
+	memset(shared, 0, (sb->s_ndata/WORD_BITS + 1)*sizeof(long));
+    }
+    check_bitmap();
+
+    if (repair) {
+	if (msync(img, img_len, MS_SYNC) < 0 || fsync(fd) < 0)
+	    die("unable to write '%s'", dev_name);
+    }
+    munmap(img, img_len);
+    close(fd);
+    printf("%s: %u inodes in use, %d problems%s\n", dev_name, live, nproblems,
+	nproblems ? (repair ? " fixed" : " found") : "");
+    if (!nproblems)
+	return EXIT_CLEAN;
+    return repair ? EXIT_FIXED : EXIT_LEFT;
+}
+
+
+
+/***********************************************************/
+void die(const char *format, ...)
+{
+    va_list arg;
+
+    va_start(arg, format);
+    vsnprintf(die_buf, sizeof(die_buf), format, arg);
+    va_end(arg);
+
+    fprintf(stderr, FSCK_NAME": %s\n", die_buf);
+    exit(EXIT_ERROR);
+}
+
+
+
+/***********************************************************/
+// Reports problem, threads call it too
+void problem(const char *format, ...)
+{
+    va_list arg;
+
+    pthread_mutex_lock(&out_lock);
+    va_start(arg, format);
+    vprintf(format, arg);
+    va_end(arg);
+    printf(repair ? ", fixed\n" : "\n");
+    nproblems++;
+    pthread_mutex_unlock(&out_lock);
+}
+
+
+
+/***********************************************************/
+void show_usage()
+{
+    printf(FSCK_NAME " (version "FSCK_VER")\n");
+    printf("Usage: " FSCK_NAME " [-n | -y] [-j threads] /dev/name\n");
+    printf("  -n  only report problems (default)\n");
+    printf("  -y  repair problems\n");
+}
+
+
+
+/***********************************************************/
+void check_mount()
+{
+    FILE *f;
+    struct mntent *mnt;
+
+    if ((f = setmntent(MOUNTED, "r")) == NULL)
+	return;
+    while ((mnt = getmntent(f)) != NULL)
+	if (strcmp(dev_name, mnt->mnt_fsname) == 0)
+	    break;
+    endmntent(f);
+    if (!mnt)
+	return;
+
+    die("'%s' is mounted", dev_name);
+}
+
+
+
+/***********************************************************/
+// Maps whole image, read-only unless repairing
+void open_image()
+{
+    struct stat st;
+    struct d_sb *s;
+    char buf[FS_BSIZE];
+    unsigned long long size;
+
+    fd = open(dev_name, repair ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+	die("unable to open '%s'", dev_name);
+    if (fstat(fd, &st) < 0)
+	die("unable to stat '%s'", dev_name);
+    size = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &size) < 0)
+	die("unable to get size of '%s'", dev_name);
+
+    if (FS_BSIZE != pread(fd, buf, FS_BSIZE, 0))
+	die("unable to read superblock");
+    s = (struct d_sb *)buf;
+    if (strncmp(s->s_magic, FS_MAGIC_STR, sizeof(s->s_magic)) || FS_REV != s->s_rev)
+	die("no plainfs revision %d found", FS_REV);
+    if (s->s_bsize_bits < FS_BSIZE_BITS || s->s_bsize_bits > FS_MAX_BSIZE_BITS)
+	die("bad block size");
+    bsize = 1 << s->s_bsize_bits;
+    ino_p_blk = FS_INO_PER_BLK(bsize);
+    ext_p_blk = FS_EXT_PER_BLK(bsize);
+    ptr_p_blk = FS_PTR_PER_BLK(bsize);
+    max_ext = FS_MAX_EXTENTS(bsize);
+    itable_blks = (s->s_nnodes + ino_p_blk - 1)/ino_p_blk;
+    if ((unsigned long long)s->s_nblocks*bsize > size)
+	die("file system is larger than '%s'", dev_name);
+    if (FS_INO_BLK + itable_blks > s->s_bmap_blk || s->s_bmap_blk > s->s_journal_blk
+	|| s->s_journal_len < FS_JOURNAL_MIN || s->s_journal_blk + s->s_journal_len > s->s_data_blk
+	|| s->s_data_blk + s->s_ndata > s->s_nblocks || s->s_itable_init > itable_blks)
+	die("bad layout in superblock");
+
+    img_len = (size_t)s->s_nblocks*bsize;
+    img = mmap(NULL, img_len, repair ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == img)
+	die("unable to map '%s'", dev_name);
+    sb = (struct d_sb *)img;
+}
+
+
+
+/***********************************************************/
+// Walks committed transactions like fs_journal_replay(). With -y
+// they are written home and journal is emptied, otherwise their
+// images are read in place of the blocks.
+void load_journal()
+{
+    struct d_jhead *h = (struct d_jhead *)block(sb->s_journal_blk);
+    struct d_jblk *jb, *cj;
+    unsigned int len = sb->s_journal_len - 1, seq, pos, walked = 0, i;
+    int n = 0, max = 0;
+
+    if (FS_JOURNAL_MAGIC != h->j_magic || h->j_start >= len) {
+	problem("journal header is damaged");
+	if (repair) {
+	    h->j_magic = FS_JOURNAL_MAGIC;
+	    h->j_start = 0;
+	}
+	return;
+    }
+    seq = h->j_seq;
+    pos = h->j_start;
+    for (;;) {
+	jb = (struct d_jblk *)block(sb->s_journal_blk + 1 + pos);
+	if (FS_JOURNAL_MAGIC != jb->j_magic || FS_JDESC != jb->j_type || seq != jb->j_seq
+	    || jb->j_count > FS_JBLK_MAX(bsize) || walked + jb->j_count + 2 >= len)
+	    break;
+	cj = (struct d_jblk *)block(sb->s_journal_blk + 1 + (pos + 1 + jb->j_count)%len);
+	if (FS_JOURNAL_MAGIC != cj->j_magic || FS_JCOMMIT != cj->j_type
+	    || seq != cj->j_seq || jb->j_count != cj->j_count)
+	    break;
+	for (i=0; i < jb->j_count; i++) {
+	    if (jb->j_blk[i] >= sb->s_journal_blk)
+		die("journal transaction %u writes outside of metadata", seq);
+	    if (njblocks == max) {
+		max = max ? max*2 : 64;
+		jblocks = realloc(jblocks, max*sizeof(struct jblock));
+		if (!jblocks)
+		    die("out of memory");
+	    }
+	    jblocks[njblocks].blk = jb->j_blk[i];
+	    jblocks[njblocks].seq = njblocks;
+	    jblocks[njblocks++].data = img + (size_t)(sb->s_journal_blk + 1 + (pos + 1 + i)%len)*bsize;
+	}
+	walked += jb->j_count + 2;
+	pos = (pos + jb->j_count + 2)%len;
+	seq++;
+	n++;
+    }
+    if (!n)
+	return;
+
+    if (repair) {
+	for (i=0; i < njblocks; i++)
+	    memcpy(img + (size_t)jblocks[i].blk*bsize, jblocks[i].data, bsize);
+	if (msync(img, img_len, MS_SYNC) < 0)
+	    die("unable to write '%s'", dev_name);
+	h->j_seq = seq;
+	h->j_start = pos;
+	njblocks = 0;
+	printf("Journal: %d transactions replayed\n", n);
+	return;
+    }
+    // Sorted by block, the latest image of each block is kept
+    qsort(jblocks, njblocks, sizeof(struct jblock), jblock_cmp);
+    for (i=0, max=0; i < njblocks; i++)
+	if (i + 1 == njblocks || jblocks[i].blk != jblocks[i + 1].blk)
+	    jblocks[max++] = jblocks[i];
+    njblocks = max;
+    sb = (struct d_sb *)block(FS_SB_BLK);
+    printf("Journal: %d transactions not replayed yet, checked as if they were\n", n);
+}
+
+
+
+/***********************************************************/
+int jblock_cmp(const void *a, const void *b)
+{
+    const struct jblock *x = a, *y = b;
+
+    if (x->blk != y->blk)
+	return x->blk < y->blk ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+
+
+/***********************************************************/
+// Returns contents of block, as pending journal has it
+char *block(unsigned int blk)
+{
+    int lo = 0, hi = njblocks - 1, mid;
+
+    while (lo <= hi) {
+	mid = (lo + hi)/2;
+	if (jblocks[mid].blk == blk)
+	    return jblocks[mid].data;
+	if (jblocks[mid].blk < blk)
+	    lo = mid + 1;
+	else
+	    hi = mid - 1;
+    }
+    return img + (size_t)blk*bsize;
+}
+
+
+
+/***********************************************************/
+// Returns whether n blocks from blk on lie in data zone
+int in_data(unsigned int blk, unsigned int n)
+{
+    return blk >= sb->s_data_blk && n <= sb->s_ndata && blk - sb->s_data_blk <= sb->s_ndata - n;
+}
+
+
+
+/***********************************************************/
+// PASS_CHECK runs threads over inode table, PASS_SHARED goes
+// through it alone in slot order
+void run_pass(int pass)
+{
+    pthread_t threads[THREADS_MAX];
+    struct d_extent *ext;
+    unsigned int slot;
+    int n;
+
+    if (PASS_SHARED == pass) {
+	assigned = calloc(sb->s_ndata/WORD_BITS + 1, sizeof(long));
+	ext = malloc(max_ext*sizeof(struct d_extent));
+	if (!assigned || !ext)
+	    die("out of memory");
+	for (slot=0; slot < sb->s_itable_init*ino_p_blk && slot < sb->s_nnodes; slot++)
+	    check_inode(slot, pass, ext);
+	free(ext);
+	free(assigned);
+	return;
+    }
+
+    live = nnames = nshared = 0;
+    next_chunk = 0;
+    for (n=0; n < nthreads; n++)
+	if (pthread_create(&threads[n], NULL, check_thread, NULL))
+	    break;
+    if (!n)
+	check_thread(NULL);
+    while (n-- > 0)
+	pthread_join(threads[n], NULL);
+}
+
+
+
+/***********************************************************/
+// Checks inodes of SCAN_CHUNK table blocks at a time
+void *check_thread(void *arg)
+{
+    struct d_extent *ext;
+    unsigned int blk, end, slot;
+
+    ext = malloc(max_ext*sizeof(struct d_extent));
+    if (!ext)
+	die("out of memory");
+    for (;;) {
+	blk = __sync_fetch_and_add(&next_chunk, SCAN_CHUNK);
+	if (blk >= sb->s_itable_init)
+	    break;
+	end = blk + SCAN_CHUNK < sb->s_itable_init ? blk + SCAN_CHUNK : sb->s_itable_init;
+	for (slot = blk*ino_p_blk; slot < end*ino_p_blk && slot < sb->s_nnodes; slot++)
+	    check_inode(slot, PASS_CHECK, ext);
+    }
+    free(ext);
+    return NULL;
+}
+
+
+
+/***********************************************************/
+// Checks one inode table slot: free slot keeps no name, live
+// inode has its number, a sane name and blocks inside data zone
+// no other file has
+void check_inode(unsigned int slot, int pass, struct d_extent *ext)
+{
+    struct d_ino *di = (struct d_ino *)block(FS_INO_BLK + slot/ino_p_blk) + slot%ino_p_blk;
+    unsigned int ino = FS_SLOT_INO(slot), i, n;
+    char *name;
+    __u32 hash;
+
+    if (!di->i_nlinks) {
+	if (PASS_CHECK == pass && (di->name[0] || di->i_name_blk)) {
+	    problem("Slot %u: free, but keeps a name", slot);
+	    if (repair) {
+		di->name[0] = 0;
+		di->i_name_blk = 0;
+	    }
+	}
+	return;
+    }
+    if (di->i_ino != ino || !di->i_name_len
+	|| (di->i_name_len > FS_FNAME_LEN && !in_data(di->i_name_blk, 1))) {
+	if (PASS_CHECK == pass) {
+	    problem("Slot %u: inode %u with name length %u and name block %u is not valid",
+		slot, di->i_ino, di->i_name_len, di->i_name_blk);
+	    if (repair)
+		clear_slot(di);
+	}
+	return;
+    }
+    if (PASS_CHECK == pass) {
+	name = inode_name(di);
+	hash = fs_name_hash(name, di->i_name_len);
+	if (hash != di->i_name_hash) {
+	    problem("Inode %u: wrong name hash", ino);
+	    if (repair)
+		di->i_name_hash = hash;
+	}
+	i = __sync_fetch_and_add(&nnames, 1);
+	names[i].hash = hash;
+	names[i].slot = slot;
+	__sync_fetch_and_add(&live, 1);
+    }
+    if (di->i_name_len > FS_FNAME_LEN && claim(di->i_name_blk, ino, pass) < 0) {
+	problem("Inode %u: name block %u belongs to another file", ino, di->i_name_blk);
+	if (repair)
+	    clear_slot(di);
+	return;
+    }
+
+    // Inline file may be longer than its data after extending truncate, the rest reads zeros
+    if (di->i_flags & FS_INLINE_DATA)
+	return;
+    if (PASS_CHECK == pass && di->i_nextents > max_ext) {
+	problem("Inode %u: %u extents", ino, di->i_nextents);
+	if (repair)
+	    di->i_nextents = max_ext;
+    }
+
+    // Extents are taken up to the first bad one, the file is cut there
+    n = read_runs(di, ino, pass, ext);
+    for (i=0; i < n; i++) {
+	unsigned int b, start = ext[i].e_start, len = ext[i].e_len;
+
+	if (!start)
+	    continue;
+	if (!in_data(start, len)) {
+	    if (PASS_CHECK == pass)
+		problem("Inode %u: extent %u (%u, %u) is out of data zone", ino, i, start, len);
+	    break;
+	}
+	for (b=0; b < len; b++)
+	    if (claim(start + b, ino, pass) < 0)
+		break;
+	if (b < len) {
+	    problem("Inode %u: block %u belongs to another file", ino, start + b);
+	    break;
+	}
+    }
+    if ((i < n || n < di->i_nextents) && repair)
+	cut_runs(di, i, ext);
+}
+
+
+
+/***********************************************************/
+// Collects extents of inode into ext as pfs_read_ext() does,
+// checking and claiming extent blocks. Returns number of extents
+// that could be read.
+int read_runs(struct d_ino *di, unsigned int ino, int pass, struct d_extent *ext)
+{
+    unsigned int n = di->i_nextents < max_ext ? di->i_nextents : max_ext, k, i;
+    __u32 *ptr;
+
+    k = n < FS_NEXTENT ? n : FS_NEXTENT;
+    memcpy(ext, di->i_ext, k*sizeof(struct d_extent));
+    if (n <= FS_NEXTENT)
+	return n;
+
+    if (take_meta(di->i_ind, ino, pass, "extent block") < 0)
+	return FS_NEXTENT;
+    k = n - FS_NEXTENT < ext_p_blk ? n - FS_NEXTENT : ext_p_blk;
+    memcpy(ext + FS_NEXTENT, block(di->i_ind), k*sizeof(struct d_extent));
+    if (n == FS_NEXTENT + k)
+	return n;
+
+    if (take_meta(di->i_dind, ino, pass, "extent pointer block") < 0)
+	return FS_NEXTENT + ext_p_blk;
+    ptr = (__u32 *)block(di->i_dind);
+    for (i = FS_NEXTENT + ext_p_blk, k = 0; i < n; i += ext_p_blk, k++) {
+	if (take_meta(ptr[k], ino, pass, "extent block") < 0)
+	    return i;
+	memcpy(ext + i, block(ptr[k]), (n - i < ext_p_blk ? n - i : ext_p_blk)*sizeof(struct d_extent));
+    }
+    return n;
+}
+
+
+
+/***********************************************************/
+// Claims block holding extents, returns -1 if file can not have it
+int take_meta(unsigned int blk, unsigned int ino, int pass, const char *what)
+{
+    if (!in_data(blk, 1)) {
+	if (PASS_CHECK == pass)
+	    problem("Inode %u: %s %u is out of data zone", ino, what, blk);
+	return -1;
+    }
+    if (claim(blk, ino, pass) < 0) {
+	problem("Inode %u: %s %u belongs to another file", ino, what, blk);
+	return -1;
+    }
+    return 0;
+}
+
+
+
+/***********************************************************/
+// PASS_CHECK marks block owned and notes it if it already was.
+// PASS_SHARED gives a shared block to its first file, returns -1
+// for the others.
+int claim(unsigned int blk, unsigned int ino, int pass)
+{
+    unsigned int bit = blk - sb->s_data_blk;
+    unsigned long mask = 1UL << (bit%WORD_BITS);
+
+    if (PASS_CHECK == pass) {
+	if (__sync_fetch_and_or(&owned[bit/WORD_BITS], mask) & mask) {
+	    __sync_fetch_and_or(&shared[bit/WORD_BITS], mask);
+	    __sync_fetch_and_add(&nshared, 1);
+	}
+	return 0;
+    }
+    if (!(shared[bit/WORD_BITS] & mask))
+	return 0;
+    if (assigned[bit/WORD_BITS] & mask)
+	return -1;
+    assigned[bit/WORD_BITS] |= mask;
+    return 0;
+}
+
+
+
+/***********************************************************/
+// Leaves first n extents of file, size is cut to them. Extent
+// blocks no longer needed are dropped from inode, as the module
+// frees the ones it finds listed.
+void cut_runs(struct d_ino *di, unsigned int n, struct d_extent *ext)
+{
+    unsigned long long size = 0;
+    unsigned int i, nchild;
+    __u32 *ptr;
+
+    for (i=0; i < n; i++)
+	size += ext[i].e_len;
+    size *= bsize;
+    if (di->i_size > size)
+	di->i_size = size;
+    if (n < FS_NEXTENT)
+	memset(di->i_ext + n, 0, (FS_NEXTENT - n)*sizeof(struct d_extent));
+    if (n <= FS_NEXTENT)
+	di->i_ind = 0;
+    if (n <= FS_NEXTENT + ext_p_blk)
+	di->i_dind = 0;
+    else if (in_data(di->i_dind, 1)) {
+	ptr = (__u32 *)block(di->i_dind);
+	nchild = (n - FS_NEXTENT - ext_p_blk + ext_p_blk - 1)/ext_p_blk;
+	for (i = nchild; i < ptr_p_blk; i++)
+	    ptr[i] = 0;
+    }
+    di->i_nextents = n;
+    changed = 1;
+}
+
+
+
+/***********************************************************/
+void clear_slot(struct d_ino *di)
+{
+    memset(di, 0, sizeof(struct d_ino));
+    changed = 1;
+}
+
+
+
+/***********************************************************/
+char *inode_name(struct d_ino *di)
+{
+    return di->i_name_len > FS_FNAME_LEN ? block(di->i_name_blk) : di->name;
+}
+
+
+
+/***********************************************************/
+// Two files with the same name can not both be looked up, the
+// one in the higher slot is removed
+void check_names()
+{
+    struct d_ino *a, *b;
+    unsigned int i, j;
+
+    qsort(names, nnames, sizeof(struct name_ent), name_cmp);
+    for (i=0; i < nnames; i++)
+	for (j = i + 1; j < nnames && names[j].hash == names[i].hash; j++) {
+	    a = (struct d_ino *)block(FS_INO_BLK + names[i].slot/ino_p_blk) + names[i].slot%ino_p_blk;
+	    b = (struct d_ino *)block(FS_INO_BLK + names[j].slot/ino_p_blk) + names[j].slot%ino_p_blk;
+	    if (!a->i_nlinks || !b->i_nlinks || a->i_name_len != b->i_name_len
+		|| memcmp(inode_name(a), inode_name(b), a->i_name_len))
+		continue;
+	    problem("Inode %u: has the same name as inode %u", FS_SLOT_INO(names[j].slot),
+		FS_SLOT_INO(names[i].slot));
+	    if (repair)
+		clear_slot(b);
+	}
+}
+
+
+
+/***********************************************************/
+int name_cmp(const void *a, const void *b)
+{
+    const struct name_ent *x = a, *y = b;
+
+    if (x->hash != y->hash)
+	return x->hash < y->hash ? -1 : 1;
+    return x->slot < y->slot ? -1 : x->slot > y->slot;
+}
+
+
+
+/***********************************************************/
+// Compares on-disk bitmap and free counters with blocks files
+// own. They are only kept up to date by the module when state
+// says so, otherwise mount rebuilds them and -y writes them.
+void check_bitmap()
+{
+    unsigned char *own = (unsigned char *)owned, *bm;
+    unsigned int i, bit, used = 0, lost = 0, leaked = 0, per_blk = 8*bsize;
+
+    for (i=0; i < sb->s_ndata; i++) {
+	bm = (unsigned char *)block(sb->s_bmap_blk + i/per_blk);
+	bit = i%per_blk;
+	if (own[i >> 3] & (1 << (i & 7))) {
+	    used++;
+	    if (!(bm[bit >> 3] & (1 << (bit & 7))))
+		lost++;
+	} else if (bm[bit >> 3] & (1 << (bit & 7)))
+	    leaked++;
+    }
+
+    if (FS_BMAP_VALID(sb->s_state)) {
+	if (lost)
+	    problem("Bitmap: %u blocks in use are marked free", lost);
+	if (leaked)
+	    problem("Bitmap: %u free blocks are marked in use", leaked);
+	if (FS_STATE_CLEAN == sb->s_state
+	    && (sb->s_free_blocks != sb->s_ndata - used || sb->s_free_inodes != sb->s_nnodes - live))
+	    problem("Superblock: free counts %u/%u, should be %u/%u", sb->s_free_blocks,
+		sb->s_free_inodes, sb->s_ndata - used, sb->s_nnodes - live);
+    } else if (lost || leaked)
+	printf("Bitmap differs from blocks in use, it is rebuilt on mount\n");
+    if (!repair)
+	return;
+
+    // Bitmap is rewritten whole, bits past data zone stay clear
+    for (i=0; i*per_blk < sb->s_ndata; i++) {
+	bm = (unsigned char *)block(sb->s_bmap_blk + i);
+	memset(bm, 0, bsize);
+	bit = sb->s_ndata - i*per_blk < per_blk ? sb->s_ndata - i*per_blk : per_blk;
+	memcpy(bm, own + i*bsize, (bit + 7)/8);
+	if (bit%8)
+	    bm[bit/8] &= (1 << (bit%8)) - 1;
+    }
+    sb->s_free_blocks = sb->s_ndata - used;
+    sb->s_free_inodes = sb->s_nnodes - live;
+    sb->s_state = FS_STATE_CLEAN;
+}
@@ -0,0 +1,1862 @@
+/*
+ * libplainfs.c - reads and writes PlainFS images from userspace
+ *
+ * This file is released under the GPL.
+ *
+ * Layout rules are the ones of plainfs.c: inode numbers map straight to inode
+ * table slots, names longer than FS_FNAME_LEN live in name blocks, small files
+ * keep their data inline and extents past FS_NEXTENT go to extent blocks.
+ * Journal left by the module is replayed on open. While an image is open for
+ * writing its superblock state is 0, so after a crashed tool the module rebuilds
+ * the bitmap from the inode table.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "libplainfs.h"
+
+#define PFS_NAME_HASH_MIN 256	// smallest name hash table
+#define PFS_SHARD(fs, blk) (&(fs)->shard[(blk)%PFS_CACHE_SHARDS])
+
+/*
+ * cached block
+ */
+struct pfs_buf {
+    __u32 blk;
+    int uptodate;		// data has been read or filled
+    int dirty;
+    int refs;			// users, block is not evicted while it has some
+    struct pfs_buf *hnext;	// hash chain
+    struct pfs_buf *prev;	// LRU list, most recently used first
+    struct pfs_buf *next;
+    char *data;
+};
+
+/*
+ * part of block cache, block n is kept by shard n % PFS_CACHE_SHARDS
+ */
+struct pfs_shard {
+    pthread_mutex_t lock;	// guards everything below and refs of buffers
+    struct pfs_buf **hash;
+    __u32 hash_mask;
+    struct pfs_buf lru;		// list head
+    int nbufs;
+};
+
+/*
+ * inode in memory, all extents are kept in ext, di.i_ext is filled from it on write
+ */
+struct pfs_inode {
+    struct d_ino di;
+    struct d_extent *ext;
+    __u32 ext_max;		// room in ext
+    int dirty;
+};
+
+/*
+ * opened image
+ */
+struct pfs {
+    int fd;
+    int flags;
+    struct d_sb sb;
+    __u32 bsize;
+    __u32 ino_per_blk;
+    __u32 ext_per_blk;
+    __u32 ptr_per_blk;
+    __u32 max_extents;
+    struct pfs_shard shard[PFS_CACHE_SHARDS];	// block cache
+    // Data zone bitmap, bit n is block s_data_blk + n
+    unsigned char *bm;
+    __u32 bm_bytes;
+    __u32 free_blocks;
+    __u32 free_inodes;
+    // Name index, chains hold slot + 1, 0 ends them
+    char **names;		// name of each live slot, NULL - free slot
+    __u32 *name_next;
+    __u32 *name_head;
+    __u32 name_mask;
+    __u32 slot_rotor;		// where free slots are searched from
+    struct pfs_inode **inodes;	// loaded inodes by slot
+    pthread_mutex_t ilock;	// guards loading into inodes
+};
+
+static struct pfs_buf *pfs_getblk(struct pfs *, __u32);
+static struct pfs_buf *pfs_find_blk(struct pfs *, struct pfs_shard *, __u32, int);
+static struct pfs_buf *pfs_bread(struct pfs *, __u32);
+static void pfs_brelse(struct pfs *, struct pfs_buf *);
+static int pfs_bwrite(struct pfs *, struct pfs_buf *);
+static int pfs_sync_blk(struct pfs *, __u32);
+static struct pfs_buf *pfs_buf_alloc(struct pfs *, struct pfs_shard *);
+static void pfs_lru_del(struct pfs_buf *);
+static void pfs_lru_add(struct pfs_shard *, struct pfs_buf *);
+static int pfs_flush(struct pfs *);
+static int pfs_buf_cmp(const void *, const void *);
+static int pfs_journal_replay(struct pfs *);
+static __u32 pfs_jblock(struct pfs *, __u32);
+static int pfs_load(struct pfs *);
+static int pfs_load_bitmap(struct pfs *);
+static int pfs_write_state(struct pfs *, int);
+static void pfs_mark_blk(struct pfs *, __u32, __u32);
+static void pfs_free_blk(struct pfs *, __u32, __u32);
+static __u32 pfs_alloc_blk(struct pfs *, __u32);
+static int pfs_read_ext(struct pfs *, struct d_ino *, struct d_extent *, int);
+static int pfs_write_ext(struct pfs *, struct pfs_inode *);
+static int pfs_meta_blk(struct pfs *, __u32 *, struct pfs_buf **);
+static int pfs_ext_room(struct pfs_inode *, __u32);
+static void pfs_ext_merge(struct pfs_inode *, __u32);
+static void pfs_ext_cut(struct pfs *, struct pfs_inode *, __u32);
+static int pfs_bmap(struct pfs *, struct pfs_inode *, __u32, int, __u32 *, int *);
+static int pfs_iget(struct pfs *, __u32, struct pfs_inode **);
+static int pfs_load_inode(struct pfs *, __u32, struct pfs_inode **);
+static int pfs_put_inode(struct pfs *, __u32, struct pfs_inode *);
+static int pfs_itable_extend(struct pfs *, __u32);
+static int pfs_inline_to_blocks(struct pfs *, struct pfs_inode *);
+static void pfs_inode_free(struct pfs *, __u32, struct pfs_inode *);
+static char *pfs_dname(struct pfs *, struct d_ino *);
+static void pfs_set_dname(struct d_ino *, const char *, int, __u32);
+static int pfs_write_name(struct pfs *, const char *, int);
+static int pfs_name_find(struct pfs *, const char *, int);
+static void pfs_name_add(struct pfs *, __u32, char *);
+static void pfs_name_del(struct pfs *, __u32);
+static void pfs_free(struct pfs *);
+
+
+
+/**********************************************************************************/
+// Opens image, replays its journal and builds name index and block bitmap. Returns
+// NULL and error in *err on failure.
+/**********************************************************************************/
+struct pfs *pfs_open(const char *path, int flags, int *err)
+{
+    struct pfs *fs;
+    struct pfs_buf *b;
+    char buf[FS_BSIZE];
+    struct pfs_shard *sh;
+    int rc = 0, i;
+    __u32 n;
+
+    fs = calloc(1, sizeof(struct pfs));
+    if (!fs) {
+	*err = -ENOMEM;
+	return NULL;
+    }
+    fs->flags = flags;
+    for (i = 0; i < PFS_CACHE_SHARDS; i++) {
+	sh = &fs->shard[i];
+	pthread_mutex_init(&sh->lock, NULL);
+	sh->lru.prev = sh->lru.next = &sh->lru;
+    }
+    pthread_mutex_init(&fs->ilock, NULL);
+    fs->fd = open(path, (flags & PFS_RDONLY) ? O_RDONLY : O_RDWR);
+    if (fs->fd < 0) {
+	rc = -errno;
+	goto out;
+    }
+
+    // Superblock is read with the smallest block size, as the module does
+    if (FS_BSIZE != pread(fs->fd, buf, FS_BSIZE, 0)) {
+	rc = -EIO;
+	goto out;
+    }
+    memcpy(&fs->sb, buf, sizeof(fs->sb));
+    if (strncmp(fs->sb.s_magic, FS_MAGIC_STR, sizeof(fs->sb.s_magic)) || FS_REV != fs->sb.s_rev
+	|| fs->sb.s_bsize_bits < FS_BSIZE_BITS || fs->sb.s_bsize_bits > FS_MAX_BSIZE_BITS
+	|| fs->sb.s_journal_len < FS_JOURNAL_MIN
+	|| fs->sb.s_itable_init > fs->sb.s_bmap_blk - FS_INO_BLK) {
+	rc = -EINVAL;
+	goto out;
+    }
+    fs->bsize = 1 << fs->sb.s_bsize_bits;
+    fs->ino_per_blk = FS_INO_PER_BLK(fs->bsize);
+    fs->ext_per_blk = FS_EXT_PER_BLK(fs->bsize);
+    fs->ptr_per_blk = FS_PTR_PER_BLK(fs->bsize);
+    fs->max_extents = FS_MAX_EXTENTS(fs->bsize);
+
+    for (n = 1; n < PFS_CACHE_BLOCKS/PFS_CACHE_SHARDS; n <<= 1);
+    for (i = 0; i < PFS_CACHE_SHARDS; i++) {
+	sh = &fs->shard[i];
+	sh->hash = calloc(n, sizeof(struct pfs_buf *));
+	if (!sh->hash) {
+	    rc = -ENOMEM;
+	    goto out;
+	}
+	sh->hash_mask = n - 1;
+    }
+
+    rc = pfs_journal_replay(fs);
+    if (rc)
+	goto out;
+    // Replay may have rewritten superblock
+    b = pfs_bread(fs, FS_SB_BLK);
+    if (!b) {
+	rc = -EIO;
+	goto out;
+    }
+    memcpy(&fs->sb, b->data, sizeof(fs->sb));
+    pfs_brelse(fs, b);
+
+    rc = pfs_load(fs);
+    if (rc)
+	goto out;
+    if (!(flags & PFS_RDONLY))
+	rc = pfs_write_state(fs, 0);
+
+out:
+    if (rc) {
+	pfs_free(fs);
+	*err = rc;
+	return NULL;
+    }
+    return fs;
+}
+
+
+
+/**********************************************************************************/
+// Writes everything back, marks image clean and releases handle
+/**********************************************************************************/
+int pfs_close(struct pfs *fs)
+{
+    int rc;
+
+    rc = pfs_sync(fs);
+    if (!rc && !(fs->flags & PFS_RDONLY))
+	rc = pfs_write_state(fs, FS_STATE_CLEAN);
+    pfs_free(fs);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Writes changed inodes, bitmap, free counters and cached blocks to image
+/**********************************************************************************/
+int pfs_sync(struct pfs *fs)
+{
+    struct pfs_buf *b;
+    struct d_sb *ds;
+    __u32 slot, i, len;
+    int rc = 0, ret;
+
+    if (fs->flags & PFS_RDONLY)
+	return 0;
+    for (slot = 0; slot < fs->sb.s_nnodes; slot++)
+	if (fs->inodes[slot] && fs->inodes[slot]->dirty) {
+	    ret = pfs_put_inode(fs, slot, fs->inodes[slot]);
+	    rc = rc ? rc : ret;
+	}
+
+    for (i = 0; i*fs->bsize < fs->bm_bytes; i++) {
+	b = pfs_getblk(fs, fs->sb.s_bmap_blk + i);
+	if (!b)
+	    return -EIO;
+	len = fs->bm_bytes - i*fs->bsize;
+	if (len > fs->bsize)
+	    len = fs->bsize;
+	memset(b->data, 0, fs->bsize);
+	memcpy(b->data, fs->bm + i*fs->bsize, len);
+	b->uptodate = b->dirty = 1;
+	pfs_brelse(fs, b);
+    }
+
+    ret = pfs_flush(fs);
+    rc = rc ? rc : ret;
+    if (!rc && fsync(fs->fd))
+	rc = -errno;
+    if (rc)
+	return rc;
+
+    // Superblock goes last, it may count table blocks written just now
+    b = pfs_bread(fs, FS_SB_BLK);
+    if (!b)
+	return -EIO;
+    ds = (struct d_sb *)b->data;
+    ds->s_free_blocks = fs->free_blocks;
+    ds->s_free_inodes = fs->free_inodes;
+    ds->s_itable_init = fs->sb.s_itable_init;
+    rc = pfs_bwrite(fs, b);
+    pfs_brelse(fs, b);
+    if (!rc && fsync(fs->fd))
+	rc = -errno;
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Returns inode number of name or error
+/**********************************************************************************/
+int pfs_lookup(struct pfs *fs, const char *name)
+{
+    int slot;
+
+    slot = pfs_name_find(fs, name, strlen(name));
+    return slot < 0 ? -ENOENT : FS_SLOT_INO(slot);
+}
+
+
+
+/**********************************************************************************/
+int pfs_stat(struct pfs *fs, __u32 ino, struct pfs_stat *st)
+{
+    struct pfs_inode *ip;
+    __u32 i;
+    int rc;
+
+    rc = pfs_iget(fs, ino, &ip);
+    if (rc)
+	return rc;
+    st->ino = ino;
+    st->mode = ip->di.i_mode | S_IFREG;
+    st->uid = ip->di.i_uid;
+    st->gid = ip->di.i_gid;
+    st->time = ip->di.i_time;
+    st->size = ip->di.i_size;
+    st->blocks = 0;
+    for (i = 0; i < ip->di.i_nextents; i++)
+	if (ip->ext[i].e_start)
+	    st->blocks += ip->ext[i].e_len;
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Sets mode, owner and time of file. Size is changed with pfs_truncate().
+/**********************************************************************************/
+int pfs_setattr(struct pfs *fs, __u32 ino, const struct pfs_stat *st)
+{
+    struct pfs_inode *ip;
+    int rc;
+
+    if (fs->flags & PFS_RDONLY)
+	return -EROFS;
+    rc = pfs_iget(fs, ino, &ip);
+    if (rc)
+	return rc;
+    ip->di.i_mode = st->mode;
+    ip->di.i_uid = st->uid;
+    ip->di.i_gid = st->gid;
+    ip->di.i_time = st->time;
+    ip->dirty = 1;
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Creates empty file like fs_mknod(), returns its inode number or error
+/**********************************************************************************/
+int pfs_create(struct pfs *fs, const char *name, int mode)
+{
+    struct pfs_inode *ip;
+    char *copy;
+    int len = strlen(name), name_blk, rc;
+    __u32 slot, i;
+
+    if (fs->flags & PFS_RDONLY)
+	return -EROFS;
+    if (!len)
+	return -EINVAL;
+    if (len > FS_NAME_MAX)
+	return -ENAMETOOLONG;
+    if (pfs_name_find(fs, name, len) >= 0)
+	return -EEXIST;
+    for (i = 0; i < fs->sb.s_nnodes; i++) {
+	slot = (fs->slot_rotor + i)%fs->sb.s_nnodes;
+	if (!fs->names[slot])
+	    break;
+    }
+    if (i == fs->sb.s_nnodes)
+	return -ENFILE;
+    rc = pfs_itable_extend(fs, slot);
+    if (rc)
+	return rc;
+    rc = pfs_load_inode(fs, slot, &ip);
+    if (rc)
+	return rc;
+    copy = strdup(name);
+    if (!copy)
+	return -ENOMEM;
+    name_blk = pfs_write_name(fs, name, len);
+    if (name_blk < 0) {
+	free(copy);
+	return name_blk;
+    }
+
+    // New file starts inline, as in the module
+    memset(&ip->di, 0, sizeof(ip->di));
+    pfs_set_dname(&ip->di, name, len, name_blk);
+    ip->di.i_ino = FS_SLOT_INO(slot);
+    ip->di.i_mode = (mode & S_IFMT) ? mode : mode | S_IFREG;
+    ip->di.i_nlinks = 1;
+    ip->di.i_time = time(NULL);
+    ip->di.i_flags = FS_INLINE_DATA;
+    ip->dirty = 1;
+    pfs_name_add(fs, slot, copy);
+    fs->free_inodes--;
+    fs->slot_rotor = slot + 1;
+    return FS_SLOT_INO(slot);
+}
+
+
+
+/**********************************************************************************/
+// Reads up to len bytes at off, returns bytes read or error
+/**********************************************************************************/
+ssize_t pfs_read(struct pfs *fs, __u32 ino, void *buf, size_t len, __u64 off)
+{
+    struct pfs_inode *ip;
+    struct pfs_buf *b;
+    __u32 phys, boff, n;
+    size_t done = 0;
+    int rc, new;
+
+    rc = pfs_iget(fs, ino, &ip);
+    if (rc)
+	return rc;
+    if (off >= ip->di.i_size)
+	return 0;
+    if (len > ip->di.i_size - off)
+	len = ip->di.i_size - off;
+    if (ip->di.i_flags & FS_INLINE_DATA) {
+	// Size may exceed inline bytes after extending truncate in module, rest reads zeros
+	n = off < FS_INLINE_LEN ? FS_INLINE_LEN - off : 0;
+	if (n > len)
+	    n = len;
+	memcpy(buf, (char *)ip->di.i_ext + off, n);
+	memset((char *)buf + n, 0, len - n);
+	return len;
+    }
+
+    while (done < len) {
+	boff = (off + done)%fs->bsize;
+	n = fs->bsize - boff;
+	if (n > len - done)
+	    n = len - done;
+	rc = pfs_bmap(fs, ip, (off + done)/fs->bsize, 0, &phys, &new);
+	if (rc)
+	    return done ? done : rc;
+	if (!phys)
+	    memset((char *)buf + done, 0, n);
+	else {
+	    b = pfs_bread(fs, phys);
+	    if (!b)
+		return done ? done : -EIO;
+	    memcpy((char *)buf + done, b->data + boff, n);
+	    pfs_brelse(fs, b);
+	}
+	done += n;
+    }
+    return done;
+}
+
+
+
+/**********************************************************************************/
+// Maps up to len bytes of file at off to image. Segment with pos 0 is a hole, block
+// 0 is never file data. Cached changes of mapped blocks are written first, so that
+// image can be read at returned offsets. Returns number of segments filled, 0 past
+// end of file and where file can only be read with pfs_read(): inline data and
+// replayed blocks of read-only handle.
+/**********************************************************************************/
+int pfs_map(struct pfs *fs, __u32 ino, __u64 off, size_t len, struct pfs_seg *seg, int nseg)
+{
+    struct pfs_inode *ip;
+    struct pfs_seg *last;
+    __u32 phys, boff, n;
+    __u64 pos;
+    size_t done = 0;
+    int rc, new, k = 0;
+
+    rc = pfs_iget(fs, ino, &ip);
+    if (rc)
+	return rc;
+    if (off >= ip->di.i_size || (ip->di.i_flags & FS_INLINE_DATA))
+	return 0;
+    if (len > ip->di.i_size - off)
+	len = ip->di.i_size - off;
+
+    while (done < len) {
+	boff = (off + done)%fs->bsize;
+	n = fs->bsize - boff;
+	if (n > len - done)
+	    n = len - done;
+	rc = pfs_bmap(fs, ip, (off + done)/fs->bsize, 0, &phys, &new);
+	if (rc)
+	    return k ? k : rc;
+	pos = 0;
+	if (phys) {
+	    rc = pfs_sync_blk(fs, phys);
+	    if (-EROFS == rc)
+		return 0;
+	    if (rc)
+		return k ? k : rc;
+	    pos = (__u64)phys*fs->bsize + boff;
+	}
+	last = k ? seg + k - 1 : NULL;
+	if (last && (pos ? last->pos && last->pos + last->len == pos : !last->pos))
+	    last->len += n;
+	else if (k == nseg)
+	    break;
+	else {
+	    seg[k].pos = pos;
+	    seg[k++].len = n;
+	}
+	done += n;
+    }
+    return k;
+}
+
+
+
+/**********************************************************************************/
+// Writes len bytes at off, allocating blocks near the previous ones of file.
+// Returns bytes written or error.
+/**********************************************************************************/
+ssize_t pfs_write(struct pfs *fs, __u32 ino, const void *buf, size_t len, __u64 off)
+{
+    struct pfs_inode *ip;
+    struct pfs_buf *b;
+    __u32 phys, boff, n;
+    size_t done = 0;
+    int rc, new;
+
+    if (fs->flags & PFS_RDONLY)
+	return -EROFS;
+    rc = pfs_iget(fs, ino, &ip);
+    if (rc)
+	return rc;
+    if (off + len > (__u64)fs->sb.s_ndata*fs->bsize)
+	return -EFBIG;
+    if (!len)
+	return 0;
+    ip->dirty = 1;
+    ip->di.i_time = time(NULL);
+    if (ip->di.i_flags & FS_INLINE_DATA) {
+	if (off + len <= FS_INLINE_LEN) {
+	    memcpy((char *)ip->di.i_ext + off, buf, len);
+	    if (off + len > ip->di.i_size)
+		ip->di.i_size = off + len;
+	    return len;
+	}
+	rc = pfs_inline_to_blocks(fs, ip);
+	if (rc)
+	    return rc;
+    }
+
+    while (done < len) {
+	boff = (off + done)%fs->bsize;
+	n = fs->bsize - boff;
+	if (n > len - done)
+	    n = len - done;
+	rc = pfs_bmap(fs, ip, (off + done)/fs->bsize, 1, &phys, &new);
+	if (rc)
+	    break;
+	b = (new || n == fs->bsize) ? pfs_getblk(fs, phys) : pfs_bread(fs, phys);
+	if (!b) {
+	    rc = -EIO;
+	    break;
+	}
+	if (new && n != fs->bsize)
+	    memset(b->data, 0, fs->bsize);
+	memcpy(b->data + boff, (const char *)buf + done, n);
+	b->uptodate = b->dirty = 1;
+	pfs_brelse(fs, b);
+	done += n;
+    }
+    if (off + done > ip->di.i_size)
+	ip->di.i_size = off + done;
+    return done ? done : rc;
+}
+
+
+
+/**********************************************************************************/
+// Sets file size. Blocks past new size are freed, growing file leaves a hole.
+/**********************************************************************************/
+int pfs_truncate(struct pfs *fs, __u32 ino, __u64 size)
+{
+    struct pfs_inode *ip;
+    struct pfs_buf *b;
+    __u32 phys, boff;
+    int rc, new;
+
+    if (fs->flags & PFS_RDONLY)
+	return -EROFS;
+    rc = pfs_iget(fs, ino, &ip);
+    if (rc)
+	return rc;
+    if (size > (__u64)fs->sb.s_ndata*fs->bsize)
+	return -EFBIG;
+    if (ip->di.i_flags & FS_INLINE_DATA) {
+	if (size <= FS_INLINE_LEN) {
+	    if (size < ip->di.i_size)
+		memset((char *)ip->di.i_ext + size, 0, FS_INLINE_LEN - size);
+	    goto out;
+	}
+	rc = pfs_inline_to_blocks(fs, ip);
+	if (rc)
+	    return rc;
+    }
+
+    if (size < ip->di.i_size) {
+	pfs_ext_cut(fs, ip, (size + fs->bsize - 1)/fs->bsize);
+	// Rest of last block is cleared, file grown later reads zeros there
+	boff = size%fs->bsize;
+	rc = boff ? pfs_bmap(fs, ip, size/fs->bsize, 0, &phys, &new) : 0;
+	if (rc)
+	    return rc;
+	if (boff && phys) {
+	    b = pfs_bread(fs, phys);
+	    if (!b)
+		return -EIO;
+	    memset(b->data + boff, 0, fs->bsize - boff);
+	    b->dirty = 1;
+	    pfs_brelse(fs, b);
+	}
+    }
+out:
+    ip->di.i_size = size;
+    ip->di.i_time = time(NULL);
+    ip->dirty = 1;
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Frees file's blocks and inode slot
+/**********************************************************************************/
+int pfs_unlink(struct pfs *fs, const char *name)
+{
+    struct pfs_inode *ip;
+    int slot, rc;
+
+    if (fs->flags & PFS_RDONLY)
+	return -EROFS;
+    slot = pfs_name_find(fs, name, strlen(name));
+    if (slot < 0)
+	return -ENOENT;
+    rc = pfs_iget(fs, FS_SLOT_INO(slot), &ip);
+    if (rc)
+	return rc;
+    pfs_inode_free(fs, slot, ip);
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Renames file like fs_rename(), file having new name is deleted
+/**********************************************************************************/
+int pfs_rename(struct pfs *fs, const char *name, const char *new_name)
+{
+    struct pfs_inode *ip, *victim_ip = NULL;
+    int slot, victim, len = strlen(new_name), name_blk, rc;
+    __u32 old_blk;
+    char *copy;
+
+    if (fs->flags & PFS_RDONLY)
+	return -EROFS;
+    if (!len)
+	return -EINVAL;
+    if (len > FS_NAME_MAX)
+	return -ENAMETOOLONG;
+    slot = pfs_name_find(fs, name, strlen(name));
+    if (slot < 0)
+	return -ENOENT;
+    victim = pfs_name_find(fs, new_name, len);
+    if (victim == slot)
+	return 0;
+    rc = pfs_iget(fs, FS_SLOT_INO(slot), &ip);
+    if (rc)
+	return rc;
+    if (victim >= 0) {
+	rc = pfs_iget(fs, FS_SLOT_INO(victim), &victim_ip);
+	if (rc)
+	    return rc;
+    }
+    copy = strdup(new_name);
+    if (!copy)
+	return -ENOMEM;
+    name_blk = pfs_write_name(fs, new_name, len);
+    if (name_blk < 0) {
+	free(copy);
+	return name_blk;
+    }
+
+    if (victim >= 0)
+	pfs_inode_free(fs, victim, victim_ip);
+    old_blk = ip->di.i_name_blk;
+    pfs_set_dname(&ip->di, new_name, len, name_blk);
+    ip->dirty = 1;
+    if (old_blk)
+	pfs_free_blk(fs, old_blk, 1);
+    pfs_name_del(fs, slot);
+    pfs_name_add(fs, slot, copy);
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Returns next file from slot *pos on, its name (FS_NAME_MAX + 1 bytes buffer) and
+// inode number. Returns name length, 0 when there are no more files.
+/**********************************************************************************/
+int pfs_readdir(struct pfs *fs, __u32 *pos, char *name, __u32 *ino)
+{
+    __u32 slot;
+
+    for (slot = *pos; slot < fs->sb.s_nnodes; slot++)
+	if (fs->names[slot]) {
+	    strcpy(name, fs->names[slot]);
+	    *ino = FS_SLOT_INO(slot);
+	    *pos = slot + 1;
+	    return strlen(name);
+	}
+    *pos = fs->sb.s_nnodes;
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Returns descriptor of image, offsets from pfs_map() are read from it
+/**********************************************************************************/
+int pfs_fd(struct pfs *fs)
+{
+    return fs->fd;
+}
+
+
+
+/**********************************************************************************/
+int pfs_statfs(struct pfs *fs, struct pfs_statfs *st)
+{
+    st->bsize = fs->bsize;
+    st->blocks = fs->sb.s_ndata;
+    st->bfree = fs->free_blocks;
+    st->files = fs->sb.s_nnodes;
+    st->ffree = fs->free_inodes;
+    st->namelen = FS_NAME_MAX;
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Returns cached buffer of block, its data is valid if uptodate is set
+/**********************************************************************************/
+static struct pfs_buf *pfs_getblk(struct pfs *fs, __u32 blk)
+{
+    struct pfs_shard *sh = PFS_SHARD(fs, blk);
+    struct pfs_buf *b;
+
+    pthread_mutex_lock(&sh->lock);
+    b = pfs_find_blk(fs, sh, blk, 1);
+    pthread_mutex_unlock(&sh->lock);
+    return b;
+}
+
+
+
+/**********************************************************************************/
+// Looks block up in its shard, adding buffer for it when create is set. Called with
+// shard locked.
+/**********************************************************************************/
+static struct pfs_buf *pfs_find_blk(struct pfs *fs, struct pfs_shard *sh, __u32 blk, int create)
+{
+    struct pfs_buf *b, **head = &sh->hash[(blk/PFS_CACHE_SHARDS) & sh->hash_mask];
+
+    if (blk >= fs->sb.s_nblocks)
+	return NULL;
+    for (b = *head; b; b = b->hnext)
+	if (b->blk == blk) {
+	    pfs_lru_del(b);
+	    pfs_lru_add(sh, b);
+	    b->refs++;
+	    return b;
+	}
+    if (!create)
+	return NULL;
+    b = pfs_buf_alloc(fs, sh);
+    if (!b)
+	return NULL;
+    b->blk = blk;
+    b->uptodate = b->dirty = 0;
+    b->refs = 1;
+    b->hnext = *head;
+    *head = b;
+    pfs_lru_add(sh, b);
+    return b;
+}
+
+
+
+/**********************************************************************************/
+// Reading is done with shard locked, so that block is read once
+/**********************************************************************************/
+static struct pfs_buf *pfs_bread(struct pfs *fs, __u32 blk)
+{
+    struct pfs_shard *sh = PFS_SHARD(fs, blk);
+    struct pfs_buf *b;
+
+    pthread_mutex_lock(&sh->lock);
+    b = pfs_find_blk(fs, sh, blk, 1);
+    if (b && !b->uptodate) {
+	if (fs->bsize != pread(fs->fd, b->data, fs->bsize, (off_t)blk*fs->bsize)) {
+	    b->refs--;
+	    b = NULL;
+	} else
+	    b->uptodate = 1;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return b;
+}
+
+
+
+/**********************************************************************************/
+static void pfs_brelse(struct pfs *fs, struct pfs_buf *b)
+{
+    struct pfs_shard *sh;
+
+    if (!b)
+	return;
+    sh = PFS_SHARD(fs, b->blk);
+    pthread_mutex_lock(&sh->lock);
+    b->refs--;
+    pthread_mutex_unlock(&sh->lock);
+}
+
+
+
+/**********************************************************************************/
+// Writes block if it is cached and dirty. Read-only handle can not, -EROFS then.
+/**********************************************************************************/
+static int pfs_sync_blk(struct pfs *fs, __u32 blk)
+{
+    struct pfs_shard *sh = PFS_SHARD(fs, blk);
+    struct pfs_buf *b;
+    int rc = 0;
+
+    pthread_mutex_lock(&sh->lock);
+    b = pfs_find_blk(fs, sh, blk, 0);
+    if (b) {
+	if (b->dirty)
+	    rc = (fs->flags & PFS_RDONLY) ? -EROFS : pfs_bwrite(fs, b);
+	b->refs--;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+static int pfs_bwrite(struct pfs *fs, struct pfs_buf *b)
+{
+    if (fs->bsize != pwrite(fs->fd, b->data, fs->bsize, (off_t)b->blk*fs->bsize))
+	return -EIO;
+    b->dirty = 0;
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Takes least recently used unreferenced buffer out of shard, writing it if dirty.
+// Shard grows past its share of PFS_CACHE_BLOCKS when there is none. Read-only
+// handle keeps dirty buffers, those are replayed journal blocks.
+/**********************************************************************************/
+static struct pfs_buf *pfs_buf_alloc(struct pfs *fs, struct pfs_shard *sh)
+{
+    struct pfs_buf *b, **p;
+
+    if (sh->nbufs >= PFS_CACHE_BLOCKS/PFS_CACHE_SHARDS)
+	for (b = sh->lru.prev; b != &sh->lru; b = b->prev) {
+	    if (b->refs || (b->dirty && (fs->flags & PFS_RDONLY)))
+		continue;
+	    if (b->dirty && pfs_bwrite(fs, b))
+		return NULL;
+	    for (p = &sh->hash[(b->blk/PFS_CACHE_SHARDS) & sh->hash_mask]; *p != b; p = &(*p)->hnext);
+	    *p = b->hnext;
+	    pfs_lru_del(b);
+	    return b;
+	}
+    b = malloc(sizeof(struct pfs_buf) + fs->bsize);
+    if (!b)
+	return NULL;
+    b->data = (char *)(b + 1);
+    sh->nbufs++;
+    return b;
+}
+
+
+
+/**********************************************************************************/
+static void pfs_lru_del(struct pfs_buf *b)
+{
+    b->prev->next = b->next;
+    b->next->prev = b->prev;
+}
+
+
+
+/**********************************************************************************/
+static void pfs_lru_add(struct pfs_shard *sh, struct pfs_buf *b)
+{
+    b->next = sh->lru.next;
+    b->prev = &sh->lru;
+    sh->lru.next->prev = b;
+    sh->lru.next = b;
+}
+
+
+
+/**********************************************************************************/
+// Writes dirty buffers in block order
+/**********************************************************************************/
+static int pfs_flush(struct pfs *fs)
+{
+    struct pfs_buf *b, **dirty;
+    int rc = 0, n = 0, nbufs = 0, i;
+
+    for (i = 0; i < PFS_CACHE_SHARDS; i++)
+	nbufs += fs->shard[i].nbufs;
+    dirty = malloc((nbufs + 1)*sizeof(struct pfs_buf *));
+    if (!dirty)
+	return -ENOMEM;
+    for (i = 0; i < PFS_CACHE_SHARDS; i++)
+	for (b = fs->shard[i].lru.next; b != &fs->shard[i].lru; b = b->next)
+	    if (b->dirty)
+		dirty[n++] = b;
+    qsort(dirty, n, sizeof(struct pfs_buf *), pfs_buf_cmp);
+    for (i = 0; i < n && !rc; i++)
+	rc = pfs_bwrite(fs, dirty[i]);
+    free(dirty);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+static int pfs_buf_cmp(const void *a, const void *b)
+{
+    __u32 x = (*(struct pfs_buf **)a)->blk, y = (*(struct pfs_buf **)b)->blk;
+
+    return x < y ? -1 : x > y;
+}
+
+
+
+/**********************************************************************************/
+// Applies transactions committed to journal as fs_journal_replay() does. Writable
+// handle writes them in place and moves journal start past them, read-only one
+// keeps them in cache.
+/**********************************************************************************/
+static int pfs_journal_replay(struct pfs *fs)
+{
+    struct pfs_buf *hb, *b, *cb, *src, *dst;
+    struct d_jhead *h;
+    struct d_jblk *jb, *cj;
+    __u32 len = fs->sb.s_journal_len - 1, seq, pos, walked = 0, i;
+    int rc = 0, n = 0;
+
+    hb = pfs_bread(fs, fs->sb.s_journal_blk);
+    if (!hb)
+	return -EIO;
+    h = (struct d_jhead *)hb->data;
+    if (FS_JOURNAL_MAGIC != h->j_magic || h->j_start >= len) {
+	pfs_brelse(fs, hb);
+	return -EINVAL;
+    }
+    seq = h->j_seq;
+    pos = h->j_start;
+
+    for (;;) {
+	b = pfs_bread(fs, pfs_jblock(fs, pos));
+	if (!b) {
+	    rc = -EIO;
+	    break;
+	}
+	jb = (struct d_jblk *)b->data;
+	if (FS_JOURNAL_MAGIC != jb->j_magic || FS_JDESC != jb->j_type || seq != jb->j_seq
+	    || jb->j_count > FS_JBLK_MAX(fs->bsize) || walked + jb->j_count + 2 >= len) {
+	    pfs_brelse(fs, b);
+	    break;
+	}
+	cb = pfs_bread(fs, pfs_jblock(fs, pos + 1 + jb->j_count));
+	cj = cb ? (struct d_jblk *)cb->data : NULL;
+	if (!cj || FS_JOURNAL_MAGIC != cj->j_magic || FS_JCOMMIT != cj->j_type
+	    || seq != cj->j_seq || jb->j_count != cj->j_count) {
+	    pfs_brelse(fs, cb);
+	    pfs_brelse(fs, b);
+	    break;
+	}
+	pfs_brelse(fs, cb);
+	for (i = 0; i < jb->j_count && !rc; i++) {
+	    if (jb->j_blk[i] >= fs->sb.s_journal_blk) {
+		rc = -EINVAL;
+		break;
+	    }
+	    src = pfs_bread(fs, pfs_jblock(fs, pos + 1 + i));
+	    dst = src ? pfs_getblk(fs, jb->j_blk[i]) : NULL;
+	    if (dst) {
+		memcpy(dst->data, src->data, fs->bsize);
+		dst->uptodate = dst->dirty = 1;
+	    } else
+		rc = -EIO;
+	    pfs_brelse(fs, src);
+	    pfs_brelse(fs, dst);
+	}
+	walked += jb->j_count + 2;
+	pos = (pos + jb->j_count + 2)%len;
+	seq++;
+	n++;
+	pfs_brelse(fs, b);
+	if (rc)
+	    break;
+    }
+
+    if (!rc && n && !(fs->flags & PFS_RDONLY)) {
+	rc = pfs_flush(fs);
+	if (!rc && fsync(fs->fd))
+	    rc = -errno;
+	if (!rc) {
+	    h->j_seq = seq;
+	    h->j_start = pos;
+	    hb->dirty = 1;
+	    rc = pfs_flush(fs);
+	}
+    }
+    pfs_brelse(fs, hb);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Block number of journal block pos, counted from the one after header
+/**********************************************************************************/
+static __u32 pfs_jblock(struct pfs *fs, __u32 pos)
+{
+    return fs->sb.s_journal_blk + 1 + pos%(fs->sb.s_journal_len - 1);
+}
+
+
+
+/**********************************************************************************/
+// Fills name index from inode table. Bitmap is read from image when superblock
+// says it is valid, otherwise it is rebuilt from extents of all files.
+/**********************************************************************************/
+static int pfs_load(struct pfs *fs)
+{
+    struct pfs_buf *b;
+    struct d_ino *di;
+    struct d_extent *ext = NULL;
+    __u32 nnodes = fs->sb.s_nnodes, blk, slot, j, i, n;
+    int rc = 0, valid = FS_BMAP_VALID(fs->sb.s_state);
+    char *name;
+
+    for (n = PFS_NAME_HASH_MIN; n < nnodes/2; n <<= 1);
+    fs->name_mask = n - 1;
+    fs->name_head = calloc(n, sizeof(__u32));
+    fs->name_next = calloc(nnodes, sizeof(__u32));
+    fs->names = calloc(nnodes, sizeof(char *));
+    fs->inodes = calloc(nnodes, sizeof(struct pfs_inode *));
+    fs->bm_bytes = (fs->sb.s_ndata + 7)/8;
+    fs->bm = calloc(fs->bm_bytes, 1);
+    if (!fs->name_head || !fs->name_next || !fs->names || !fs->inodes || !fs->bm)
+	return -ENOMEM;
+    if (valid) {
+	rc = pfs_load_bitmap(fs);
+	if (rc)
+	    return rc;
+    } else {
+	ext = malloc(fs->max_extents*sizeof(struct d_extent));
+	if (!ext)
+	    return -ENOMEM;
+    }
+
+    // Table blocks past s_itable_init hold no inodes
+    fs->free_inodes = nnodes;
+    for (blk = 0; blk < fs->sb.s_itable_init && !rc; blk++) {
+	b = pfs_bread(fs, FS_INO_BLK + blk);
+	if (!b) {
+	    rc = -EIO;
+	    break;
+	}
+	di = (struct d_ino *)b->data;
+	for (j = 0; j < fs->ino_per_blk && !rc; j++) {
+	    slot = blk*fs->ino_per_blk + j;
+	    if (slot >= nnodes)
+		break;
+	    if (!di[j].i_nlinks || di[j].i_ino != FS_SLOT_INO(slot) || !di[j].i_name_len)
+		continue;
+	    name = pfs_dname(fs, di + j);
+	    if (!name) {
+		rc = -EIO;
+		break;
+	    }
+	    pfs_name_add(fs, slot, name);
+	    fs->free_inodes--;
+	    if (valid)
+		continue;
+	    if (di[j].i_name_blk)
+		pfs_mark_blk(fs, di[j].i_name_blk, 1);
+	    if (di[j].i_flags & FS_INLINE_DATA)
+		continue;
+	    rc = pfs_read_ext(fs, di + j, ext, 1);
+	    n = di[j].i_nextents < fs->max_extents ? di[j].i_nextents : fs->max_extents;
+	    for (i = 0; i < n && !rc; i++)
+		if (ext[i].e_start)
+		    pfs_mark_blk(fs, ext[i].e_start, ext[i].e_len);
+	}
+	pfs_brelse(fs, b);
+    }
+    free(ext);
+
+    fs->free_blocks = 0;
+    for (i = 0; i < fs->sb.s_ndata; i++)
+	if (!(fs->bm[i >> 3] & (1 << (i & 7))))
+	    fs->free_blocks++;
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+static int pfs_load_bitmap(struct pfs *fs)
+{
+    struct pfs_buf *b;
+    __u32 i, len;
+
+    for (i = 0; i*fs->bsize < fs->bm_bytes; i++) {
+	b = pfs_bread(fs, fs->sb.s_bmap_blk + i);
+	if (!b)
+	    return -EIO;
+	len = fs->bm_bytes - i*fs->bsize;
+	memcpy(fs->bm + i*fs->bsize, b->data, len < fs->bsize ? len : fs->bsize);
+	pfs_brelse(fs, b);
+    }
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Writes state to superblock on disk and waits for it
+/**********************************************************************************/
+static int pfs_write_state(struct pfs *fs, int state)
+{
+    struct pfs_buf *b;
+    int rc;
+
+    b = pfs_bread(fs, FS_SB_BLK);
+    if (!b)
+	return -EIO;
+    ((struct d_sb *)b->data)->s_state = state;
+    fs->sb.s_state = state;
+    rc = pfs_bwrite(fs, b);
+    pfs_brelse(fs, b);
+    if (!rc && fsync(fs->fd))
+	rc = -errno;
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+static void pfs_mark_blk(struct pfs *fs, __u32 blk, __u32 len)
+{
+    __u32 i;
+
+    for (i = blk - fs->sb.s_data_blk; i < blk - fs->sb.s_data_blk + len; i++)
+	if (i < fs->sb.s_ndata)
+	    fs->bm[i >> 3] |= 1 << (i & 7);
+}
+
+
+
+/**********************************************************************************/
+static void pfs_free_blk(struct pfs *fs, __u32 blk, __u32 len)
+{
+    __u32 i;
+
+    for (i = blk - fs->sb.s_data_blk; i < blk - fs->sb.s_data_blk + len; i++)
+	if (i < fs->sb.s_ndata && (fs->bm[i >> 3] & (1 << (i & 7)))) {
+	    fs->bm[i >> 3] &= ~(1 << (i & 7));
+	    fs->free_blocks++;
+	}
+}
+
+
+
+/**********************************************************************************/
+// Takes first free block from goal on, wrapping around the data zone. Returns the
+// block, 0 if data zone is full.
+/**********************************************************************************/
+static __u32 pfs_alloc_blk(struct pfs *fs, __u32 goal)
+{
+    __u32 i, n, bit;
+
+    if (!fs->free_blocks)
+	return 0;
+    bit = goal >= fs->sb.s_data_blk && goal < fs->sb.s_data_blk + fs->sb.s_ndata ?
+	goal - fs->sb.s_data_blk : 0;
+    for (n = 0; n < fs->sb.s_ndata; n++) {
+	i = (bit + n)%fs->sb.s_ndata;
+	// Full bytes are skipped whole
+	if (!(i & 7) && 0xff == fs->bm[i >> 3] && i + 8 <= fs->sb.s_ndata) {
+	    n += 7;
+	    continue;
+	}
+	if (!(fs->bm[i >> 3] & (1 << (i & 7)))) {
+	    fs->bm[i >> 3] |= 1 << (i & 7);
+	    fs->free_blocks--;
+	    return fs->sb.s_data_blk + i;
+	}
+    }
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Reads all extents of di into ext, marks blocks holding them in bitmap if mark
+/**********************************************************************************/
+static int pfs_read_ext(struct pfs *fs, struct d_ino *di, struct d_extent *ext, int mark)
+{
+    struct pfs_buf *b, *db;
+    __u32 n = di->i_nextents, k, i;
+    __u32 *ptr;
+
+    if (n > fs->max_extents)
+	n = fs->max_extents;
+    k = n < FS_NEXTENT ? n : FS_NEXTENT;
+    memcpy(ext, di->i_ext, k*sizeof(struct d_extent));
+    if (n <= FS_NEXTENT)
+	return 0;
+    n -= FS_NEXTENT;
+    ext += FS_NEXTENT;
+
+    b = di->i_ind ? pfs_bread(fs, di->i_ind) : NULL;
+    if (!b)
+	return -EIO;
+    k = n < fs->ext_per_blk ? n : fs->ext_per_blk;
+    memcpy(ext, b->data, k*sizeof(struct d_extent));
+    pfs_brelse(fs, b);
+    if (mark)
+	pfs_mark_blk(fs, di->i_ind, 1);
+    n -= k;
+    ext += k;
+    if (!n)
+	return 0;
+
+    db = di->i_dind ? pfs_bread(fs, di->i_dind) : NULL;
+    if (!db)
+	return -EIO;
+    ptr = (__u32 *)db->data;
+    for (i = 0; n; i++) {
+	b = ptr[i] ? pfs_bread(fs, ptr[i]) : NULL;
+	if (!b) {
+	    pfs_brelse(fs, db);
+	    return -EIO;
+	}
+	k = n < fs->ext_per_blk ? n : fs->ext_per_blk;
+	memcpy(ext, b->data, k*sizeof(struct d_extent));
+	pfs_brelse(fs, b);
+	if (mark)
+	    pfs_mark_blk(fs, ptr[i], 1);
+	n -= k;
+	ext += k;
+    }
+    pfs_brelse(fs, db);
+    if (mark)
+	pfs_mark_blk(fs, di->i_dind, 1);
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Puts extents of inode to di.i_ext and extent blocks, taking blocks it needs
+// and freeing ones it does not
+/**********************************************************************************/
+static int pfs_write_ext(struct pfs *fs, struct pfs_inode *ip)
+{
+    struct d_ino *di = &ip->di;
+    struct d_extent *ext = ip->ext;
+    struct pfs_buf *b, *db;
+    __u32 n = di->i_nextents, k, i, nchild;
+    __u32 *ptr;
+    int rc;
+
+    memset(di->i_ext, 0, sizeof(di->i_ext));
+    k = n < FS_NEXTENT ? n : FS_NEXTENT;
+    memcpy(di->i_ext, ext, k*sizeof(struct d_extent));
+    n -= k;
+    ext += k;
+
+    if (n) {
+	rc = pfs_meta_blk(fs, &di->i_ind, &b);
+	if (rc)
+	    return rc;
+	k = n < fs->ext_per_blk ? n : fs->ext_per_blk;
+	memset(b->data, 0, fs->bsize);
+	memcpy(b->data, ext, k*sizeof(struct d_extent));
+	b->dirty = 1;
+	pfs_brelse(fs, b);
+	n -= k;
+	ext += k;
+    } else if (di->i_ind) {
+	pfs_free_blk(fs, di->i_ind, 1);
+	di->i_ind = 0;
+    }
+
+    nchild = (n + fs->ext_per_blk - 1)/fs->ext_per_blk;
+    if (!nchild && !di->i_dind)
+	return 0;
+    if (nchild)
+	rc = pfs_meta_blk(fs, &di->i_dind, &db);
+    else {
+	db = pfs_bread(fs, di->i_dind);
+	rc = db ? 0 : -EIO;
+    }
+    if (rc)
+	return rc;
+    ptr = (__u32 *)db->data;
+    for (i = 0; i < fs->ptr_per_blk && !rc; i++) {
+	if (i >= nchild) {
+	    if (ptr[i])
+		pfs_free_blk(fs, ptr[i], 1);
+	    ptr[i] = 0;
+	    continue;
+	}
+	rc = pfs_meta_blk(fs, ptr + i, &b);
+	if (rc)
+	    break;
+	k = n < fs->ext_per_blk ? n : fs->ext_per_blk;
+	memset(b->data, 0, fs->bsize);
+	memcpy(b->data, ext, k*sizeof(struct d_extent));
+	b->dirty = 1;
+	pfs_brelse(fs, b);
+	n -= k;
+	ext += k;
+    }
+    db->dirty = 1;
+    pfs_brelse(fs, db);
+    if (!nchild) {
+	pfs_free_blk(fs, di->i_dind, 1);
+	di->i_dind = 0;
+    }
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Returns buffer of extent block *blk, taking a zeroed new block if *blk is 0
+/**********************************************************************************/
+static int pfs_meta_blk(struct pfs *fs, __u32 *blk, struct pfs_buf **b)
+{
+    if (*blk) {
+	*b = pfs_bread(fs, *blk);
+	return *b ? 0 : -EIO;
+    }
+    *blk = pfs_alloc_blk(fs, 0);
+    if (!*blk)
+	return -ENOSPC;
+    *b = pfs_getblk(fs, *blk);
+    if (!*b) {
+	pfs_free_blk(fs, *blk, 1);
+	*blk = 0;
+	return -EIO;
+    }
+    memset((*b)->data, 0, fs->bsize);
+    (*b)->uptodate = (*b)->dirty = 1;
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+static int pfs_ext_room(struct pfs_inode *ip, __u32 n)
+{
+    struct d_extent *ext;
+    __u32 max = ip->ext_max ? ip->ext_max : FS_NEXTENT;
+
+    if (n <= ip->ext_max)
+	return 0;
+    while (max < n)
+	max *= 2;
+    ext = realloc(ip->ext, max*sizeof(struct d_extent));
+    if (!ext)
+	return -ENOMEM;
+    ip->ext = ext;
+    ip->ext_max = max;
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Joins extent idx with its neighbours when they continue each other on disk or
+// are all holes
+/**********************************************************************************/
+static void pfs_ext_merge(struct pfs_inode *ip, __u32 idx)
+{
+    struct d_extent *e = ip->ext;
+    __u32 *n = &ip->di.i_nextents, i;
+
+    for (i = idx + 1; i >= idx && i > 0; i--) {
+	if (i >= *n)
+	    continue;
+	if (e[i - 1].e_start ? e[i - 1].e_start + e[i - 1].e_len != e[i].e_start : !!e[i].e_start)
+	    continue;
+	e[i - 1].e_len += e[i].e_len;
+	memmove(e + i, e + i + 1, (*n - i - 1)*sizeof(struct d_extent));
+	(*n)--;
+    }
+}
+
+
+
+/**********************************************************************************/
+// Drops extents past first nblk blocks of file, freeing their blocks. Trailing
+// holes are dropped as well.
+/**********************************************************************************/
+static void pfs_ext_cut(struct pfs *fs, struct pfs_inode *ip, __u32 nblk)
+{
+    struct d_extent *e = ip->ext;
+    __u32 i, n = 0, pos = 0, len, keep;
+
+    for (i = 0; i < ip->di.i_nextents; i++) {
+	len = e[i].e_len;
+	keep = pos < nblk ? nblk - pos : 0;
+	if (keep < len) {
+	    if (e[i].e_start)
+		pfs_free_blk(fs, e[i].e_start + keep, len - keep);
+	    e[i].e_len = keep;
+	}
+	if (e[i].e_start && e[i].e_len)
+	    n = i + 1;
+	pos += len;
+    }
+    ip->di.i_nextents = n;
+    ip->dirty = 1;
+}
+
+
+
+/**********************************************************************************/
+// Maps file block lblk to *phys, 0 - hole. With create, hole or block past the end
+// gets a new block near the previous one of file and *new is set.
+/**********************************************************************************/
+static int pfs_bmap(struct pfs *fs, struct pfs_inode *ip, __u32 lblk, int create, __u32 *phys, int *new)
+{
+    struct d_extent *e;
+    __u32 n = ip->di.i_nextents, i, pos = 0, goal = 0, off, blk, k = 0;
+    struct d_extent split[3];
+    int rc;
+
+    *phys = 0;
+    *new = 0;
+    for (i = 0; i < n; i++) {
+	if (lblk < pos + ip->ext[i].e_len)
+	    break;
+	pos += ip->ext[i].e_len;
+	if (ip->ext[i].e_start)
+	    goal = ip->ext[i].e_start + ip->ext[i].e_len;
+    }
+    if (i < n && ip->ext[i].e_start) {
+	*phys = ip->ext[i].e_start + lblk - pos;
+	return 0;
+    }
+    if (!create)
+	return 0;
+    if (n + 2 > fs->max_extents)
+	return -EFBIG;
+    rc = pfs_ext_room(ip, n + 2);
+    if (rc)
+	return rc;
+    blk = pfs_alloc_blk(fs, goal);
+    if (!blk)
+	return -ENOSPC;
+    e = ip->ext;
+
+    if (i < n) {
+	// Hole is split around the new block
+	off = lblk - pos;
+	if (off) {
+	    split[k].e_start = 0;
+	    split[k++].e_len = off;
+	}
+	split[k].e_start = blk;
+	split[k++].e_len = 1;
+	if (e[i].e_len - off - 1) {
+	    split[k].e_start = 0;
+	    split[k++].e_len = e[i].e_len - off - 1;
+	}
+	memmove(e + i + k, e + i + 1, (n - i - 1)*sizeof(struct d_extent));
+	memcpy(e + i, split, k*sizeof(struct d_extent));
+	ip->di.i_nextents = n + k - 1;
+	i += off ? 1 : 0;
+    } else {
+	// Gap past the end becomes a hole
+	if (lblk > pos) {
+	    e[n].e_start = 0;
+	    e[n++].e_len = lblk - pos;
+	}
+	e[n].e_start = blk;
+	e[n++].e_len = 1;
+	ip->di.i_nextents = n;
+	i = n - 1;
+    }
+    pfs_ext_merge(ip, i);
+    ip->dirty = 1;
+    *phys = blk;
+    *new = 1;
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Returns loaded live inode
+/**********************************************************************************/
+static int pfs_iget(struct pfs *fs, __u32 ino, struct pfs_inode **ip)
+{
+    int rc;
+
+    if (ino <= FS_ROOT_INO || FS_INO_SLOT(ino) >= fs->sb.s_nnodes || !fs->names[FS_INO_SLOT(ino)])
+	return -ENOENT;
+    rc = pfs_load_inode(fs, FS_INO_SLOT(ino), ip);
+    if (rc)
+	return rc;
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Reads inode of slot with its extents, once per handle
+/**********************************************************************************/
+static int pfs_load_inode(struct pfs *fs, __u32 slot, struct pfs_inode **ip)
+{
+    struct pfs_inode *i;
+    struct pfs_buf *b;
+    int rc = 0;
+
+    pthread_mutex_lock(&fs->ilock);
+    if (fs->inodes[slot]) {
+	*ip = fs->inodes[slot];
+	goto out;
+    }
+    i = calloc(1, sizeof(struct pfs_inode));
+    if (!i) {
+	rc = -ENOMEM;
+	goto out;
+    }
+    b = pfs_bread(fs, FS_INO_BLK + slot/fs->ino_per_blk);
+    if (!b) {
+	free(i);
+	rc = -EIO;
+	goto out;
+    }
+    memcpy(&i->di, b->data + (slot%fs->ino_per_blk)*sizeof(struct d_ino), sizeof(struct d_ino));
+    pfs_brelse(fs, b);
+
+    if (!fs->names[slot] || (i->di.i_flags & FS_INLINE_DATA))
+	i->di.i_nextents = 0;
+    if (i->di.i_nextents > fs->max_extents)
+	i->di.i_nextents = fs->max_extents;
+    rc = pfs_ext_room(i, i->di.i_nextents);
+    if (!rc && i->di.i_nextents)
+	rc = pfs_read_ext(fs, &i->di, i->ext, 0);
+    if (rc) {
+	free(i->ext);
+	free(i);
+	goto out;
+    }
+    fs->inodes[slot] = *ip = i;
+out:
+    pthread_mutex_unlock(&fs->ilock);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Writes inode to its inode table slot
+/**********************************************************************************/
+static int pfs_put_inode(struct pfs *fs, __u32 slot, struct pfs_inode *ip)
+{
+    struct pfs_buf *b;
+    int rc = 0;
+
+    if (!(ip->di.i_flags & FS_INLINE_DATA))
+	rc = pfs_write_ext(fs, ip);
+    if (rc)
+	return rc;
+    b = pfs_bread(fs, FS_INO_BLK + slot/fs->ino_per_blk);
+    if (!b)
+	return -EIO;
+    memcpy(b->data + (slot%fs->ino_per_blk)*sizeof(struct d_ino), &ip->di, sizeof(struct d_ino));
+    b->dirty = 1;
+    pfs_brelse(fs, b);
+    ip->dirty = 0;
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Brings inode table blocks up to the one holding slot into use, as
+// fs_itable_extend() does
+/**********************************************************************************/
+static int pfs_itable_extend(struct pfs *fs, __u32 slot)
+{
+    struct pfs_buf *b;
+
+    while (slot/fs->ino_per_blk >= fs->sb.s_itable_init) {
+	b = pfs_getblk(fs, FS_INO_BLK + fs->sb.s_itable_init);
+	if (!b)
+	    return -EIO;
+	memset(b->data, 0, fs->bsize);
+	b->uptodate = b->dirty = 1;
+	pfs_brelse(fs, b);
+	fs->sb.s_itable_init++;
+    }
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Moves inline data to first block of file, as fs_inline_to_blocks() does
+/**********************************************************************************/
+static int pfs_inline_to_blocks(struct pfs *fs, struct pfs_inode *ip)
+{
+    char data[FS_INLINE_LEN];
+    struct pfs_buf *b;
+    __u32 phys;
+    int rc = 0, new, n = ip->di.i_size < FS_INLINE_LEN ? ip->di.i_size : FS_INLINE_LEN;
+
+    memcpy(data, ip->di.i_ext, FS_INLINE_LEN);
+    memset(ip->di.i_ext, 0, sizeof(ip->di.i_ext));
+    ip->di.i_flags &= ~FS_INLINE_DATA;
+    ip->di.i_nextents = 0;
+    if (!ip->di.i_size)
+	return 0;
+    rc = pfs_bmap(fs, ip, 0, 1, &phys, &new);
+    if (!rc) {
+	b = pfs_getblk(fs, phys);
+	if (b) {
+	    memset(b->data, 0, fs->bsize);
+	    memcpy(b->data, data, n);
+	    b->uptodate = b->dirty = 1;
+	    pfs_brelse(fs, b);
+	} else
+	    rc = -EIO;
+    }
+    if (rc) {
+	if (ip->di.i_nextents)
+	    pfs_free_blk(fs, ip->ext[0].e_start, 1);
+	ip->di.i_nextents = 0;
+	memcpy(ip->di.i_ext, data, FS_INLINE_LEN);
+	ip->di.i_flags |= FS_INLINE_DATA;
+    }
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Frees blocks and slot of inode, on-disk inode is cleared as fs_delete_inode()
+// does
+/**********************************************************************************/
+static void pfs_inode_free(struct pfs *fs, __u32 slot, struct pfs_inode *ip)
+{
+    __u32 i;
+
+    if (ip->di.i_flags & FS_INLINE_DATA)
+	memset(ip->di.i_ext, 0, sizeof(ip->di.i_ext));
+    for (i = 0; i < ip->di.i_nextents; i++)
+	if (ip->ext[i].e_start)
+	    pfs_free_blk(fs, ip->ext[i].e_start, ip->ext[i].e_len);
+    ip->di.i_nextents = 0;
+    ip->di.i_flags &= ~FS_INLINE_DATA;
+    pfs_write_ext(fs, ip);
+    if (ip->di.i_name_blk)
+	pfs_free_blk(fs, ip->di.i_name_blk, 1);
+    ip->di.name[0] = 0;
+    ip->di.i_nlinks = 0;
+    ip->di.i_name_blk = 0;
+    ip->dirty = 1;
+    pfs_name_del(fs, slot);
+    fs->free_inodes++;
+}
+
+
+
+/**********************************************************************************/
+// Returns name of on-disk inode in allocated string
+/**********************************************************************************/
+static char *pfs_dname(struct pfs *fs, struct d_ino *di)
+{
+    struct pfs_buf *b;
+    char *name;
+
+    name = malloc(di->i_name_len + 1);
+    if (!name)
+	return NULL;
+    if (di->i_name_len <= FS_FNAME_LEN)
+	memcpy(name, di->name, di->i_name_len);
+    else {
+	b = pfs_bread(fs, di->i_name_blk);
+	if (!b) {
+	    free(name);
+	    return NULL;
+	}
+	memcpy(name, b->data, di->i_name_len);
+	pfs_brelse(fs, b);
+    }
+    name[di->i_name_len] = 0;
+    return name;
+}
+
+
+
+/**********************************************************************************/
+// Fills name fields of on-disk inode as fs_set_dname() does
+/**********************************************************************************/
+static void pfs_set_dname(struct d_ino *di, const char *name, int len, __u32 name_blk)
+{
+    memset(di->name, 0, FS_FNAME_LEN);
+    memcpy(di->name, name, len < FS_FNAME_LEN ? len : FS_FNAME_LEN);
+    di->i_name_len = len;
+    di->i_name_hash = fs_name_hash(name, len);
+    di->i_name_blk = name_blk;
+}
+
+
+
+/**********************************************************************************/
+// Writes name longer than FS_FNAME_LEN to a new name block. Returns the block,
+// 0 for short names or error.
+/**********************************************************************************/
+static int pfs_write_name(struct pfs *fs, const char *name, int len)
+{
+    struct pfs_buf *b;
+    __u32 blk;
+
+    if (len <= FS_FNAME_LEN)
+	return 0;
+    blk = pfs_alloc_blk(fs, 0);
+    if (!blk)
+	return -ENOSPC;
+    b = pfs_getblk(fs, blk);
+    if (!b) {
+	pfs_free_blk(fs, blk, 1);
+	return -EIO;
+    }
+    memset(b->data, 0, fs->bsize);
+    memcpy(b->data, name, len);
+    b->uptodate = b->dirty = 1;
+    pfs_brelse(fs, b);
+    return blk;
+}
+
+
+
+/**********************************************************************************/
+// Returns slot of name or -1
+/**********************************************************************************/
+static int pfs_name_find(struct pfs *fs, const char *name, int len)
+{
+    __u32 i;
+
+    if (len > FS_NAME_MAX)
+	return -1;
+    for (i = fs->name_head[fs_name_hash(name, len) & fs->name_mask]; i; i = fs->name_next[i - 1])
+	if (!strncmp(fs->names[i - 1], name, len) && !fs->names[i - 1][len])
+	    return i - 1;
+    return -1;
+}
+
+
+
+/**********************************************************************************/
+// Puts allocated name of slot to name index
+/**********************************************************************************/
+static void pfs_name_add(struct pfs *fs, __u32 slot, char *name)
+{
+    __u32 *head = &fs->name_head[fs_name_hash(name, strlen(name)) & fs->name_mask];
+
+    fs->names[slot] = name;
+    fs->name_next[slot] = *head;
+    *head = slot + 1;
+}
+
+
+
+/**********************************************************************************/
+static void pfs_name_del(struct pfs *fs, __u32 slot)
+{
+    char *name = fs->names[slot];
+    __u32 *p = &fs->name_head[fs_name_hash(name, strlen(name)) & fs->name_mask];
+
+    for (; *p != slot + 1; p = &fs->name_next[*p - 1]);
+    *p = fs->name_next[slot];
+    free(name);
+    fs->names[slot] = NULL;
+}
+
+
+
+/**********************************************************************************/
+// Releases everything handle holds, image is not written
+/**********************************************************************************/
+static void pfs_free(struct pfs *fs)
+{
+    struct pfs_shard *sh;
+    struct pfs_buf *b, *next;
+    __u32 i;
+
+    for (i = 0; i < PFS_CACHE_SHARDS; i++) {
+	sh = &fs->shard[i];
+	for (b = sh->lru.next; b != &sh->lru; b = next) {
+	    next = b->next;
+	    free(b);
+	}
+	free(sh->hash);
+	pthread_mutex_destroy(&sh->lock);
+    }
+    pthread_mutex_destroy(&fs->ilock);
+    for (i = 0; fs->names && i < fs->sb.s_nnodes; i++)
+	free(fs->names[i]);
+    for (i = 0; fs->inodes && i < fs->sb.s_nnodes; i++)
+	if (fs->inodes[i]) {
+	    free(fs->inodes[i]->ext);
+	    free(fs->inodes[i]);
+	}
+    free(fs->names);
+    free(fs->inodes);
+    free(fs->name_next);
+    free(fs->name_head);
+    free(fs->bm);
+    if (fs->fd >= 0)
+	close(fs->fd);
+    free(fs);
+}
@@ -0,0 +1,75 @@
+/*
+ * libplainfs.h - reads and writes PlainFS images from userspace
+ *
+ * This file is released under the GPL.
+ *
+ * Image is opened with pfs_open() and all calls take the returned handle.
+ * Errors are returned as negative errno values, as in the kernel module.
+ * Calls that only read (pfs_lookup, pfs_stat, pfs_read, pfs_map, pfs_readdir,
+ * pfs_statfs) may run in parallel on a handle, any other call needs the handle
+ * to itself.
+ */
+
+#ifndef LIBPLAINFS_H
+#define LIBPLAINFS_H
+
+#include <sys/types.h>
+#include "plainfs.h"
+
+#define PFS_RDONLY	0x1	// pfs_open(): image is never written
+#define PFS_CACHE_BLOCKS 1024	// blocks kept by block cache
+#define PFS_CACHE_SHARDS 16	// block cache parts with own lock
+
+struct pfs;
+
+/*
+ * file attributes
+ */
+struct pfs_stat {
+    __u32 ino;
+    __u16 mode;
+    __u8 uid;
+    __u8 gid;
+    __u32 time;			// modification time
+    __u64 size;
+    __u32 blocks;		// blocks holding file data
+};
+
+/*
+ * file system totals, as fs_statfs() reports them
+ */
+struct pfs_statfs {
+    __u32 bsize;
+    __u32 blocks;		// data zone
+    __u32 bfree;
+    __u32 files;		// inode table slots
+    __u32 ffree;
+    __u32 namelen;
+};
+
+/*
+ * part of file in image, see pfs_map()
+ */
+struct pfs_seg {
+    __u64 pos;			// image offset, 0 - hole
+    __u64 len;
+};
+
+struct pfs *pfs_open(const char *path, int flags, int *err);
+int pfs_close(struct pfs *fs);
+int pfs_sync(struct pfs *fs);
+int pfs_lookup(struct pfs *fs, const char *name);
+int pfs_stat(struct pfs *fs, __u32 ino, struct pfs_stat *st);
+int pfs_setattr(struct pfs *fs, __u32 ino, const struct pfs_stat *st);
+int pfs_create(struct pfs *fs, const char *name, int mode);
+ssize_t pfs_read(struct pfs *fs, __u32 ino, void *buf, size_t len, __u64 off);
+int pfs_map(struct pfs *fs, __u32 ino, __u64 off, size_t len, struct pfs_seg *seg, int nseg);
+ssize_t pfs_write(struct pfs *fs, __u32 ino, const void *buf, size_t len, __u64 off);
+int pfs_truncate(struct pfs *fs, __u32 ino, __u64 size);
+int pfs_unlink(struct pfs *fs, const char *name);
+int pfs_rename(struct pfs *fs, const char *name, const char *new_name);
+int pfs_readdir(struct pfs *fs, __u32 *pos, char *name, __u32 *ino);
+int pfs_statfs(struct pfs *fs, struct pfs_statfs *st);
+int pfs_fd(struct pfs *fs);
+
+#endif
@@ -6,27 +6,73 @@
  * This file is released under the GPL.
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
 #include <mntent.h>
 #include <linux/fs.h>
 #include "plainfs.h"
 
 #define MKFS_VER "0.2"
 #define MKFS_NAME "mkfs.plainfs"
+#define BLOCKS_PER_INODE 4	// data blocks per inode
+#define JOURNAL_SHARE 256	// default journal is one block per JOURNAL_SHARE blocks of device
+#define JOURNAL_DEF_MIN 16	// limits of default journal size
+#define JOURNAL_DEF_MAX 1024
+#define WRITE_CHUNK (1 << 20)	// bytes per write when zeroing tables
+#define COPY_CHUNK (1 << 20)	// bytes per read and write of -d files without copy_file_range()
+#define COPY_THREADS_MAX 8	// threads copying -d files
+
+/*
+ * file copied into image by -d
+ */
+struct src_file {
+    char *name;
+    int len;
+    struct stat st;
+    unsigned int name_blk;	// block holding long name, 0 - none
+    unsigned int blk;		// first block of data run, 0 - inline data
+    unsigned int nblk;
+};
 
 void die(const char *, ...);
 void show_usage();
 void check_mount();
 void write_tables();
-void create_file(int, char *, int);
+void write_zeros(unsigned int, unsigned int, const char *);
+void trim_data();
+void scan_dir();
+int file_cmp(const void *, const void *);
+void layout_files();
+void write_files();
+void *copy_thread(void *);
+void copy_file(struct src_file *);
+int open_file(struct src_file *);
+ssize_t read_file(struct src_file *, char *, size_t);
 
 int fd = -1;
+int bsize = FS_BSIZE;	// block size, -b option
+int njournal = 0;	// journal blocks, -j option, 0 - default
+int lazy = 0;		// inode table is left unwritten, -l option
+int trim = 0;		// data zone is discarded, -t option
+char *zero_buf;		// WRITE_CHUNK zero bytes
+char *src_dir;		// files are copied from it, -d option
+struct src_file *files;	// files of src_dir in name order
+int nfiles;
+int next_file;		// next file for copy threads
+pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
 struct stat dev_stat;
 char dev_name[100];
-char die_buf[100];
 struct d_sb s;
 
 
@@ -35,15 +81,42 @@ struct d_sb s;
 int main(int argc, char *argv[])
 {
     int rc;
-    long size;
 
     //printf("argc: %d\n", argc);
-    if (argc != 2) {
+    while ((rc = getopt(argc, argv, "b:d:j:lt")) != -1) {
+	switch (rc) {
+	case 'b':
+	    bsize = atoi(optarg);
+	    break;
+	case 'd':
+	    src_dir = optarg;
+	    break;
+	case 'j':
+	    njournal = atoi(optarg);
+	    if (njournal < FS_JOURNAL_MIN)
+		die("journal must have at least %d blocks", FS_JOURNAL_MIN);
+	    break;
+	case 'l':
+	    lazy = 1;
+	    break;
+	case 't':
+	    trim = 1;
+	    break;
+	default:
+	    show_usage();
+	    return 0;
+	}
+    }
+    if (optind != argc - 1) {
 	show_usage();
 	return 0;
     }
+    if (bsize < FS_BSIZE || bsize > 1 << FS_MAX_BSIZE_BITS || (bsize & (bsize - 1)))
+	die("block size must be a power of 2 from %d to %d", FS_BSIZE, 1 << FS_MAX_BSIZE_BITS);
 
-    strcpy(dev_name, argv[1]);
+    strcpy(dev_name, argv[optind]);
+    if (src_dir)
+	scan_dir();
 
     //check_mount();
     fd = open(dev_name, O_RDWR);
@@ -52,24 +125,57 @@ int main(int argc, char *argv[])
     if (fstat(fd, &dev_stat) < 0)
 	die("unable to stat '%s'", dev_name);
 
-    int nblocks = dev_stat.st_size/FS_BSIZE; // total blocks in file
+    unsigned long long dev_size = dev_stat.st_size;
+    if (S_ISBLK(dev_stat.st_mode) && ioctl(fd, BLKGETSIZE64, &dev_size) < 0)
+	die("unable to get size of '%s'", dev_name);
+    if (dev_size/bsize > 0xffffffffULL)
+	dev_size = 0xffffffffULL*bsize;
+    unsigned int nblocks = dev_size/bsize; // total blocks in file
     // last lost incomplete block
-    int nbytes_l = dev_stat.st_size - FS_BSIZE*nblocks;
+    int nbytes_l = dev_size - (unsigned long long)bsize*nblocks;
     // inodes per block
-    float ino_p_blk = (float)FS_BSIZE/sizeof(struct d_ino);
-    // size on inode table in blocks
-    int nino_zone = nblocks/(ino_p_blk + 1);
-    int nino = nino_zone*ino_p_blk; // number of inodes
-    int nblocks_l = nblocks - nino_zone - nino; // lost blocks
-    printf("Block size: %d\n", FS_BSIZE);
-    printf("Device size: %d(%.2f Mb), nblocks: %d, lost bytes: %d\n", dev_stat.st_size, (float)dev_stat.st_size/1024/1024, nblocks, nbytes_l);
-    printf("Inode size: %d, inodes per block: %f\n", sizeof(struct d_ino), ino_p_blk);
-    printf("Inodes: %d(%d blocks), data zone: %d\n", nino, nino_zone, nblocks - nino_zone);
-    printf("Lost blocks: %d\n", nblocks_l);
-
+    int ino_p_blk = FS_INO_PER_BLK(bsize);
+    // size on inode table in blocks, one inode per BLOCKS_PER_INODE data blocks
+    unsigned int nino_zone = (nblocks - FS_INO_BLK)/(ino_p_blk*BLOCKS_PER_INODE + 1) + 1;
+    unsigned int nino = nino_zone*ino_p_blk; // number of inodes
+    if (!njournal) {
+	njournal = nblocks/JOURNAL_SHARE;
+	if (njournal < JOURNAL_DEF_MIN)
+	    njournal = JOURNAL_DEF_MIN;
+	if (njournal > JOURNAL_DEF_MAX)
+	    njournal = JOURNAL_DEF_MAX;
+    }
+    if (nblocks < FS_INO_BLK + nino_zone + njournal + 2)
+	die("'%s' is too small", dev_name);
+    // the rest goes to bitmap and data zone
+    unsigned int nbmap_zone = (nblocks - FS_INO_BLK - nino_zone - njournal + bsize*8 - 1)/(bsize*8);
+    if (nblocks < FS_INO_BLK + nino_zone + nbmap_zone + njournal + 1)
+	die("'%s' is too small", dev_name);
+    unsigned int ndata = nblocks - FS_INO_BLK - nino_zone - nbmap_zone - njournal;
+    printf("Block size: %d\n", bsize);
+    printf("Device size: %llu(%.2f Mb), nblocks: %u, lost bytes: %d\n", dev_size, (float)dev_size/1024/1024, nblocks, nbytes_l);
+    printf("Inode size: %zu, inodes per block: %d\n", sizeof(struct d_ino), ino_p_blk);
+    printf("Inodes: %u(%u blocks), bitmap: %u blocks, journal: %u blocks, data zone: %u\n",
+	nino, nino_zone, nbmap_zone, njournal, ndata);
+
+    s.s_rev = FS_REV;
     s.s_nnodes = nino;
     s.s_nblocks = nblocks;
-    sprintf(s.s_magic, "plainfs superblock");
+    s.s_bmap_blk = FS_INO_BLK + nino_zone;
+    s.s_journal_blk = s.s_bmap_blk + nbmap_zone;
+    s.s_journal_len = njournal;
+    s.s_itable_init = lazy ? 0 : nino_zone;
+    s.s_data_blk = s.s_journal_blk + njournal;
+    s.s_ndata = ndata;
+    s.s_free_blocks = ndata;
+    s.s_free_inodes = nino;
+    s.s_state = FS_STATE_CLEAN;
+    for (s.s_bsize_bits = FS_BSIZE_BITS; 1 << s.s_bsize_bits < bsize; s.s_bsize_bits++);
+    sprintf(s.s_magic, FS_MAGIC_STR);
+    if (src_dir) {
+	layout_files();
+	printf("Files: %d, data blocks: %u\n", nfiles, s.s_ndata - s.s_free_blocks);
+    }
     write_tables();
 
     close(fd);
@@ -82,12 +188,13 @@ int main(int argc, char *argv[])
 void die(const char *format, ...)
 {
     va_list arg;
+    char buf[PATH_MAX + 100];	// copy threads may fail at once
     
     va_start(arg, format);
-    vsprintf(die_buf, format, arg);
+    vsnprintf(buf, sizeof(buf), format, arg);
     va_end(arg);
 
-    fprintf(stderr, MKFS_NAME": %s\n", die_buf);
+    fprintf(stderr, MKFS_NAME": %s\n", buf);
     if (-1 != fd)
 	close(fd);
     exit(-1);
@@ -99,7 +206,10 @@ void die(const char *format, ...)
 void show_usage()
 {
     printf(MKFS_NAME " (version "MKFS_VER")\n");
-    printf("Usage: " MKFS_NAME " /dev/name\n");
+    printf("Usage: " MKFS_NAME " [-b block_size] [-j journal_blocks] [-l] [-t] [-d directory] /dev/name\n");
+    printf("  -l  leave inode table unwritten, its blocks are cleared as inodes are created\n");
+    printf("  -t  discard data zone (punch it out of an image file)\n");
+    printf("  -d  copy regular files of directory into file system\n");
 }
 
 
@@ -125,60 +235,363 @@ void check_mount()
 
 
 /***********************************************************/
+// Tables are zeroed with large writes: free inodes, free blocks and an empty
+// journal are all zero bytes. Data zone is not written at all. Superblock goes
+// last, so that an interrupted mkfs leaves no file system behind.
 void write_tables()
 {
-    int i, i_cnt;
-    char buf[FS_BSIZE];
+    char buf[1 << FS_MAX_BSIZE_BITS];
     struct d_sb *sb = (struct d_sb*)buf;
-    struct d_ino di;
+    struct d_jhead *jh = (struct d_jhead *)buf;
+
+    zero_buf = calloc(1, WRITE_CHUNK);
+    if (!zero_buf)
+	die("out of memory");
+
+    // Writing inode table, lazy one is left as it is
+    if (!lazy)
+	write_zeros(FS_INO_BLK, s.s_bmap_blk - FS_INO_BLK, "inode table");
+
+    // Writing empty block bitmap and journal
+    write_zeros(s.s_bmap_blk, s.s_data_blk - s.s_bmap_blk, "bitmap");
+
+    // Replay starts with sequence 1 at first journal block
+    memset(buf, 0, bsize);
+    jh->j_magic = FS_JOURNAL_MAGIC;
+    jh->j_seq = 1;
+    jh->j_start = 0;
+    if (bsize != pwrite(fd, buf, bsize, (off_t)s.s_journal_blk*bsize))
+	die("unable to write journal header");
+
+    if (trim)
+	trim_data();
+    if (src_dir)
+	write_files();
+    if (fsync(fd) < 0)
+	die("unable to write '%s'", dev_name);
 
     // Writing superblock
-    memset(buf, 0, FS_BSIZE);
+    memset(buf, 0, bsize);
     *sb = s;
-    if (FS_BSIZE != write(fd, buf, FS_BSIZE))
+    if (bsize != pwrite(fd, buf, bsize, 0) || fsync(fd) < 0)
 	die("unable to write superblock");
+    free(zero_buf);
+}
+
+
 
-    // Writing inode table
-    memset(&di, 0, sizeof(di));
-    di.i_nlinks = 0;
-    for (i=0; i < s.s_nnodes; i++) {
-	sprintf(di.name, "ino%05d", i);
-	write(fd, &di, sizeof(di));
+/***********************************************************/
+// Zeroes n blocks from blk on, WRITE_CHUNK bytes at a time
+void write_zeros(unsigned int blk, unsigned int n, const char *what)
+{
+    off_t pos = (off_t)blk*bsize, end = pos + (off_t)n*bsize;
+    ssize_t len;
+
+    while (pos < end) {
+	len = end - pos < WRITE_CHUNK ? end - pos : WRITE_CHUNK;
+	if (len != pwrite(fd, zero_buf, len, pos))
+	    die("unable to write %s at block %llu", what, (unsigned long long)pos/bsize);
+	pos += len;
     }
-    
-    // Writing data area
-    memset(buf, 0, FS_BSIZE);
-    lseek(fd, SEEK_SET, (1 + s.s_nnodes/sizeof(di))*FS_BSIZE);
-    for (i=0; i < s.s_nnodes; i++) {
-	sprintf(buf, "block%05d", i);
-	if (FS_BSIZE != write(fd, buf, FS_BSIZE))
-	    die("unable to write block %d", i+1);
+}
+
+
+
+/***********************************************************/
+// Tells device that data zone holds nothing: BLKDISCARD for a block device,
+// punched hole for an image file. Data zone is never read before being written,
+// so failure only costs the space.
+void trim_data()
+{
+    unsigned long long range[2];
+    int rc;
+
+    range[0] = (unsigned long long)s.s_data_blk*bsize;
+    range[1] = (unsigned long long)s.s_ndata*bsize;
+    if (S_ISBLK(dev_stat.st_mode))
+	rc = ioctl(fd, BLKDISCARD, range);
+    else
+	rc = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, range[0], range[1]);
+    if (rc < 0)
+	printf("Data zone was not discarded\n");
+}
+
+
+
+/***********************************************************/
+// Collects regular files of src_dir in name order. Other entries
+// are skipped, file system has no directories.
+void scan_dir()
+{
+    DIR *d;
+    struct dirent *de;
+    struct src_file *f;
+    int max = 0, dfd;
+
+    d = opendir(src_dir);
+    if (!d)
+	die("unable to open directory '%s'", src_dir);
+    dfd = dirfd(d);
+    while ((de = readdir(d)) != NULL) {
+	if (nfiles == max) {
+	    max = max ? max*2 : 64;
+	    files = realloc(files, max*sizeof(struct src_file));
+	    if (!files)
+		die("out of memory");
+	}
+	f = &files[nfiles];
+	memset(f, 0, sizeof(*f));
+	if (fstatat(dfd, de->d_name, &f->st, AT_SYMLINK_NOFOLLOW) < 0)
+	    die("unable to stat '%s'", de->d_name);
+	if (!S_ISREG(f->st.st_mode)) {
+	    if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+		printf("Skipping '%s', not a regular file\n", de->d_name);
+	    continue;
+	}
+	f->len = strlen(de->d_name);
+	if (f->len > FS_NAME_MAX) {
+	    printf("Skipping '%s', name is too long\n", de->d_name);
+	    continue;
+	}
+	f->name = strdup(de->d_name);
+	if (!f->name)
+	    die("out of memory");
+	nfiles++;
     }
-    if (s.s_nblocks - 1 > s.s_nnodes) {
-	sprintf(buf, "unused tail");
-	write(fd, buf, FS_BSIZE);
+    closedir(d);
+    qsort(files, nfiles, sizeof(struct src_file), file_cmp);
+}
+
+
+
+/***********************************************************/
+int file_cmp(const void *a, const void *b)
+{
+    return strcmp(((struct src_file *)a)->name, ((struct src_file *)b)->name);
+}
+
+
+
+/***********************************************************/
+// Places files at the start of data zone: name blocks of long
+// names first, then data of each file as one run, in name order.
+// Files up to FS_INLINE_LEN bytes stay inline.
+void layout_files()
+{
+    unsigned long long need = 0;
+    unsigned int next = s.s_data_blk;
+    int i;
+
+    if (nfiles > s.s_nnodes)
+	die("%d files do not fit in %u inodes", nfiles, s.s_nnodes);
+    for (i=0; i < nfiles; i++) {
+	need += files[i].len > FS_FNAME_LEN;
+	if (files[i].st.st_size > FS_INLINE_LEN)
+	    need += (files[i].st.st_size + bsize - 1)/bsize;
+    }
+    if (need > s.s_ndata)
+	die("files need %llu blocks, data zone has %u", need, s.s_ndata);
+
+    for (i=0; i < nfiles; i++)
+	if (files[i].len > FS_FNAME_LEN)
+	    files[i].name_blk = next++;
+    for (i=0; i < nfiles; i++)
+	if (files[i].st.st_size > FS_INLINE_LEN) {
+	    files[i].blk = next;
+	    files[i].nblk = (files[i].st.st_size + bsize - 1)/bsize;
+	    next += files[i].nblk;
+	}
+    s.s_free_blocks -= need;
+    s.s_free_inodes -= nfiles;
+    if (lazy)
+	s.s_itable_init = (nfiles + FS_INO_PER_BLK(bsize) - 1)/FS_INO_PER_BLK(bsize);
+}
+
+
+
+/***********************************************************/
+// Writes files laid out by layout_files(): data is copied by
+// copy threads while inode table, name blocks and bitmap are
+// written here
+void write_files()
+{
+    pthread_t threads[COPY_THREADS_MAX];
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN), i, n;
+    unsigned int ino_p_blk = FS_INO_PER_BLK(bsize), used, len;
+    size_t size;
+    char *buf;
+    struct d_ino *di;
+    struct src_file *f;
+
+    if (nthreads < 1)
+	nthreads = 1;
+    if (nthreads > COPY_THREADS_MAX)
+	nthreads = COPY_THREADS_MAX;
+    if (nthreads > nfiles)
+	nthreads = nfiles;
+    for (n=0; n < nthreads; n++)
+	if (pthread_create(&threads[n], NULL, copy_thread, NULL))
+	    break;
+    if (!n)
+	copy_thread(NULL);
+
+    // Inode table, inline data is read here
+    size = (size_t)((nfiles + ino_p_blk - 1)/ino_p_blk)*bsize;
+    buf = calloc(1, size + bsize);
+    if (!buf)
+	die("out of memory");
+    for (i=0; i < nfiles; i++) {
+	f = &files[i];
+	di = (struct d_ino *)buf + i;
+	memcpy(di->name, f->name, f->len < FS_FNAME_LEN ? f->len : FS_FNAME_LEN);
+	di->i_name_len = f->len;
+	di->i_name_hash = fs_name_hash(f->name, f->len);
+	di->i_name_blk = f->name_blk;
+	di->i_ino = FS_SLOT_INO(i);
+	di->i_mode = f->st.st_mode;
+	di->i_nlinks = 1;
+	di->i_uid = f->st.st_uid;
+	di->i_gid = f->st.st_gid;
+	di->i_time = f->st.st_mtime;
+	di->i_size = f->st.st_size;
+	if (f->blk) {
+	    di->i_nextents = 1;
+	    di->i_ext[0].e_start = f->blk;
+	    di->i_ext[0].e_len = f->nblk;
+	} else {
+	    di->i_flags = FS_INLINE_DATA;
+	    if (f->st.st_size && read_file(f, (char *)di->i_ext, f->st.st_size) < 0)
+		die("unable to read '%s'", f->name);
+	}
+    }
+    if (size && (ssize_t)size != pwrite(fd, buf, size, (off_t)FS_INO_BLK*bsize))
+	die("unable to write inode table");
+    free(buf);
+
+    // Name blocks
+    buf = calloc(1, bsize);
+    if (!buf)
+	die("out of memory");
+    for (i=0; i < nfiles; i++) {
+	if (!files[i].name_blk)
+	    continue;
+	memset(buf, 0, bsize);
+	memcpy(buf, files[i].name, files[i].len);
+	if (bsize != pwrite(fd, buf, bsize, (off_t)files[i].name_blk*bsize))
+	    die("unable to write name of '%s'", files[i].name);
+    }
+    free(buf);
+
+    // Bitmap, blocks in use are the first ones of data zone
+    used = s.s_ndata - s.s_free_blocks;
+    len = (used + 8*bsize - 1)/(8*bsize)*bsize;
+    buf = calloc(1, len + 1);
+    if (!buf)
+	die("out of memory");
+    memset(buf, 0xff, used/8);
+    for (i=used & ~7; i < used; i++)
+	buf[i >> 3] |= 1 << (i & 7);
+    if (len && len != pwrite(fd, buf, len, (off_t)s.s_bmap_blk*bsize))
+	die("unable to write bitmap");
+    free(buf);
+
+    while (n-- > 0)
+	pthread_join(threads[n], NULL);
+}
+
+
+
+/***********************************************************/
+// Takes files one by one and copies their data into their runs
+void *copy_thread(void *arg)
+{
+    int i;
+
+    for (;;) {
+	pthread_mutex_lock(&files_lock);
+	i = next_file++;
+	pthread_mutex_unlock(&files_lock);
+	if (i >= nfiles)
+	    return NULL;
+	if (files[i].blk)
+	    copy_file(&files[i]);
     }
+}
+
+
 
-    // Creating files
-    //create_file(fd, "file0", 0);
-    //create_file(fd, "file1", 1);
+/***********************************************************/
+// Copies file into its run with copy_file_range(), falling back
+// to reads and writes of COPY_CHUNK bytes when file systems do not
+// support it. Rest of the last block is zeroed.
+void copy_file(struct src_file *f)
+{
+    off_t in = 0, out = (off_t)f->blk*bsize, end = (off_t)f->nblk*bsize;
+    ssize_t n = 0, len;
+    char *buf = NULL;
+    int src;
+
+    src = open_file(f);
+    while (in < f->st.st_size) {
+	n = copy_file_range(src, &in, fd, &out, f->st.st_size - in, 0);
+	if (n <= 0)
+	    break;
+    }
+    if (n < 0 && (EXDEV == errno || EINVAL == errno || ENOSYS == errno || EOPNOTSUPP == errno)) {
+	buf = malloc(COPY_CHUNK);
+	if (!buf)
+	    die("out of memory");
+	while (in < f->st.st_size) {
+	    len = f->st.st_size - in < COPY_CHUNK ? f->st.st_size - in : COPY_CHUNK;
+	    n = pread(src, buf, len, in);
+	    if (n <= 0)
+		break;
+	    if (n != pwrite(fd, buf, n, out))
+		die("unable to write '%s'", f->name);
+	    in += n;
+	    out += n;
+	}
+	free(buf);
+    }
+    if (n < 0)
+	die("unable to copy '%s'", f->name);
+    close(src);
+
+    // File that shrank while being copied reads zeros past its end
+    out -= (off_t)f->blk*bsize;
+    while (out < end) {
+	len = end - out < WRITE_CHUNK ? end - out : WRITE_CHUNK;
+	if (len != pwrite(fd, zero_buf, len, (off_t)f->blk*bsize + out))
+	    die("unable to write '%s'", f->name);
+	out += len;
+    }
 }
 
 
 
-void create_file(int fd, char *fname, int ino)
+/***********************************************************/
+int open_file(struct src_file *f)
 {
-    struct d_ino di;
-
-    memset(&di, 0, sizeof(di));
-    lseek(fd, FS_INO_BLK*FS_BSIZE + sizeof(di)*ino, SEEK_SET);
-    strcpy(di.name, fname);
-    di.i_ino = FS_ROOT_INO + ino + 1;
-    di.i_mode = 0x100;
-    di.i_size = 555;
-    di.i_nlinks = 1;
-    di.i_data[0] = 1 + s.s_nnodes/FS_INO_PER_BLK + ino*2;
-    di.i_data[1] = di.i_data[0] + 1;
-    //di.i_data[2] = di.i_data[1] + 1;
-    write(fd, &di, sizeof(di));
+    char path[PATH_MAX];
+    int src;
+
+    snprintf(path, sizeof(path), "%s/%s", src_dir, f->name);
+    src = open(path, O_RDONLY);
+    if (src < 0)
+	die("unable to open '%s'", path);
+    return src;
+}
+
+
+
+/***********************************************************/
+ssize_t read_file(struct src_file *f, char *buf, size_t len)
+{
+    ssize_t n;
+    int src;
+
+    src = open_file(f);
+    n = pread(src, buf, len, 0);
+    close(src);
+    return n;
 }
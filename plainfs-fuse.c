@@ -0,0 +1,615 @@
+/*
+ * plainfs-fuse.c - mounts PlainFS image through FUSE
+ *
+ * This file is released under the GPL.
+ *
+ * Image is served through libplainfs with the semantics of the kernel module:
+ * one flat root directory holding regular files. Requests are handled by
+ * several threads, the ones that only read share the image and the ones that
+ * change it hold it alone. File data is spliced from image to /dev/fuse when
+ * kernel allows it, holes and inline data are copied.
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <fuse_lowlevel.h>
+#include "libplainfs.h"
+
+#define PFUSE_NAME "plainfs-fuse"
+#define PFUSE_VER "0.1"
+#define PFUSE_TIMEOUT 1.0	// entry and attribute timeout, seconds
+
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+
+/*
+ * mounted image
+ */
+struct pfuse {
+    struct pfs *fs;
+    pthread_rwlock_t lock;	// read lock for calls only reading image
+    __u32 bsize;
+    __u32 nnodes;		// size of root directory, as fs_read_inode() sets
+    time_t mtime;		// root directory times
+};
+
+static void pfuse_init(void *, struct fuse_conn_info *);
+static void pfuse_destroy(void *);
+static void pfuse_lookup(fuse_req_t, fuse_ino_t, const char *);
+static void pfuse_getattr(fuse_req_t, fuse_ino_t, struct fuse_file_info *);
+static void pfuse_setattr(fuse_req_t, fuse_ino_t, struct stat *, int, struct fuse_file_info *);
+static void pfuse_mknod(fuse_req_t, fuse_ino_t, const char *, mode_t, dev_t);
+static void pfuse_create(fuse_req_t, fuse_ino_t, const char *, mode_t, struct fuse_file_info *);
+static void pfuse_unlink(fuse_req_t, fuse_ino_t, const char *);
+static void pfuse_rename(fuse_req_t, fuse_ino_t, const char *, fuse_ino_t, const char *, unsigned int);
+static void pfuse_open(fuse_req_t, fuse_ino_t, struct fuse_file_info *);
+static void pfuse_read(fuse_req_t, fuse_ino_t, size_t, off_t, struct fuse_file_info *);
+static void pfuse_write(fuse_req_t, fuse_ino_t, const char *, size_t, off_t, struct fuse_file_info *);
+static void pfuse_flush(fuse_req_t, fuse_ino_t, struct fuse_file_info *);
+static void pfuse_fsync(fuse_req_t, fuse_ino_t, int, struct fuse_file_info *);
+static void pfuse_readdir(fuse_req_t, fuse_ino_t, size_t, off_t, struct fuse_file_info *);
+static void pfuse_statfs(fuse_req_t, fuse_ino_t);
+static int pfuse_stat(struct pfuse *, fuse_ino_t, struct stat *);
+static int pfuse_mknod_locked(fuse_req_t, const char *, mode_t, struct fuse_entry_param *);
+static void show_usage(void);
+
+static const struct fuse_lowlevel_ops pfuse_ops = {
+    .init	= pfuse_init,
+    .destroy	= pfuse_destroy,
+    .lookup	= pfuse_lookup,
+    .getattr	= pfuse_getattr,
+    .setattr	= pfuse_setattr,
+    .mknod	= pfuse_mknod,
+    .create	= pfuse_create,
+    .unlink	= pfuse_unlink,
+    .rename	= pfuse_rename,
+    .open	= pfuse_open,
+    .read	= pfuse_read,
+    .write	= pfuse_write,
+    .flush	= pfuse_flush,
+    .fsync	= pfuse_fsync,
+    .readdir	= pfuse_readdir,
+    .statfs	= pfuse_statfs,
+};
+
+
+
+/**********************************************************************************/
+int main(int argc, char *argv[])
+{
+    struct fuse_args args;
+    struct fuse_cmdline_opts opts;
+    struct fuse_session *se = NULL;
+    struct pfs_statfs st;
+    struct pfuse pf;
+    char *image;
+    int err, rc = 1;
+
+    if (argc < 3 || '-' == argv[1][0]) {
+	show_usage();
+	return 1;
+    }
+    // Image goes first, the rest is for FUSE
+    image = argv[1];
+    argv[1] = argv[0];
+    args = (struct fuse_args)FUSE_ARGS_INIT(argc - 1, argv + 1);
+    if (fuse_parse_cmdline(&args, &opts))
+	return 1;
+    if (opts.show_help) {
+	show_usage();
+	fuse_cmdline_help();
+	fuse_lowlevel_help();
+	rc = 0;
+	goto out;
+    }
+    if (!opts.mountpoint) {
+	show_usage();
+	goto out;
+    }
+
+    memset(&pf, 0, sizeof(pf));
+    pf.fs = pfs_open(image, 0, &err);
+    if (!pf.fs) {
+	fprintf(stderr, PFUSE_NAME ": %s: %s\n", image, strerror(-err));
+	goto out;
+    }
+    pthread_rwlock_init(&pf.lock, NULL);
+    pfs_statfs(pf.fs, &st);
+    pf.bsize = st.bsize;
+    pf.nnodes = st.files;
+    pf.mtime = time(NULL);
+
+    se = fuse_session_new(&args, &pfuse_ops, sizeof(pfuse_ops), &pf);
+    if (!se)
+	goto out_close;
+    if (fuse_set_signal_handlers(se))
+	goto out_close;
+    if (fuse_session_mount(se, opts.mountpoint))
+	goto out_signals;
+    fuse_daemonize(opts.foreground);
+    if (opts.singlethread)
+	rc = fuse_session_loop(se);
+    else
+	rc = fuse_session_loop_mt(se, opts.clone_fd);
+    fuse_session_unmount(se);
+
+out_signals:
+    fuse_remove_signal_handlers(se);
+out_close:
+    if (se)
+	fuse_session_destroy(se);
+    // destroy() closes image when session has run
+    if (pf.fs && pfs_close(pf.fs))
+	rc = 1;
+    pthread_rwlock_destroy(&pf.lock);
+out:
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    return rc ? 1 : 0;
+}
+
+
+
+/**********************************************************************************/
+// Data is spliced to /dev/fuse straight from image when kernel can do it
+/**********************************************************************************/
+static void pfuse_init(void *data, struct fuse_conn_info *conn)
+{
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE)
+	conn->want |= FUSE_CAP_SPLICE_WRITE;
+}
+
+
+
+/**********************************************************************************/
+static void pfuse_destroy(void *data)
+{
+    struct pfuse *pf = data;
+
+    if (pfs_close(pf->fs))
+	fprintf(stderr, PFUSE_NAME ": image was not written back\n");
+    pf->fs = NULL;
+}
+
+
+
+/**********************************************************************************/
+static void pfuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct pfuse *pf = fuse_req_userdata(req);
+    struct fuse_entry_param e;
+    int rc;
+
+    if (FS_ROOT_INO != parent) {
+	fuse_reply_err(req, ENOTDIR);
+	return;
+    }
+    memset(&e, 0, sizeof(e));
+    pthread_rwlock_rdlock(&pf->lock);
+    rc = pfs_lookup(pf->fs, name);
+    if (rc > 0) {
+	e.ino = rc;
+	rc = pfuse_stat(pf, e.ino, &e.attr);
+    }
+    pthread_rwlock_unlock(&pf->lock);
+    if (rc) {
+	fuse_reply_err(req, -rc);
+	return;
+    }
+    e.attr_timeout = e.entry_timeout = PFUSE_TIMEOUT;
+    fuse_reply_entry(req, &e);
+}
+
+
+
+/**********************************************************************************/
+static void pfuse_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct pfuse *pf = fuse_req_userdata(req);
+    struct stat st;
+    int rc;
+
+    pthread_rwlock_rdlock(&pf->lock);
+    rc = pfuse_stat(pf, ino, &st);
+    pthread_rwlock_unlock(&pf->lock);
+    if (rc)
+	fuse_reply_err(req, -rc);
+    else
+	fuse_reply_attr(req, &st, PFUSE_TIMEOUT);
+}
+
+
+
+/**********************************************************************************/
+// Owner is kept in a byte, as by fs_write_inode(). Access time is not stored.
+/**********************************************************************************/
+static void pfuse_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+			  struct fuse_file_info *fi)
+{
+    struct pfuse *pf = fuse_req_userdata(req);
+    struct pfs_stat ps;
+    struct stat st;
+    int rc;
+
+    if (FS_ROOT_INO == ino) {
+	fuse_reply_err(req, EPERM);
+	return;
+    }
+    pthread_rwlock_wrlock(&pf->lock);
+    rc = pfs_stat(pf->fs, ino, &ps);
+    if (rc)
+	goto out;
+    if (to_set & FUSE_SET_ATTR_MODE)
+	ps.mode = (ps.mode & S_IFMT) | (attr->st_mode & ~S_IFMT);
+    if (to_set & FUSE_SET_ATTR_UID)
+	ps.uid = attr->st_uid;
+    if (to_set & FUSE_SET_ATTR_GID)
+	ps.gid = attr->st_gid;
+    if (to_set & FUSE_SET_ATTR_MTIME)
+	ps.time = attr->st_mtime;
+    if (to_set & FUSE_SET_ATTR_MTIME_NOW)
+	ps.time = time(NULL);
+    rc = pfs_setattr(pf->fs, ino, &ps);
+    if (!rc && (to_set & FUSE_SET_ATTR_SIZE))
+	rc = pfs_truncate(pf->fs, ino, attr->st_size);
+    if (!rc)
+	rc = pfuse_stat(pf, ino, &st);
+out:
+    pthread_rwlock_unlock(&pf->lock);
+    if (rc)
+	fuse_reply_err(req, -rc);
+    else
+	fuse_reply_attr(req, &st, PFUSE_TIMEOUT);
+}
+
+
+
+/**********************************************************************************/
+static void pfuse_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+    struct fuse_entry_param e;
+    int rc;
+
+    if (FS_ROOT_INO != parent) {
+	fuse_reply_err(req, ENOTDIR);
+	return;
+    }
+    rc = pfuse_mknod_locked(req, name, mode, &e);
+    if (rc)
+	fuse_reply_err(req, -rc);
+    else
+	fuse_reply_entry(req, &e);
+}
+
+
+
+/**********************************************************************************/
+static void pfuse_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode,
+			 struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+    int rc;
+
+    if (FS_ROOT_INO != parent) {
+	fuse_reply_err(req, ENOTDIR);
+	return;
+    }
+    rc = pfuse_mknod_locked(req, name, mode, &e);
+    if (rc)
+	fuse_reply_err(req, -rc);
+    else
+	fuse_reply_create(req, &e, fi);
+}
+
+
+
+/**********************************************************************************/
+// Creates file like fs_mknod() and fills entry for it
+/**********************************************************************************/
+static int pfuse_mknod_locked(fuse_req_t req, const char *name, mode_t mode, struct fuse_entry_param *e)
+{
+    struct pfuse *pf = fuse_req_userdata(req);
+    int rc;
+
+    memset(e, 0, sizeof(*e));
+    pthread_rwlock_wrlock(&pf->lock);
+    rc = pfs_create(pf->fs, name, mode);
+    if (rc > 0) {
+	e->ino = rc;
+	rc = pfuse_stat(pf, e->ino, &e->attr);
+    }
+    pthread_rwlock_unlock(&pf->lock);
+    e->attr_timeout = e->entry_timeout = PFUSE_TIMEOUT;
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+static void pfuse_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct pfuse *pf = fuse_req_userdata(req);
+    int rc;
+
+    if (FS_ROOT_INO != parent) {
+	fuse_reply_err(req, ENOTDIR);
+	return;
+    }
+    pthread_rwlock_wrlock(&pf->lock);
+    rc = pfs_unlink(pf->fs, name);
+    pthread_rwlock_unlock(&pf->lock);
+    fuse_reply_err(req, -rc);
+}
+
+
+
+/**********************************************************************************/
+// File having new name is replaced, as by fs_rename(), unless RENAME_NOREPLACE
+/**********************************************************************************/
+static void pfuse_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent,
+			 const char *newname, unsigned int flags)
+{
+    struct pfuse *pf = fuse_req_userdata(req);
+    int rc;
+
+    if (FS_ROOT_INO != parent || FS_ROOT_INO != newparent) {
+	fuse_reply_err(req, ENOTDIR);
+	return;
+    }
+    if (flags & ~RENAME_NOREPLACE) {
+	fuse_reply_err(req, EINVAL);
+	return;
+    }
+    pthread_rwlock_wrlock(&pf->lock);
+    if ((flags & RENAME_NOREPLACE) && pfs_lookup(pf->fs, newname) > 0)
+	rc = -EEXIST;
+    else
+	rc = pfs_rename(pf->fs, name, newname);
+    pthread_rwlock_unlock(&pf->lock);
+    fuse_reply_err(req, -rc);
+}
+
+
+
+/**********************************************************************************/
+static void pfuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct pfuse *pf = fuse_req_userdata(req);
+    int rc = 0;
+
+    if ((fi->flags & O_TRUNC) && (fi->flags & O_ACCMODE) != O_RDONLY) {
+	pthread_rwlock_wrlock(&pf->lock);
+	rc = pfs_truncate(pf->fs, ino, 0);
+	pthread_rwlock_unlock(&pf->lock);
+    }
+    if (rc)
+	fuse_reply_err(req, -rc);
+    else
+	fuse_reply_open(req, fi);
+}
+
+
+
+/**********************************************************************************/
+// Blocks of range are handed to FUSE as parts of image, so that it can splice them.
+// Ranges with holes or inline data are copied. Image is kept read locked until
+// reply is sent, blocks can not be freed under it.
+/**********************************************************************************/
+static void pfuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct pfuse *pf = fuse_req_userdata(req);
+    struct pfs_seg *seg = NULL;
+    struct fuse_bufvec *bv = NULL;
+    char *buf = NULL;
+    int nseg = size/pf->bsize + 2, n, i;
+    ssize_t rc;
+
+    pthread_rwlock_rdlock(&pf->lock);
+    seg = malloc(nseg*sizeof(struct pfs_seg));
+    if (!seg) {
+	rc = -ENOMEM;
+	goto out;
+    }
+    rc = n = pfs_map(pf->fs, ino, off, size, seg, nseg);
+    if (rc < 0)
+	goto out;
+    for (i = 0; i < n && seg[i].pos; i++);
+    if (n && i == n) {
+	bv = malloc(sizeof(struct fuse_bufvec) + n*sizeof(struct fuse_buf));
+	if (!bv) {
+	    rc = -ENOMEM;
+	    goto out;
+	}
+	memset(bv, 0, sizeof(struct fuse_bufvec) + n*sizeof(struct fuse_buf));
+	bv->count = n;
+	for (i = 0; i < n; i++) {
+	    bv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+	    bv->buf[i].fd = pfs_fd(pf->fs);
+	    bv->buf[i].pos = seg[i].pos;
+	    bv->buf[i].size = seg[i].len;
+	}
+	rc = fuse_reply_data(req, bv, 0);
+	goto out_replied;
+    }
+
+    buf = malloc(size);
+    if (!buf) {
+	rc = -ENOMEM;
+	goto out;
+    }
+    rc = pfs_read(pf->fs, ino, buf, size, off);
+    if (rc >= 0)
+	fuse_reply_buf(req, buf, rc);
+out:
+    if (rc < 0)
+	fuse_reply_err(req, -rc);
+out_replied:
+    pthread_rwlock_unlock(&pf->lock);
+    free(buf);
+    free(bv);
+    free(seg);
+}
+
+
+
+/**********************************************************************************/
+static void pfuse_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off,
+			struct fuse_file_info *fi)
+{
+    struct pfuse *pf = fuse_req_userdata(req);
+    ssize_t rc;
+
+    pthread_rwlock_wrlock(&pf->lock);
+    rc = pfs_write(pf->fs, ino, buf, size, off);
+    pthread_rwlock_unlock(&pf->lock);
+    if (rc < 0)
+	fuse_reply_err(req, -rc);
+    else
+	fuse_reply_write(req, rc);
+}
+
+
+
+/**********************************************************************************/
+// Closing file does not write image, as with the module
+/**********************************************************************************/
+static void pfuse_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    fuse_reply_err(req, 0);
+}
+
+
+
+/**********************************************************************************/
+static void pfuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    struct pfuse *pf = fuse_req_userdata(req);
+    int rc;
+
+    pthread_rwlock_wrlock(&pf->lock);
+    rc = pfs_sync(pf->fs);
+    pthread_rwlock_unlock(&pf->lock);
+    fuse_reply_err(req, -rc);
+}
+
+
+
+/**********************************************************************************/
+// Offsets 0 and 1 are "." and "..", then inode table slot + 2 as in fs_readdir()
+/**********************************************************************************/
+static void pfuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    struct pfuse *pf = fuse_req_userdata(req);
+    char name[FS_NAME_MAX + 1], *buf;
+    struct stat st;
+    size_t used = 0, n;
+    __u32 pos, next, child;
+
+    if (FS_ROOT_INO != ino) {
+	fuse_reply_err(req, ENOTDIR);
+	return;
+    }
+    buf = malloc(size);
+    if (!buf) {
+	fuse_reply_err(req, ENOMEM);
+	return;
+    }
+    memset(&st, 0, sizeof(st));
+    for (; off < 2; off++) {
+	st.st_ino = FS_ROOT_INO;
+	st.st_mode = S_IFDIR;
+	n = fuse_add_direntry(req, buf + used, size - used, off ? ".." : ".", &st, off + 1);
+	if (n > size - used)
+	    goto out;
+	used += n;
+    }
+
+    pthread_rwlock_rdlock(&pf->lock);
+    for (pos = off - 2;; pos = next) {
+	next = pos;
+	if (pfs_readdir(pf->fs, &next, name, &child) <= 0)
+	    break;
+	st.st_ino = child;
+	st.st_mode = S_IFREG;
+	n = fuse_add_direntry(req, buf + used, size - used, name, &st, next + 2);
+	if (n > size - used)
+	    break;
+	used += n;
+    }
+    pthread_rwlock_unlock(&pf->lock);
+out:
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+
+
+/**********************************************************************************/
+static void pfuse_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct pfuse *pf = fuse_req_userdata(req);
+    struct pfs_statfs ps;
+    struct statvfs st;
+
+    pthread_rwlock_rdlock(&pf->lock);
+    pfs_statfs(pf->fs, &ps);
+    pthread_rwlock_unlock(&pf->lock);
+    memset(&st, 0, sizeof(st));
+    st.f_bsize = st.f_frsize = ps.bsize;
+    st.f_blocks = ps.blocks;
+    st.f_bfree = st.f_bavail = ps.bfree;
+    st.f_files = ps.files;
+    st.f_ffree = st.f_favail = ps.ffree;
+    st.f_namemax = ps.namelen;
+    fuse_reply_statfs(req, &st);
+}
+
+
+
+/**********************************************************************************/
+// Fills attributes of inode, root directory gets those of fs_read_inode()
+/**********************************************************************************/
+static int pfuse_stat(struct pfuse *pf, fuse_ino_t ino, struct stat *st)
+{
+    struct pfs_stat ps;
+    int rc;
+
+    memset(st, 0, sizeof(*st));
+    st->st_ino = ino;
+    if (FS_ROOT_INO == ino) {
+	st->st_mode = S_IFDIR | 0644;
+	st->st_nlink = 2;
+	st->st_size = pf->nnodes;
+	st->st_atime = st->st_mtime = st->st_ctime = pf->mtime;
+	return 0;
+    }
+    rc = pfs_stat(pf->fs, ino, &ps);
+    if (rc)
+	return rc;
+    st->st_mode = ps.mode;
+    st->st_nlink = 1;
+    st->st_uid = ps.uid;
+    st->st_gid = ps.gid;
+    st->st_size = ps.size;
+    st->st_blocks = (__u64)ps.blocks*pf->bsize/512;
+    st->st_blksize = pf->bsize;
+    st->st_atime = st->st_mtime = st->st_ctime = ps.time;
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+static void show_usage(void)
+{
+    printf(PFUSE_NAME " (version " PFUSE_VER ")\n");
+    printf("Usage: " PFUSE_NAME " image mountpoint [options]\n");
+}
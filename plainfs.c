@@ -25,8 +25,8 @@ PlainFS features (may be TODOs):
 - Simple superblock
 - File attributes atime and ctime has not been implemented yet
 - Simple FS data structures
-- File size limit is FS_IDATA*512 bytes
-- File name limit is FS_FNAME_LEN
+- File size limit is FS_MAX_EXTENTS() runs of contiguous blocks
+- File name limit is FS_NAME_MAX
 - Inodes and file names are stored in single structure
 - Rest of a disk beyond files' data remains unused
 */
@@ -39,8 +39,16 @@ PlainFS features (may be TODOs):
 #include <asm/atomic.h>
 #include <asm/uaccess.h>
 #include <linux/buffer_head.h>
+#include <linux/mpage.h>
+#include <linux/pagevec.h>
 #include <linux/writeback.h>
 #include <linux/statfs.h>
+#include <linux/hash.h>
+#include <linux/vmalloc.h>
+#include <linux/percpu_counter.h>
+#include <linux/seqlock.h>
+#include <linux/rcupdate.h>
+#include <linux/rwsem.h>
 #include "plainfs.h"
 
 #ifdef DEBUG
@@ -63,11 +71,40 @@ struct super_block *fs_get_sb(struct file_system_type *, int, const char *, void
 void fs_destroy_inode(struct inode *);
 void fs_delete_inode(struct inode *);
 void fs_put_super(struct super_block *sb);
+void fs_write_super(struct super_block *);
+int fs_sync_fs(struct super_block *, int);
+int fs_sync_super(struct super_block *, int);
+int fs_write_sb(struct super_block *, int);
+struct buffer_head *fs_read_sb(struct super_block *, int);
+int fs_txn_add(struct super_block *, struct buffer_head *, int *);
+int fs_journal_commit(struct super_block *, int);
+struct buffer_head *fs_jblk_get(struct super_block *, __u32, int, int);
+__u32 fs_jblock(struct m_sb *, __u32);
+int fs_journal_reset(struct super_block *);
+int fs_journal_bypass(struct super_block *, int);
+int fs_journal_replay(struct super_block *);
+int fs_write_bhs(struct buffer_head **, int, int);
+void fs_dirty_slot(struct super_block *, int, struct buffer_head *);
+int fs_itable_extend(struct super_block *, int);
+int fs_load_bitmap(struct super_block *);
 
 int fs_readpage(struct file *, struct page *);
 int fs_get_block(struct inode *, sector_t, struct buffer_head *, int);
 int fs_writepage(struct page *, struct writeback_control *);
+int fs_readpages(struct file *, struct address_space *, struct list_head *, unsigned);
+int fs_writepages(struct address_space *, struct writeback_control *);
 int fs_prepare_write(struct file *, struct page *, unsigned, unsigned);
+int fs_commit_write(struct file *, struct page *, unsigned, unsigned);
+int fs_inline_fill(struct inode *, struct page *);
+int fs_inline_to_blocks(struct inode *);
+int fs_invalidatepage(struct page *, unsigned long);
+int fs_release_file(struct inode *, struct file *);
+void fs_clear_inode(struct inode *);
+int fs_map_delayed(struct address_space *);
+int fs_reserve_blk(struct inode *);
+void fs_unreserve_blk(struct inode *);
+int fs_alloc_delayed(struct inode *, int);
+void fs_discard_window(struct inode *);
 int fs_write_inode(struct inode *, int);
 void fs_read_inode(struct inode * inode);
 struct dentry *fs_lookup(struct inode *, struct dentry *, struct nameidata *);
@@ -78,9 +115,49 @@ int fs_statfs(struct super_block *, struct kstatfs *);
 int fs_mknod(struct inode *, struct dentry *, int, dev_t);
 
 struct d_ino *fs_raw_inode(struct super_block *, ino_t, struct buffer_head **);
+struct d_ino *fs_slot_bread(struct super_block *, int, struct buffer_head **);
 int fs_find_free_inode(struct super_block *);
+int fs_ino_to_slot(struct super_block *, ino_t);
+int fs_map_block(struct inode *, sector_t, int *);
+int fs_add_block(struct inode *, sector_t, int *, int);
+int fs_find_extent(struct inode *, sector_t, int *, sector_t *, struct d_extent *);
+int fs_ext_insert(struct inode *, int, sector_t, struct d_extent *, int, int);
+struct d_extent *fs_ext_get(struct inode *, int, struct buffer_head **, int);
+void fs_ext_dirty(struct inode *, struct buffer_head *);
+struct buffer_head *fs_meta_bread(struct inode *, __u32 *, struct buffer_head *, int);
+void fs_walk_runs(struct super_block *, struct d_extent *, __u32, __u32, __u32, void (*)(struct super_block *, int, int));
+void fs_walk_ext_blk(struct super_block *, __u32, int, void (*)(struct super_block *, int, int));
+int fs_alloc_blk(struct super_block *, int);
+int fs_alloc_run(struct super_block *, int, int, __u32 *);
+void fs_free_blk(struct super_block *, int, int);
+void fs_release_blk(struct super_block *, int, int);
+void fs_release_pending(struct super_block *);
+int fs_bm_image(struct m_sb *, char *, int, int);
+void fs_mark_blk(struct super_block *, int, int);
+int fs_scan_inodes(struct super_block *);
+int fs_scan_block(struct super_block *, struct buffer_head *, int);
 int fs_count_free_blk(struct super_block *);
-char *fs_inode_to_name(struct inode *);
+int fs_bm_build(struct super_block *);
+void fs_bm_destroy(struct m_sb *);
+void fs_bm_set(struct m_sb *, int);
+void fs_bm_clear(struct m_sb *, int);
+int fs_bm_find_free(struct m_sb *, int);
+int fs_bm_find_run(struct m_sb *, int, int);
+void fs_name_key(const char *, int, __u64 *, __u16 *);
+__u32 *fs_name_bucket(struct m_sb *, __u32);
+void fs_name_unlink(struct m_sb *, int);
+int fs_name_copy(struct m_sb *, int, char *);
+void fs_name_tail_free(struct rcu_head *);
+int fs_write_name(struct super_block *, const char *, int);
+void fs_set_dname(struct d_ino *, const char *, int, __u32);
+int fs_lookup_find(struct super_block *, const char *, int);
+int fs_lookup_add(struct super_block *, int, const char *, int, __u32, ino_t);
+void fs_lookup_del(struct super_block *, int);
+void fs_lookup_unhash(struct super_block *, int);
+int fs_lookup_init(struct m_sb *);
+void fs_lookup_destroy(struct m_sb *);
+void *fs_alloc_table(unsigned long);
+void fs_free_table(void *, unsigned long);
 
 static kmem_cache_t *fs_inode_cachep;
 
@@ -90,7 +167,6 @@ struct inode *fs_alloc_inode(struct super_block *);
 int init_inodecache(void);
 void destroy_inodecache(void);
 int fs_rename(struct inode *, struct dentry *, struct inode *, struct dentry *);
-int fs_hash(struct dentry *, struct qstr *);
 
 // Superblock operations
 struct super_operations fs_sops = {
@@ -101,6 +177,9 @@ struct super_operations fs_sops = {
     .delete_inode	= fs_delete_inode,
     .put_super		= fs_put_super,
     .write_inode	= fs_write_inode,
+    .clear_inode	= fs_clear_inode,
+    .write_super	= fs_write_super,
+    .sync_fs		= fs_sync_fs,
 };
 
 // File operations
@@ -110,13 +189,17 @@ struct file_operations fs_file_ops = {
     .write          = generic_file_write,
     .mmap           = generic_file_mmap,
     .sendfile       = generic_file_sendfile,
+    .release        = fs_release_file,
 };
 
 struct address_space_operations fs_aops = {                                                        
     .readpage       = fs_readpage,
+    .readpages      = fs_readpages,
     .writepage      = fs_writepage,
+    .writepages     = fs_writepages,
     .prepare_write  = fs_prepare_write,
-    .commit_write   = generic_commit_write,
+    .commit_write   = fs_commit_write,
+    .invalidatepage = fs_invalidatepage,
 };
 
 struct file_system_type fs_type = {
@@ -142,11 +225,20 @@ struct file_operations fs_dir_ops = {
 
 struct fs_inode_info {
     struct inode vfs_inode;
-    __u16 i_data[3];
-};
-
-static struct dentry_operations fs_dentry_operations = {
-    .d_hash = fs_hash,
+    struct d_extent i_ext[FS_NEXTENT];	// first extents of file or inline data
+    __u32 i_flags;			// FS_INLINE_DATA, changes under i_map_lock
+    __u32 i_ind;			// block with next s_ext_per_blk extents
+    __u32 i_dind;			// block with numbers of further extent blocks
+    __u32 i_nextents;
+    __u32 i_cache_idx;			// extent found last by fs_find_extent()
+    sector_t i_cache_lblk;		// its first file block
+    struct d_extent i_cache_ext;	// and its copy
+    __u32 i_goal;			// block after last allocated one, 0 - none
+    struct mutex i_map_lock;		// protects extents and reservations below
+    __u32 i_delayed;			// dirty blocks with space reserved, not allocated
+    __u32 i_win_start;			// reservation window, blocks taken from bitmap
+    __u32 i_win_len;			// for delayed blocks of this file
+    __u32 i_win_resv;			// window blocks backed by i_delayed reservations
 };
 
 
@@ -155,42 +247,55 @@ module_exit(fs_exit);
 
 
 
+/**********************************************************************************/
+// Maps up to b_size bytes of file starting at block, allocates one block if create
 /**********************************************************************************/
 int fs_get_block(struct inode *inode, sector_t block, struct buffer_head *bh, int create)
 {
-    //unsigned long phys;
     struct super_block *s = inode->i_sb;
-    struct m_sb *sbi = s->s_fs_info;
-    int rc = 0, i;
-    struct fs_inode_info *fsi = fs_i(inode);
+    int rc = 0, phys, len, delayed;
 
     d("=%s(inode: %lu, block: %lu, bh: %p, create: %i)\n", fn, inode->i_ino, block, bh, create);
 
-    if (block > FS_IDATA-1) {
-	rc = -ENOSPC;
+    mutex_lock(&fs_i(inode)->i_map_lock);
+    // Inline file has no blocks, it goes to blocks when one is needed
+    if (fs_i(inode)->i_flags & FS_INLINE_DATA) {
+	if (!create)
+	    goto out;
+	rc = fs_inline_to_blocks(inode);
+	if (rc)
+	    goto out;
+    }
+    phys = fs_map_block(inode, block, &len);
+    if (phys < 0) {
+	rc = phys;
+	goto out;
+    }
+    if (phys) {
+	// Whole rest of the run can be mapped at once
+	len = min_t(int, len, bh->b_size >> inode->i_blkbits);
+	map_bh(bh, s, phys);
+	bh->b_size = len << inode->i_blkbits;
 	goto out;
     }
-    //phys = (int)inode->u.generic_ip;
-    //d("phys: %lu\n", phys);
+    if (!create)
+	goto out;
 
-    if (create) {
-	for (i=0; i < sbi->s_nnodes; i++) {
-	    if (!test_bit(i, (void *)sbi->s_inode_bm)) {
-		set_bit(i, (void *)sbi->s_inode_bm);
-		fsi->i_data[block] = FS_INO_BLK + sbi->s_nnodes/FS_INO_PER_BLK + i;
-d("Free bit: %i, block: %i\n", i, fsi->i_data[block]);
-		break;
-	    }
-	}
-	if (!fsi->i_data[block]) {
-	    rc = -ENOSPC;
-	    goto out;
-	}
+    // Delayed block has its space reserved and its data already in the page
+    delayed = buffer_delay(bh);
+    rc = fs_add_block(inode, block, &phys, delayed);
+    if (rc)
+	goto out;
+    map_bh(bh, s, phys);
+    bh->b_size = 1 << inode->i_blkbits;
+    if (delayed) {
+	clear_buffer_delay(bh);
+	unmap_underlying_metadata(bh->b_bdev, bh->b_blocknr);
+    } else
 	set_buffer_new(bh);
-    }
-    map_bh(bh, s, fsi->i_data[block]);
     
 out:
+    mutex_unlock(&fs_i(inode)->i_map_lock);
     d("-%s rc: %i, b_blocknr: %lu\n", fn, rc, bh->b_blocknr);
     return rc;
 }
@@ -198,196 +303,1399 @@ out:
 
 
 /**********************************************************************************/
-int fs_readpage(struct file *file, struct page *page)
-{                                                                                                   
-    int rc;
+// Returns disk block of file block, 0 for holes, and length of the rest of its run
+/**********************************************************************************/
+int fs_map_block(struct inode *inode, sector_t block, int *len)
+{
+    struct d_extent ext;
+    sector_t lblk;
+    int rc, i;
 
-    d("=%s\n", fn);
-    rc = block_read_full_page(page, fs_get_block);
-    d("-%s: rc: %i\n", fn, rc);
-    return rc;
+    *len = 0;
+    rc = fs_find_extent(inode, block, &i, &lblk, &ext);
+    if (rc || i == fs_i(inode)->i_nextents)
+	return rc;
+    *len = lblk + ext.e_len - block;
+    return ext.e_start ? ext.e_start + block - lblk : 0;
 }
 
 
 
 /**********************************************************************************/
-int fs_writepage(struct page *page, struct writeback_control *wbc)
+// Finds extent holding file block. Returns its number in idx (i_nextents if block
+// is beyond end of file), its first file block in lblk and its copy in ext.
+// Search starts from extent found last time, so sequential access neither walks
+// the list from the beginning nor reads extent blocks for every file block.
+/**********************************************************************************/
+int fs_find_extent(struct inode *inode, sector_t block, int *idx, sector_t *lblk, struct d_extent *ext)
 {
-    int rc;
-
-    d("=%s\n", fn);
-    rc = block_write_full_page(page, fs_get_block, wbc);
-    d("-%s: rc: %i\n", fn, rc);
-    return rc;
+    struct fs_inode_info *fsi = fs_i(inode);
+    struct buffer_head *bh;
+    struct d_extent *e;
+    sector_t l = 0;
+    int i = 0;
+
+    if (fsi->i_cache_idx <= fsi->i_nextents && block >= fsi->i_cache_lblk) {
+	i = fsi->i_cache_idx;
+	l = fsi->i_cache_lblk;
+	if (i < fsi->i_nextents) {
+	    *ext = fsi->i_cache_ext;
+	    if (block < l + ext->e_len)
+		goto out;
+	    l += ext->e_len;
+	    i++;
+	}
+    }
+    for (; i < fsi->i_nextents; i++) {
+	e = fs_ext_get(inode, i, &bh, 0);
+	if (IS_ERR(e))
+	    return PTR_ERR(e);
+	*ext = *e;
+	brelse(bh);
+	if (block < l + ext->e_len)
+	    break;
+	l += ext->e_len;
+    }
+    fsi->i_cache_idx = i;
+    fsi->i_cache_lblk = l;
+    if (i < fsi->i_nextents)
+	fsi->i_cache_ext = *ext;
+out:
+    *idx = i;
+    *lblk = l;
+    return 0;
 }
 
 
 
 /**********************************************************************************/
-int fs_prepare_write(struct file *file, struct page *page, unsigned from, unsigned to)
+// Allocates disk block for hole or end of file, extends last run when possible
+/**********************************************************************************/
+int fs_add_block(struct inode *inode, sector_t block, int *phys, int delayed)
 {
-    int rc;
+    struct fs_inode_info *fsi = fs_i(inode);
+    struct super_block *s = inode->i_sb;
+    struct d_extent ext, new[3], *e, prev;
+    struct buffer_head *bh;
+    sector_t lblk;
+    int rc, i, k = 0, off, goal = fsi->i_goal;
 
-    d("=%s\n", fn);
-    rc = block_prepare_write(page, from, to, fs_get_block);                                  
-    d("-%s: rc: %i\n", fn, rc);
+    rc = fs_find_extent(inode, block, &i, &lblk, &ext);
+    if (rc)
+	return rc;
+    // Appended block is wanted right after the last run on disk
+    prev.e_start = 0;
+    if (i && i == fsi->i_nextents) {
+	e = fs_ext_get(inode, i - 1, &bh, 0);
+	if (IS_ERR(e))
+	    return PTR_ERR(e);
+	prev = *e;
+	brelse(bh);
+	if (prev.e_start)
+	    goal = prev.e_start + prev.e_len + (block - lblk);
+    }
+    *phys = delayed ? fs_alloc_delayed(inode, goal) : fs_alloc_blk(s, goal);
+    if (!*phys)
+	return -ENOSPC;
+    fsi->i_goal = *phys + 1;
+
+    if (i == fsi->i_nextents) {
+	// Last run grows when new block follows it on disk
+	if (block == lblk && prev.e_start && prev.e_start + prev.e_len == *phys) {
+	    e = fs_ext_get(inode, i - 1, &bh, 0);
+	    if (IS_ERR(e)) {
+		rc = PTR_ERR(e);
+		goto out;
+	    }
+	    e->e_len++;
+	    fsi->i_cache_idx = i - 1;
+	    fsi->i_cache_lblk = lblk - (e->e_len - 1);
+	    fsi->i_cache_ext = *e;
+	    fs_ext_dirty(inode, bh);
+	    goto out;
+	}
+	// Gap beyond end of file becomes a hole
+	if (block > lblk) {
+	    new[k].e_start = 0;
+	    new[k++].e_len = block - lblk;
+	}
+	new[k].e_start = *phys;
+	new[k++].e_len = 1;
+	rc = fs_ext_insert(inode, i, lblk, new, k, 0);
+    } else {
+	// Splitting hole into hole, new block and hole
+	off = block - lblk;
+	if (off) {
+	    new[k].e_start = 0;
+	    new[k++].e_len = off;
+	}
+	new[k].e_start = *phys;
+	new[k++].e_len = 1;
+	if (ext.e_len - off - 1) {
+	    new[k].e_start = 0;
+	    new[k++].e_len = ext.e_len - off - 1;
+	}
+	rc = fs_ext_insert(inode, i, lblk, new, k, 1);
+    }
+
+out:
+    if (rc) {
+	fs_free_blk(s, *phys, 1);
+	// Delayed block stays reserved until it is written or invalidated
+	if (delayed) {
+	    fsi->i_delayed++;
+	    percpu_counter_mod(&((struct m_sb *)s->s_fs_info)->s_freeblocks_counter, -1);
+	}
+    }
     return rc;
 }
 
 
 
 /**********************************************************************************/
-// Fill a superblock from disk
+// Puts k extents at position idx, whose first file block is lblk, replacing
+// extent idx if replace is set. Following extents are moved up.
 /**********************************************************************************/
-int fs_fill_super(struct super_block *s, void *data, int silent)
+int fs_ext_insert(struct inode *inode, int idx, sector_t lblk, struct d_extent *new, int k, int replace)
 {
-    struct inode *inode;
-    int rc = 0, i;
-    struct m_sb *sbi;
+    struct fs_inode_info *fsi = fs_i(inode);
+    struct m_sb *sbi = inode->i_sb->s_fs_info;
     struct buffer_head *bh;
-    struct d_sb *fsi;
-    struct lookup_entry **le;
+    struct d_extent *e, tmp;
+    int i, n = fsi->i_nextents, shift = k - replace;
+
+    if (n + shift > sbi->s_max_extents)
+	return -EFBIG;
+    // Extent blocks up to the new last extent are allocated first
+    e = fs_ext_get(inode, n + shift - 1, &bh, 1);
+    if (IS_ERR(e))
+	return PTR_ERR(e);
+    brelse(bh);
 
-    d("=%s(silent: %d)\n", fn, silent);
-    sbi = kmalloc(sizeof(struct m_sb), GFP_KERNEL);
-    if (!sbi) {
-	rc = -ENOMEM;
-	goto out;
-    }
-    memset(sbi, 0, sizeof(struct m_sb));
-    if (!sb_set_blocksize(s, FS_BSIZE)) {
-	d("%s: unable to set block size\n", fn);
-	rc = -EINVAL;
-	goto out;
+    for (i = n - 1; i >= idx + replace; i--) {
+	e = fs_ext_get(inode, i, &bh, 0);
+	if (IS_ERR(e))
+	    return PTR_ERR(e);
+	tmp = *e;
+	brelse(bh);
+	e = fs_ext_get(inode, i + shift, &bh, 1);
+	if (IS_ERR(e))
+	    return PTR_ERR(e);
+	*e = tmp;
+	fs_ext_dirty(inode, bh);
     }
-    if (!(bh = sb_bread(s, FS_SB_BLK))) {
-	d("%s: unable to read superblock\n", fn);
-	rc = -EINVAL;
-	goto out;
+    for (i=0; i < k; i++) {
+	e = fs_ext_get(inode, idx + i, &bh, 1);
+	if (IS_ERR(e))
+	    return PTR_ERR(e);
+	*e = new[i];
+	fs_ext_dirty(inode, bh);
     }
-    
-    fsi = (struct d_sb *)bh->b_data;
-    sbi->s_nnodes = fsi->s_nnodes;
-    sbi->s_nblocks = fsi->s_nblocks;
-    brelse(bh);
-    d("s_nnodes: %i, s_nblocks: %i\n", sbi->s_nnodes, sbi->s_nblocks);
+    fsi->i_nextents = n + shift;
+    fsi->i_cache_idx = idx;
+    fsi->i_cache_lblk = lblk;
+    fsi->i_cache_ext = new[0];
+    mark_inode_dirty(inode);
+    return 0;
+}
 
-    le = kmalloc(sizeof(le)*sbi->s_nnodes, GFP_KERNEL);
-    if (!le) {
-	rc = -ENOMEM;
-	goto out;
+
+
+/**********************************************************************************/
+// Returns pointer to extent idx of inode, *bh holds its extent block or is NULL
+// for extents kept in inode. With create missing extent blocks are allocated.
+/**********************************************************************************/
+struct d_extent *fs_ext_get(struct inode *inode, int idx, struct buffer_head **bh, int create)
+{
+    struct fs_inode_info *fsi = fs_i(inode);
+    struct m_sb *sbi = inode->i_sb->s_fs_info;
+    struct buffer_head *dbh;
+
+    *bh = NULL;
+    if (idx < FS_NEXTENT)
+	return fsi->i_ext + idx;
+    idx -= FS_NEXTENT;
+    if (idx < sbi->s_ext_per_blk)
+	*bh = fs_meta_bread(inode, &fsi->i_ind, NULL, create);
+    else {
+	idx -= sbi->s_ext_per_blk;
+	if (idx >= sbi->s_ptr_per_blk*sbi->s_ext_per_blk)
+	    return ERR_PTR(-EFBIG);
+	dbh = fs_meta_bread(inode, &fsi->i_dind, NULL, create);
+	if (IS_ERR(dbh))
+	    return (struct d_extent *)dbh;
+	*bh = fs_meta_bread(inode, (__u32 *)dbh->b_data + idx/sbi->s_ext_per_blk, dbh, create);
+	brelse(dbh);
+	idx %= sbi->s_ext_per_blk;
     }
-    memset(le, 0, sizeof(le)*sbi->s_nnodes);
-    sbi->s_lookup = le;
-    s->s_fs_info = sbi;
-    
-    // Allocating bitmap for inodes
-    i = sbi->s_nnodes/8 + (sbi->s_nnodes%8 ? 1 : 0);
-d("bitmap len: %i\n", i);
-    sbi->s_inode_bm = kmalloc(i, GFP_KERNEL);
-    if (!sbi->s_inode_bm) {
-	rc = -ENOMEM;
-	goto out;
+    if (IS_ERR(*bh)) {
+	dbh = *bh;
+	*bh = NULL;
+	return (struct d_extent *)dbh;
     }
-    memset(sbi->s_inode_bm, 0, i);
-    
-    s->s_op = &fs_sops;
-    inode = iget(s, FS_ROOT_INO);
-    if (!inode) {
-	d("%s: get root inode failed\n", fn);
-	rc = -EINVAL;
-	goto out;
+    return (struct d_extent *)(*bh)->b_data + idx;
+}
+
+
+
+/**********************************************************************************/
+// Extent returned by fs_ext_get() was changed
+/**********************************************************************************/
+void fs_ext_dirty(struct inode *inode, struct buffer_head *bh)
+{
+    if (bh) {
+	mark_buffer_dirty(bh);
+	brelse(bh);
+    } else
+	mark_inode_dirty(inode);
+}
+
+
+
+/**********************************************************************************/
+// Reads metadata block whose number is at *ptr. If there is no block yet and create
+// is set, allocates zeroed one and stores its number to *ptr, which lives in
+// block parent or in inode if parent is NULL.
+/**********************************************************************************/
+struct buffer_head *fs_meta_bread(struct inode *inode, __u32 *ptr, struct buffer_head *parent, int create)
+{
+    struct super_block *s = inode->i_sb;
+    struct buffer_head *bh;
+    int blk;
+
+    if (*ptr) {
+	bh = sb_bread(s, *ptr);
+	return bh ? bh : ERR_PTR(-EIO);
     }
+    if (!create)
+	return ERR_PTR(-EIO);
+    blk = fs_alloc_blk(s, fs_i(inode)->i_goal);
+    if (!blk)
+	return ERR_PTR(-ENOSPC);
+    bh = sb_getblk(s, blk);
+    if (!bh) {
+	fs_free_blk(s, blk, 1);
+	return ERR_PTR(-EIO);
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, s->s_blocksize);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    *ptr = blk;
+    if (parent)
+	mark_buffer_dirty(parent);
+    else
+	mark_inode_dirty(inode);
+    return bh;
+}
 
-    s->s_root = d_alloc_root(inode);
-    if (!s->s_root) {
-	d("%s: d_alloc_root() failed\n", fn);
-	iput(inode);
-	rc = -EINVAL;
-	goto out;
+
+
+/**********************************************************************************/
+// Calls fn for every run of file described by inline extents ext, n, ind and dind,
+// and for every extent block of file. Used to free or to mark blocks of file.
+/**********************************************************************************/
+void fs_walk_runs(struct super_block *s, struct d_extent *ext, __u32 n, __u32 ind, __u32 dind,
+	void (*walk)(struct super_block *, int, int))
+{
+    struct m_sb *sbi = s->s_fs_info;
+    struct buffer_head *bh;
+    __u32 *ptr;
+    int i;
+
+    for (i=0; i < min_t(__u32, n, FS_NEXTENT); i++)
+	if (ext[i].e_start)
+	    walk(s, ext[i].e_start, ext[i].e_len);
+    if (n <= FS_NEXTENT)
+	return;
+    n -= FS_NEXTENT;
+    fs_walk_ext_blk(s, ind, min_t(__u32, n, sbi->s_ext_per_blk), walk);
+    if (n <= sbi->s_ext_per_blk || !dind)
+	return;
+    n -= sbi->s_ext_per_blk;
+    bh = sb_bread(s, dind);
+    if (!bh) {
+	printk(KERN_ERR FS_NAME ": %s: unable to read extent index block %u\n", s->s_id, dind);
+	return;
     }
-    s->s_root->d_op = &fs_dentry_operations;
-    return 0;
+    ptr = (__u32 *)bh->b_data;
+    for (i=0; i < sbi->s_ptr_per_blk && i*sbi->s_ext_per_blk < n; i++)
+	fs_walk_ext_blk(s, ptr[i], min_t(__u32, n - i*sbi->s_ext_per_blk, sbi->s_ext_per_blk), walk);
+    brelse(bh);
+    walk(s, dind, 1);
+}
 
-out:
-    s->s_fs_info = NULL;
-    if (sbi) {
-	if (sbi->s_lookup)
-	    kfree(sbi->s_lookup);
-	kfree(sbi);
-	if (sbi->s_inode_bm)
-	    kfree(sbi->s_inode_bm);
+
+
+/**********************************************************************************/
+void fs_walk_ext_blk(struct super_block *s, __u32 blk, int n,
+	void (*walk)(struct super_block *, int, int))
+{
+    struct buffer_head *bh;
+    struct d_extent *ext;
+    int i;
+
+    if (!blk)
+	return;
+    bh = sb_bread(s, blk);
+    if (!bh) {
+	printk(KERN_ERR FS_NAME ": %s: unable to read extent block %u\n", s->s_id, blk);
+	return;
     }
-    d("-%s: rc: %i\n", fn, rc);
-    return rc;
+    ext = (struct d_extent *)bh->b_data;
+    for (i=0; i < n; i++)
+	if (ext[i].e_start)
+	    walk(s, ext[i].e_start, ext[i].e_len);
+    brelse(bh);
+    walk(s, blk, 1);
 }
 
 
 
 /**********************************************************************************/
-// Filesystem registration
+// Takes free block of data zone nearest after goal, returns 0 if disk is full
 /**********************************************************************************/
-struct super_block *fs_get_sb(struct file_system_type *fs_type,
-    int flags, const char *dev_name, void *data)
+int fs_alloc_blk(struct super_block *s, int goal)
 {
-    struct super_block *rc = NULL;
-
-    d("=%s\n", fn);
-    rc = get_sb_bdev(fs_type, flags, dev_name, data, fs_fill_super);
-    d("-%s rc: %p\n", fn, rc);
-    return rc;
+    struct m_sb *sbi = s->s_fs_info;
+    __u32 len;
+    int blk;
+
+    blk = fs_alloc_run(s, goal, 1, &len);
+    if (blk)
+	percpu_counter_mod(&sbi->s_freeblocks_counter, -1);
+d("block: %i, goal: %i\n", blk, goal);
+    return blk;
 }
 
 
 
 /**********************************************************************************/
-// Initializing module
+// Takes up to max contiguous free blocks, starting at the free block nearest after
+// goal. Returns first block and sets *len, returns 0 if disk is full. Free blocks
+// counter is left to the caller.
 /**********************************************************************************/
-int __init fs_init(void)
+int fs_alloc_run(struct super_block *s, int goal, int max, __u32 *len)
 {
-    int rc = 0;
+    struct m_sb *sbi = s->s_fs_info;
+    unsigned long *bm = (unsigned long *)sbi->s_inode_bm;
+    int start, i, end, from_rotor = 0;
+
+    // Files without goal start where the last new file stopped
+    start = goal - sbi->s_data_blk;
+    if (!goal || start < 0 || start >= sbi->s_ndata) {
+	start = sbi->s_alloc_rotor;
+	from_rotor = 1;
+    }
+    // Free bit is found through bitmap summaries from goal to the end, then
+    // from the beginning
+    spin_lock(&sbi->s_bm_lock);
+    i = fs_bm_find_free(sbi, start);
+    if (i < 0 && start)
+	i = fs_bm_find_free(sbi, 0);
+    if (i < 0) {
+	spin_unlock(&sbi->s_bm_lock);
+	return 0;
+    }
+    if (max > 1)
+	i = fs_bm_find_run(sbi, i, max);
+
+    // Run goes on up to the next used bit
+    end = find_next_bit(bm, min_t(int, sbi->s_ndata, i + max), i + 1);
+    for (*len = 0; i + *len < end; (*len)++)
+	fs_bm_set(sbi, i + *len);
+    spin_unlock(&sbi->s_bm_lock);
+
+    if (from_rotor)
+	sbi->s_alloc_rotor = i + *len < sbi->s_ndata ? i + *len : 0;
+    s->s_dirt = 1;
+    return sbi->s_data_blk + i;
+}
 
-d("=%s\n", fn);
-    rc = init_inodecache();
-    if (rc)
-	goto out;
-    rc = register_filesystem(&fs_type);
 
-out:
-d("-%s rc: %i\n", fn, rc);
-    return rc;
+
+/**********************************************************************************/
+void fs_free_blk(struct super_block *s, int blk, int len)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    int i;
+
+    spin_lock(&sbi->s_bm_lock);
+    for (i=blk - sbi->s_data_blk; i < blk - sbi->s_data_blk + len; i++) {
+	if (i < 0 || i >= sbi->s_ndata) {
+	    d("block %i is out of data zone\n", i + sbi->s_data_blk);
+	    continue;
+	}
+	fs_bm_clear(sbi, i);
+	percpu_counter_mod(&sbi->s_freeblocks_counter, 1);
+    }
+    spin_unlock(&sbi->s_bm_lock);
+    s->s_dirt = 1;
 }
 
 
 
 /**********************************************************************************/
-// Module is unloaded
+// Frees blocks committed inode table may still refer to. They stay taken in memory
+// and are written free by the next transaction; allocator gets them when it has
+// committed, so no file's data lands in blocks replay gives back to a deleted inode.
+// Caller holds s_jsem for read.
 /**********************************************************************************/
-void __exit fs_exit(void)
+void fs_release_blk(struct super_block *s, int blk, int len)
 {
-d("=%s\n", fn);
-    unregister_filesystem(&fs_type);
-    destroy_inodecache();
-d("-%s\n\n", fn);
+    struct m_sb *sbi = s->s_fs_info;
+    int i;
+
+    spin_lock(&sbi->s_bm_lock);
+    for (i=blk - sbi->s_data_blk; i < blk - sbi->s_data_blk + len; i++) {
+	if (i < 0 || i >= sbi->s_ndata) {
+	    d("block %i is out of data zone\n", i + sbi->s_data_blk);
+	    continue;
+	}
+	if (!__test_and_set_bit(i, sbi->s_free_pend))
+	    sbi->s_npend++;
+    }
+    spin_unlock(&sbi->s_bm_lock);
+    s->s_dirt = 1;
 }
 
 
 
 /**********************************************************************************/
-void fs_delete_inode(struct inode *inode)
+// Gives blocks released before last commit to allocator, caller holds s_jsem for
+// write
+/**********************************************************************************/
+void fs_release_pending(struct super_block *s)
 {
-    d("=%s(inode: %lu)\n", fn, inode->i_ino);
+    struct m_sb *sbi = s->s_fs_info;
     int i;
-    struct d_ino *di;
-    struct buffer_head *bh;
-    struct super_block *s = inode->i_sb;
+
+    if (!sbi->s_npend)
+	return;
+    d("=%s(blocks: %u)\n", fn, sbi->s_npend);
+    spin_lock(&sbi->s_bm_lock);
+    for (i = find_first_bit(sbi->s_free_pend, sbi->s_ndata); i < sbi->s_ndata;
+	i = find_next_bit(sbi->s_free_pend, sbi->s_ndata, i + 1)) {
+	__clear_bit(i, sbi->s_free_pend);
+	fs_bm_clear(sbi, i);
+    }
+    percpu_counter_mod(&sbi->s_freeblocks_counter, sbi->s_npend);
+    sbi->s_npend = 0;
+    spin_unlock(&sbi->s_bm_lock);
+}
+
+
+
+/**********************************************************************************/
+// Marks run of blocks as used in block bitmap, used by inode table scan before
+// fs_bm_build() makes summaries
+/**********************************************************************************/
+void fs_mark_blk(struct super_block *s, int blk, int len)
+{
     struct m_sb *sbi = s->s_fs_info;
-    struct fs_inode_info *fsi = fs_i(inode);
+    int i;
 
-    truncate_inode_pages(&inode->i_data, 0);
-    inode->i_size = 0;
-    //truncate(inode);
-    clear_inode(inode);
+    for (i=blk - sbi->s_data_blk; i < blk - sbi->s_data_blk + len; i++)
+	if (i >= 0 && i < sbi->s_ndata)
+	    set_bit(i, (void *)sbi->s_inode_bm);
+}
+
+
+
+/**********************************************************************************/
+int fs_readpage(struct file *file, struct page *page)
+{                                                                                                   
+    int rc = 0;
+
+    d("=%s\n", fn);
+    // Inline data is in inode already, no I/O
+    if ((fs_i(page->mapping->host)->i_flags & FS_INLINE_DATA) &&
+	!fs_inline_fill(page->mapping->host, page))
+	unlock_page(page);
+    else
+	rc = block_read_full_page(page, fs_get_block);
+    d("-%s: rc: %i\n", fn, rc);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+int fs_writepage(struct page *page, struct writeback_control *wbc)
+{
+    struct inode *inode = page->mapping->host;
+    struct fs_inode_info *fsi = fs_i(inode);
+    int rc = 0;
+    char *kaddr;
+
+    d("=%s\n", fn);
+    // Page of inline file dirtied through mmap, data goes back to inode
+    if (fsi->i_flags & FS_INLINE_DATA) {
+	mutex_lock(&fsi->i_map_lock);
+	if ((fsi->i_flags & FS_INLINE_DATA) && !page->index && i_size_read(inode) <= FS_INLINE_LEN) {
+	    kaddr = kmap_atomic(page, KM_USER0);
+	    memcpy(fsi->i_ext, kaddr, i_size_read(inode));
+	    kunmap_atomic(kaddr, KM_USER0);
+	    mutex_unlock(&fsi->i_map_lock);
+	    mark_inode_dirty(inode);
+	    unlock_page(page);
+	    goto out;
+	}
+	if (fsi->i_flags & FS_INLINE_DATA)
+	    rc = fs_inline_to_blocks(inode);
+	mutex_unlock(&fsi->i_map_lock);
+	if (rc) {
+	    unlock_page(page);
+	    goto out;
+	}
+    }
+    rc = block_write_full_page(page, fs_get_block, wbc);
+out:
+    d("-%s: rc: %i\n", fn, rc);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Readahead, contiguous pages of a run go to disk in one bio
+/**********************************************************************************/
+int fs_readpages(struct file *file, struct address_space *mapping, struct list_head *pages, unsigned nr_pages)
+{
+    int rc;
+
+    d("=%s(nr_pages: %u)\n", fn, nr_pages);
+    if (fs_i(mapping->host)->i_flags & FS_INLINE_DATA) {
+	struct page *page;
+	unsigned i;
+
+	for (i=0; i < nr_pages; i++) {
+	    page = list_entry(pages->prev, struct page, lru);
+	    list_del(&page->lru);
+	    if (!add_to_page_cache_lru(page, mapping, page->index, GFP_KERNEL))
+		fs_readpage(file, page);
+	    page_cache_release(page);
+	}
+	rc = 0;
+    } else
+	rc = mpage_readpages(mapping, pages, nr_pages, fs_get_block);
+    d("-%s: rc: %i\n", fn, rc);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Writeback, dirty pages mapped to consecutive blocks are merged into one bio.
+// Pages with holes or partly dirty buffers fall back to fs_writepage().
+/**********************************************************************************/
+int fs_writepages(struct address_space *mapping, struct writeback_control *wbc)
+{
+    int rc;
+
+    d("=%s\n", fn);
+    rc = fs_map_delayed(mapping);
+    // Inline file has its pages written by fs_writepage()
+    if (!rc)
+	rc = mpage_writepages(mapping, wbc,
+	    (fs_i(mapping->host)->i_flags & FS_INLINE_DATA) ? NULL : fs_get_block);
+    d("-%s: rc: %i\n", fn, rc);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Like block_prepare_write(), but blocks not on disk yet only get space reserved.
+// They stay unmapped with BH_Delay set and fs_map_delayed() allocates them at
+// writeback, when the whole dirty range of the file is known.
+/**********************************************************************************/
+int fs_prepare_write(struct file *file, struct page *page, unsigned from, unsigned to)
+{
+    struct inode *inode = page->mapping->host;
+    unsigned bsize = 1 << inode->i_blkbits, bstart, bend;
+    sector_t block = (sector_t)page->index << (PAGE_CACHE_SHIFT - inode->i_blkbits);
+    struct buffer_head *bh, *head, *wait[PAGE_CACHE_SIZE/512], **w = wait;
+    struct fs_inode_info *fsi = fs_i(inode);
+    int rc = 0, phys, len;
+    void *kaddr;
+
+    d("=%s\n", fn);
+    if (fsi->i_flags & FS_INLINE_DATA) {
+	mutex_lock(&fsi->i_map_lock);
+	if ((fsi->i_flags & FS_INLINE_DATA) && (page->index || to > FS_INLINE_LEN))
+	    rc = fs_inline_to_blocks(inode);
+	mutex_unlock(&fsi->i_map_lock);
+	if (rc)
+	    return rc;
+	// Write that fits stays in inode, fs_commit_write() copies it there
+	if (PageUptodate(page) ? (fsi->i_flags & FS_INLINE_DATA) : !fs_inline_fill(inode, page))
+	    return 0;
+    }
+    if (!page_has_buffers(page))
+	create_empty_buffers(page, bsize, 0);
+    head = page_buffers(page);
+    for (bh = head, bstart = 0; bh != head || !bstart; block++, bstart = bend, bh = bh->b_this_page) {
+	bend = bstart + bsize;
+	if (bend <= from || bstart >= to) {
+	    if (PageUptodate(page))
+		set_buffer_uptodate(bh);
+	    continue;
+	}
+	if (!buffer_mapped(bh) && !buffer_delay(bh)) {
+	    mutex_lock(&fs_i(inode)->i_map_lock);
+	    phys = fs_map_block(inode, block, &len);
+	    if (!phys)
+		rc = fs_reserve_blk(inode);
+	    mutex_unlock(&fs_i(inode)->i_map_lock);
+	    if (phys < 0)
+		rc = phys;
+	    if (rc)
+		break;
+	    if (phys)
+		map_bh(bh, inode->i_sb, phys);
+	    else {
+		// New block, parts not written now are zeroed
+		set_buffer_delay(bh);
+		if (!PageUptodate(page) && (bstart < from || bend > to)) {
+		    kaddr = kmap_atomic(page, KM_USER0);
+		    if (bend > to)
+			memset(kaddr + to, 0, bend - to);
+		    if (bstart < from)
+			memset(kaddr + bstart, 0, from - bstart);
+		    flush_dcache_page(page);
+		    kunmap_atomic(kaddr, KM_USER0);
+		}
+		set_buffer_uptodate(bh);
+		continue;
+	    }
+	}
+	if (PageUptodate(page)) {
+	    set_buffer_uptodate(bh);
+	    continue;
+	}
+	if (!buffer_uptodate(bh) && !buffer_delay(bh) && (bstart < from || bend > to)) {
+	    ll_rw_block(READ, 1, &bh);
+	    *w++ = bh;
+	}
+    }
+    while (w > wait) {
+	wait_on_buffer(*--w);
+	if (!buffer_uptodate(*w))
+	    rc = -EIO;
+    }
+    d("-%s: rc: %i\n", fn, rc);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Inline file keeps written data in inode, other pages are committed as usual
+/**********************************************************************************/
+int fs_commit_write(struct file *file, struct page *page, unsigned from, unsigned to)
+{
+    struct inode *inode = page->mapping->host;
+    struct fs_inode_info *fsi = fs_i(inode);
+    loff_t pos = ((loff_t)page->index << PAGE_CACHE_SHIFT) + to;
+    char *kaddr;
+    int rc;
+
+    if (!page_has_buffers(page)) {
+	mutex_lock(&fsi->i_map_lock);
+	if (fsi->i_flags & FS_INLINE_DATA) {
+	    if (pos > inode->i_size)
+		i_size_write(inode, pos);
+	    kaddr = kmap_atomic(page, KM_USER0);
+	    memcpy(fsi->i_ext, kaddr, min_t(loff_t, inode->i_size, FS_INLINE_LEN));
+	    kunmap_atomic(kaddr, KM_USER0);
+	    mutex_unlock(&fsi->i_map_lock);
+	    mark_inode_dirty(inode);
+	    return 0;
+	}
+	mutex_unlock(&fsi->i_map_lock);
+	// File went to blocks after fs_prepare_write(), page is mapped now
+	rc = fs_prepare_write(file, page, from, to);
+	if (rc)
+	    return rc;
+    }
+    return generic_commit_write(file, page, from, to);
+}
+
+
+
+/**********************************************************************************/
+// Fills locked page of inline file from inode, returns 1 if file is not inline
+// any more
+/**********************************************************************************/
+int fs_inline_fill(struct inode *inode, struct page *page)
+{
+    struct fs_inode_info *fsi = fs_i(inode);
+    char *kaddr = kmap(page);
+    unsigned n = 0;
+
+    mutex_lock(&fsi->i_map_lock);
+    if (!(fsi->i_flags & FS_INLINE_DATA)) {
+	mutex_unlock(&fsi->i_map_lock);
+	kunmap(page);
+	return 1;
+    }
+    if (!page->index) {
+	n = min_t(loff_t, i_size_read(inode), FS_INLINE_LEN);
+	memcpy(kaddr, fsi->i_ext, n);
+    }
+    mutex_unlock(&fsi->i_map_lock);
+    memset(kaddr + n, 0, PAGE_CACHE_SIZE - n);
+    flush_dcache_page(page);
+    kunmap(page);
+    SetPageUptodate(page);
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Moves inline data to first block of file, caller holds i_map_lock
+/**********************************************************************************/
+int fs_inline_to_blocks(struct inode *inode)
+{
+    struct fs_inode_info *fsi = fs_i(inode);
+    struct super_block *s = inode->i_sb;
+    struct buffer_head *bh;
+    char data[FS_INLINE_LEN];
+    int rc = 0, phys, n = min_t(loff_t, i_size_read(inode), FS_INLINE_LEN);
+
+    d("=%s(inode: %lu, bytes: %i)\n", fn, inode->i_ino, n);
+    memcpy(data, fsi->i_ext, FS_INLINE_LEN);
+    memset(fsi->i_ext, 0, sizeof(fsi->i_ext));
+    fsi->i_nextents = 0;
+    fsi->i_flags &= ~FS_INLINE_DATA;
+    if (n) {
+	rc = fs_add_block(inode, 0, &phys, 0);
+	if (rc)
+	    goto restore;
+	bh = sb_getblk(s, phys);
+	if (!bh) {
+	    fs_free_blk(s, phys, 1);
+	    memset(fsi->i_ext, 0, sizeof(fsi->i_ext));
+	    fsi->i_nextents = 0;
+	    rc = -EIO;
+	    goto restore;
+	}
+	lock_buffer(bh);
+	memset(bh->b_data, 0, s->s_blocksize);
+	memcpy(bh->b_data, data, n);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	// Written now, so it can not reach disk after newer data of page cache
+	sync_dirty_buffer(bh);
+	brelse(bh);
+    }
+    mark_inode_dirty(inode);
+    goto out;
+
+restore:
+    memcpy(fsi->i_ext, data, FS_INLINE_LEN);
+    fsi->i_flags |= FS_INLINE_DATA;
+out:
+    d("-%s rc: %i\n", fn, rc);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Page is truncated, reservations of its delayed blocks past offset are dropped
+/**********************************************************************************/
+int fs_invalidatepage(struct page *page, unsigned long offset)
+{
+    struct inode *inode = page->mapping->host;
+    struct buffer_head *bh, *head;
+    unsigned long bstart = 0;
+
+    if (page_has_buffers(page)) {
+	head = bh = page_buffers(page);
+	do {
+	    if (bstart >= offset && buffer_delay(bh)) {
+		clear_buffer_delay(bh);
+		mutex_lock(&fs_i(inode)->i_map_lock);
+		fs_unreserve_blk(inode);
+		mutex_unlock(&fs_i(inode)->i_map_lock);
+	    }
+	    bstart += bh->b_size;
+	    bh = bh->b_this_page;
+	} while (bh != head);
+    }
+    return block_invalidatepage(page, offset);
+}
+
+
+
+/**********************************************************************************/
+// Allocates disk blocks for all delayed buffers of dirty pages of mapping, so that
+// blocks of the whole dirty range are taken at once and writeback sends them in
+// big bios
+/**********************************************************************************/
+int fs_map_delayed(struct address_space *mapping)
+{
+    struct inode *inode = mapping->host;
+    struct pagevec pvec;
+    struct page *page;
+    struct buffer_head *bh, *head;
+    pgoff_t index = 0;
+    sector_t block;
+    int i, rc = 0;
+
+    if (!fs_i(inode)->i_delayed)
+	return 0;
+    pagevec_init(&pvec, 0);
+    while (!rc && pagevec_lookup_tag(&pvec, mapping, &index, PAGECACHE_TAG_DIRTY, PAGEVEC_SIZE)) {
+	for (i=0; i < pagevec_count(&pvec); i++) {
+	    page = pvec.pages[i];
+	    lock_page(page);
+	    if (page->mapping == mapping && page_has_buffers(page)) {
+		block = (sector_t)page->index << (PAGE_CACHE_SHIFT - inode->i_blkbits);
+		head = bh = page_buffers(page);
+		do {
+		    if (buffer_delay(bh) && !rc)
+			rc = fs_get_block(inode, block, bh, 1);
+		    block++;
+		    bh = bh->b_this_page;
+		} while (bh != head);
+	    }
+	    unlock_page(page);
+	}
+	pagevec_release(&pvec);
+    }
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Reserves space for one delayed block, some blocks are left for extent blocks
+/**********************************************************************************/
+int fs_reserve_blk(struct inode *inode)
+{
+    struct m_sb *sbi = inode->i_sb->s_fs_info;
+
+    if (percpu_counter_read_positive(&sbi->s_freeblocks_counter) <= FS_META_RESERVE &&
+	    percpu_counter_sum(&sbi->s_freeblocks_counter) <= FS_META_RESERVE)
+	return -ENOSPC;
+    percpu_counter_mod(&sbi->s_freeblocks_counter, -1);
+    fs_i(inode)->i_delayed++;
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Drops reservation of one delayed block, window block it backed stays with inode
+/**********************************************************************************/
+void fs_unreserve_blk(struct inode *inode)
+{
+    struct m_sb *sbi = inode->i_sb->s_fs_info;
+    struct fs_inode_info *fsi = fs_i(inode);
+
+    fsi->i_delayed--;
+    if (fsi->i_win_resv > fsi->i_delayed)
+	fsi->i_win_resv--;
+    else
+	percpu_counter_mod(&sbi->s_freeblocks_counter, 1);
+}
+
+
+
+/**********************************************************************************/
+// Takes block for delayed buffer from reservation window of inode. Empty window is
+// refilled with a run covering all delayed blocks of the file and FS_RESV_WINDOW
+// blocks more, so files written back at the same time do not interleave. Window
+// blocks are kept in s_win_bm until handed out, commits write them free.
+/**********************************************************************************/
+int fs_alloc_delayed(struct inode *inode, int goal)
+{
+    struct m_sb *sbi = inode->i_sb->s_fs_info;
+    struct fs_inode_info *fsi = fs_i(inode);
+    int want, blk, i;
+
+    if (!fsi->i_win_len) {
+	want = fsi->i_delayed + min_t(int, FS_RESV_WINDOW,
+	    percpu_counter_read_positive(&sbi->s_freeblocks_counter));
+	fsi->i_win_start = fs_alloc_run(inode->i_sb, goal, want, &fsi->i_win_len);
+	if (!fsi->i_win_start) {
+	    fsi->i_win_len = 0;
+	    return 0;
+	}
+	// Reservations of delayed blocks cover that much of the window
+	fsi->i_win_resv = min(fsi->i_win_len, fsi->i_delayed);
+	percpu_counter_mod(&sbi->s_freeblocks_counter, fsi->i_win_resv - fsi->i_win_len);
+	spin_lock(&sbi->s_bm_lock);
+	for (i=0; i < fsi->i_win_len; i++)
+	    __set_bit(fsi->i_win_start + i - sbi->s_data_blk, sbi->s_win_bm);
+	sbi->s_nwin += fsi->i_win_len;
+	spin_unlock(&sbi->s_bm_lock);
+    }
+    spin_lock(&sbi->s_bm_lock);
+    __clear_bit(fsi->i_win_start - sbi->s_data_blk, sbi->s_win_bm);
+    sbi->s_nwin--;
+    spin_unlock(&sbi->s_bm_lock);
+    blk = fsi->i_win_start++;
+    fsi->i_win_len--;
+    fsi->i_delayed--;
+    if (fsi->i_win_resv)
+	fsi->i_win_resv--;
+    else
+	percpu_counter_mod(&sbi->s_freeblocks_counter, 1);
+    return blk;
+}
+
+
+
+/**********************************************************************************/
+// Returns unused blocks of reservation window to free space
+/**********************************************************************************/
+void fs_discard_window(struct inode *inode)
+{
+    struct super_block *s = inode->i_sb;
+    struct m_sb *sbi = s->s_fs_info;
+    struct fs_inode_info *fsi = fs_i(inode);
+    int i;
+
+    if (!fsi->i_win_len)
+	return;
+    spin_lock(&sbi->s_bm_lock);
+    for (i=0; i < fsi->i_win_len; i++) {
+	__clear_bit(fsi->i_win_start + i - sbi->s_data_blk, sbi->s_win_bm);
+	fs_bm_clear(sbi, fsi->i_win_start + i - sbi->s_data_blk);
+    }
+    sbi->s_nwin -= fsi->i_win_len;
+    spin_unlock(&sbi->s_bm_lock);
+    percpu_counter_mod(&sbi->s_freeblocks_counter, fsi->i_win_len - fsi->i_win_resv);
+    fsi->i_win_len = fsi->i_win_resv = 0;
+    s->s_dirt = 1;
+}
+
+
+
+/**********************************************************************************/
+// Last writer closes file, what is left of its window goes back
+/**********************************************************************************/
+int fs_release_file(struct inode *inode, struct file *file)
+{
+    if ((file->f_mode & FMODE_WRITE) && atomic_read(&inode->i_writecount) == 1) {
+	mutex_lock(&fs_i(inode)->i_map_lock);
+	fs_discard_window(inode);
+	mutex_unlock(&fs_i(inode)->i_map_lock);
+    }
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+void fs_clear_inode(struct inode *inode)
+{
+    fs_discard_window(inode);
+}
+
+
+
+/**********************************************************************************/
+// Fill a superblock from disk
+/**********************************************************************************/
+int fs_fill_super(struct super_block *s, void *data, int silent)
+{
+    struct inode *inode;
+    int rc = 0, i;
+    struct m_sb *sbi;
+    struct buffer_head *bh;
+    struct d_sb *fsi;
+
+    d("=%s(silent: %d)\n", fn, silent);
+    sbi = kmalloc(sizeof(struct m_sb), GFP_KERNEL);
+    if (!sbi) {
+	rc = -ENOMEM;
+	goto out;
+    }
+    memset(sbi, 0, sizeof(struct m_sb));
+    s->s_fs_info = sbi;
+    percpu_counter_init(&sbi->s_freeblocks_counter);
+    percpu_counter_init(&sbi->s_freeinodes_counter);
+    mutex_init(&sbi->s_lock);
+    init_rwsem(&sbi->s_jsem);
+    // Superblock starts the device whatever block size is, it is read with
+    // the smallest one the device allows and block size is switched then
+    if (!sb_min_blocksize(s, FS_BSIZE)) {
+	d("%s: unable to set block size\n", fn);
+	rc = -EINVAL;
+	goto out;
+    }
+    if (!(bh = sb_bread(s, FS_SB_BLK))) {
+	d("%s: unable to read superblock\n", fn);
+	rc = -EINVAL;
+	goto out;
+    }
+    
+    fsi = (struct d_sb *)bh->b_data;
+    if (strncmp(fsi->s_magic, FS_MAGIC_STR, sizeof(fsi->s_magic)) || FS_REV != fsi->s_rev) {
+	if (!silent)
+	    printk(KERN_ERR FS_NAME ": %s: no plainfs revision %i found\n", s->s_id, FS_REV);
+	brelse(bh);
+	rc = -EINVAL;
+	goto out;
+    }
+    if (fsi->s_bsize_bits != s->s_blocksize_bits) {
+	i = fsi->s_bsize_bits;
+	brelse(bh);
+	if (i < FS_BSIZE_BITS || i > FS_MAX_BSIZE_BITS || !sb_set_blocksize(s, 1 << i)) {
+	    printk(KERN_ERR FS_NAME ": %s: unsupported block size %i\n", s->s_id, 1 << i);
+	    rc = -EINVAL;
+	    goto out;
+	}
+	if (!(bh = sb_bread(s, FS_SB_BLK))) {
+	    d("%s: unable to read superblock\n", fn);
+	    rc = -EINVAL;
+	    goto out;
+	}
+	fsi = (struct d_sb *)bh->b_data;
+    }
+    sbi->s_ino_per_blk = FS_INO_PER_BLK(s->s_blocksize);
+    sbi->s_ext_per_blk = FS_EXT_PER_BLK(s->s_blocksize);
+    sbi->s_ptr_per_blk = FS_PTR_PER_BLK(s->s_blocksize);
+    sbi->s_max_extents = FS_MAX_EXTENTS(s->s_blocksize);
+    sbi->s_nnodes = fsi->s_nnodes;
+    sbi->s_nblocks = fsi->s_nblocks;
+    sbi->s_bmap_blk = fsi->s_bmap_blk;
+    sbi->s_data_blk = fsi->s_data_blk;
+    sbi->s_ndata = fsi->s_ndata;
+    sbi->s_journal_blk = fsi->s_journal_blk;
+    sbi->s_journal_len = fsi->s_journal_len - 1;
+    if (fsi->s_journal_len < FS_JOURNAL_MIN || fsi->s_journal_blk < sbi->s_bmap_blk
+	|| fsi->s_journal_blk + fsi->s_journal_len > sbi->s_data_blk) {
+	printk(KERN_ERR FS_NAME ": %s: bad journal location\n", s->s_id);
+	brelse(bh);
+	rc = -EINVAL;
+	goto out;
+    }
+    sbi->s_jmax = min_t(int, FS_JBLK_MAX(s->s_blocksize), sbi->s_journal_len - 3);
+    sbi->s_jbh = kmalloc(sbi->s_jmax*sizeof(struct buffer_head *), GFP_KERNEL);
+    if (!sbi->s_jbh) {
+	brelse(bh);
+	rc = -ENOMEM;
+	goto out;
+    }
+
+    // Replay may rewrite superblock, fsi sees it through the same buffer
+    rc = fs_journal_replay(s);
+    if (rc) {
+	brelse(bh);
+	goto out;
+    }
+    sbi->s_state = fsi->s_state;
+    sbi->s_itable_init = fsi->s_itable_init;
+    if (FS_STATE_CLEAN == sbi->s_state)
+	percpu_counter_mod(&sbi->s_freeblocks_counter, fsi->s_free_blocks);
+    brelse(bh);
+    s->s_maxbytes = min_t(loff_t, (loff_t)sbi->s_ndata << s->s_blocksize_bits, MAX_LFS_FILESIZE);
+    d("s_nnodes: %i, s_nblocks: %i, block size: %lu\n", sbi->s_nnodes, sbi->s_nblocks, s->s_blocksize);
+
+    rc = fs_lookup_init(sbi);
+    if (rc)
+	goto out;
+    sbi->s_itable_blocks = (sbi->s_nnodes + sbi->s_ino_per_blk - 1)/sbi->s_ino_per_blk;
+    if (sbi->s_itable_init > sbi->s_itable_blocks) {
+	printk(KERN_ERR FS_NAME ": %s: bad inode table size %u\n", s->s_id, sbi->s_itable_init);
+	rc = -EINVAL;
+	goto out;
+    }
+    sbi->s_itable_dirty = fs_alloc_table(BITS_TO_LONGS(sbi->s_itable_blocks)*sizeof(long));
+    if (!sbi->s_itable_dirty) {
+	rc = -ENOMEM;
+	goto out;
+    }
+    memset(sbi->s_itable_dirty, 0, BITS_TO_LONGS(sbi->s_itable_blocks)*sizeof(long));
+    
+    // Allocating bitmap for inodes, bit operations work on whole longs
+    i = BITS_TO_LONGS(sbi->s_ndata)*sizeof(long);
+d("bitmap len: %i\n", i);
+    spin_lock_init(&sbi->s_bm_lock);
+    sbi->s_inode_bm = fs_alloc_table(i);
+    if (!sbi->s_inode_bm) {
+	rc = -ENOMEM;
+	goto out;
+    }
+    memset(sbi->s_inode_bm, 0, i);
+    sbi->s_free_pend = fs_alloc_table(i);
+    if (!sbi->s_free_pend) {
+	rc = -ENOMEM;
+	goto out;
+    }
+    memset(sbi->s_free_pend, 0, i);
+    sbi->s_win_bm = fs_alloc_table(i);
+    if (!sbi->s_win_bm) {
+	rc = -ENOMEM;
+	goto out;
+    }
+    memset(sbi->s_win_bm, 0, i);
+
+    // Bitmap saved by clean unmount or journal commit is loaded, otherwise inode
+    // table scan rebuilds it
+    if (FS_BMAP_VALID(sbi->s_state)) {
+	rc = fs_load_bitmap(s);
+	if (rc)
+	    goto out;
+    }
+
+    // Filling name cache (and block bitmap) from inode table
+    rc = fs_scan_inodes(s);
+    if (rc)
+	goto out;
+    rc = fs_bm_build(s);
+    if (rc)
+	goto out;
+    if (FS_STATE_CLEAN != sbi->s_state)
+	percpu_counter_mod(&sbi->s_freeblocks_counter, fs_count_free_blk(s));
+
+    // Journal commits keep bitmap on disk valid until next clean unmount, free
+    // counters there are not kept up to date
+    sbi->s_state = FS_STATE_JOURNAL;
+    if (!(s->s_flags & MS_RDONLY)) {
+	rc = fs_write_sb(s, 1);
+	if (rc)
+	    goto out;
+    }
+    
+    s->s_op = &fs_sops;
+    inode = iget(s, FS_ROOT_INO);
+    if (!inode) {
+	d("%s: get root inode failed\n", fn);
+	rc = -EINVAL;
+	goto out;
+    }
+
+    s->s_root = d_alloc_root(inode);
+    if (!s->s_root) {
+	d("%s: d_alloc_root() failed\n", fn);
+	iput(inode);
+	rc = -EINVAL;
+	goto out;
+    }
+    return 0;
+
+out:
+    if (sbi) {
+	fs_lookup_destroy(sbi);
+	if (sbi->s_itable_dirty)
+	    fs_free_table(sbi->s_itable_dirty, BITS_TO_LONGS(sbi->s_itable_blocks)*sizeof(long));
+	fs_bm_destroy(sbi);
+	if (sbi->s_inode_bm)
+	    fs_free_table(sbi->s_inode_bm, BITS_TO_LONGS(sbi->s_ndata)*sizeof(long));
+	if (sbi->s_free_pend)
+	    fs_free_table(sbi->s_free_pend, BITS_TO_LONGS(sbi->s_ndata)*sizeof(long));
+	if (sbi->s_win_bm)
+	    fs_free_table(sbi->s_win_bm, BITS_TO_LONGS(sbi->s_ndata)*sizeof(long));
+	kfree(sbi->s_jbh);
+	percpu_counter_destroy(&sbi->s_freeblocks_counter);
+	percpu_counter_destroy(&sbi->s_freeinodes_counter);
+	kfree(sbi);
+    }
+    s->s_fs_info = NULL;
+    d("-%s: rc: %i\n", fn, rc);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Reads inode table in one pass at mount time, blocks past s_itable_init hold no
+// inodes and are skipped. Table blocks are requested FS_SCAN_BATCH at a time and
+// the next batch is submitted before the current one is parsed, so the disk
+// streams while names and block bits are collected.
+/**********************************************************************************/
+int fs_scan_inodes(struct super_block *s)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    struct buffer_head *bhs[2][FS_SCAN_BATCH];
+    int nblk = sbi->s_itable_init;
+    int blk, next, n = 0, cur = 0, i, rc = 0, used = 0;
+    unsigned long start = jiffies;
+
+    d("=%s(table blocks: %i)\n", fn, nblk);
+    for (blk = 0; blk < nblk; blk = next) {
+	// Submitting reads of this batch on first pass, then of the next one
+	if (!blk) {
+	    n = min(nblk, FS_SCAN_BATCH);
+	    for (i=0; i < n; i++)
+		bhs[cur][i] = sb_getblk(s, FS_INO_BLK + i);
+	    ll_rw_block(READ, n, bhs[cur]);
+	}
+	next = blk + n;
+	if (next < nblk) {
+	    int nn = min(nblk - next, FS_SCAN_BATCH);
+
+	    for (i=0; i < nn; i++)
+		bhs[!cur][i] = sb_getblk(s, FS_INO_BLK + next + i);
+	    ll_rw_block(READ, nn, bhs[!cur]);
+	}
+
+	for (i=0; i < n; i++) {
+	    struct buffer_head *bh = bhs[cur][i];
+
+	    wait_on_buffer(bh);
+	    if (!rc) {
+		if (buffer_uptodate(bh)) {
+		    int ret = fs_scan_block(s, bh, blk + i);
+
+		    if (ret < 0)
+			rc = ret;
+		    else
+			used += ret;
+		} else {
+		    printk(KERN_ERR FS_NAME ": %s: unable to read inode table block %i\n", s->s_id, FS_INO_BLK + blk + i);
+		    rc = -EIO;
+		}
+	    }
+	    brelse(bh);
+	}
+	if (next < nblk)
+	    n = min(nblk - next, FS_SCAN_BATCH);
+	cur = !cur;
+    }
+
+    if (!rc) {
+	percpu_counter_mod(&sbi->s_freeinodes_counter, sbi->s_nnodes - used);
+	printk(KERN_INFO FS_NAME ": %s: %i inodes, %i in use, table scanned in %u ms\n",
+	    s->s_id, sbi->s_nnodes, used, jiffies_to_msecs(jiffies - start));
+    }
+    d("-%s rc: %i\n", fn, rc);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Puts live inodes of table block blk into name cache and their blocks into bitmap,
+// returns number of live inodes or error
+/**********************************************************************************/
+int fs_scan_block(struct super_block *s, struct buffer_head *bh, int blk)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    struct d_ino *di = (struct d_ino *)bh->b_data;
+    struct buffer_head *nbh = NULL;
+    const char *name;
+    int j, slot, rc, used = 0;
+
+    for (j=0; j < sbi->s_ino_per_blk; j++) {
+	slot = blk*sbi->s_ino_per_blk + j;
+	if (slot >= sbi->s_nnodes)
+	    break;
+	if (!di[j].i_nlinks)
+	    continue;
+	if (di[j].i_ino != FS_SLOT_INO(slot)) {
+	    d("slot %i holds wrong inode number %i\n", slot, di[j].i_ino);
+	    continue;
+	}
+	name = di[j].name;
+	if (di[j].i_name_len > FS_FNAME_LEN) {
+	    nbh = sb_bread(s, di[j].i_name_blk);
+	    if (!nbh) {
+		printk(KERN_ERR FS_NAME ": %s: unable to read name block %u of inode %u\n",
+		    s->s_id, di[j].i_name_blk, di[j].i_ino);
+		return -EIO;
+	    }
+	    name = nbh->b_data;
+	}
+	rc = fs_lookup_add(s, slot, name, di[j].i_name_len, di[j].i_name_hash, di[j].i_ino);
+	if (nbh) {
+	    brelse(nbh);
+	    nbh = NULL;
+	}
+	if (rc)
+	    return rc;
+	used++;
+	if (FS_BMAP_VALID(sbi->s_state))
+	    continue;
+	if (!(di[j].i_flags & FS_INLINE_DATA))
+	    fs_walk_runs(s, di[j].i_ext, di[j].i_nextents, di[j].i_ind, di[j].i_dind, fs_mark_blk);
+	if (di[j].i_name_blk)
+	    fs_mark_blk(s, di[j].i_name_blk, 1);
+    }
+    return used;
+}
+
+
+
+/**********************************************************************************/
+// Filesystem registration
+/**********************************************************************************/
+struct super_block *fs_get_sb(struct file_system_type *fs_type,
+    int flags, const char *dev_name, void *data)
+{
+    struct super_block *rc = NULL;
+
+    d("=%s\n", fn);
+    rc = get_sb_bdev(fs_type, flags, dev_name, data, fs_fill_super);
+    d("-%s rc: %p\n", fn, rc);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Initializing module
+/**********************************************************************************/
+int __init fs_init(void)
+{
+    int rc = 0;
+
+d("=%s\n", fn);
+    rc = init_inodecache();
+    if (rc)
+	goto out;
+    rc = register_filesystem(&fs_type);
+
+out:
+d("-%s rc: %i\n", fn, rc);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Module is unloaded
+/**********************************************************************************/
+void __exit fs_exit(void)
+{
+d("=%s\n", fn);
+    unregister_filesystem(&fs_type);
+    // Name tails freed on umount may still wait for a grace period
+    rcu_barrier();
+    destroy_inodecache();
+d("-%s\n\n", fn);
+}
+
+
+
+/**********************************************************************************/
+void fs_delete_inode(struct inode *inode)
+{
+    d("=%s(inode: %lu)\n", fn, inode->i_ino);
+    struct d_ino *di;
+    struct buffer_head *bh;
+    struct super_block *s = inode->i_sb;
+    struct m_sb *sbi = s->s_fs_info;
+    struct fs_inode_info *fsi = fs_i(inode);
+    __u32 name_blk;
+
+    truncate_inode_pages(&inode->i_data, 0);
+    inode->i_size = 0;
+    //truncate(inode);
+    clear_inode(inode);
+    // Bad inode never got its slot written, fs_mknod() has given the slot back
+    if (is_bad_inode(inode))
+	goto out;
 
     // Write inode as unused to disk
     di = fs_raw_inode(s, inode->i_ino, &bh);
@@ -395,46 +1703,794 @@ void fs_delete_inode(struct inode *inode)
 	d("Unable to read inode %lu\n", inode->i_ino);
 	goto out;
     }
-    di->name[0] = 0;
-    di->i_nlinks = 0;
-    mark_buffer_dirty(bh);
-    brelse(bh);
-    
-    // Deleting name from name cache
-    kfree(sbi->s_lookup[inode->i_ino - FS_ROOT_INO - 1]);
-    sbi->s_lookup[inode->i_ino - FS_ROOT_INO - 1] = NULL;
+    // Blocks are freed in the same transaction that frees the inode, allocator
+    // gets them once it commits
+    down_read(&sbi->s_jsem);
+    lock_buffer(bh);
+    di->name[0] = 0;
+    di->i_nlinks = 0;
+    name_blk = di->i_name_blk;
+    di->i_name_blk = 0;
+    unlock_buffer(bh);
+    fs_dirty_slot(s, FS_INO_SLOT(inode->i_ino), bh);
+    brelse(bh);
+    
+    // Deleting name from name cache, slot becomes free for fs_mknod()
+    mutex_lock(&sbi->s_lock);
+    fs_lookup_del(s, FS_INO_SLOT(inode->i_ino));
+    mutex_unlock(&sbi->s_lock);
+    percpu_counter_mod(&sbi->s_freeinodes_counter, 1);
+
+    // Clearing inode bitmap
+    fs_walk_runs(s, fsi->i_ext, fsi->i_nextents, fsi->i_ind, fsi->i_dind, fs_release_blk);
+    if (name_blk)
+	fs_release_blk(s, name_blk, 1);
+    up_read(&sbi->s_jsem);
+out:
+    d("-%s\n", fn);
+}
+
+
+
+/**********************************************************************************/
+void fs_put_super(struct super_block *s)
+{
+    struct m_sb *sbi;
+
+    d("=%s\n", fn);
+    sbi = s->s_fs_info;
+    if (sbi) {
+	sbi->s_state = FS_STATE_CLEAN;
+	fs_sync_super(s, 1);
+	// Everything is written in place, next mount has nothing to replay
+	if (!(s->s_flags & MS_RDONLY))
+	    fs_journal_reset(s);
+	fs_lookup_destroy(sbi);
+	if (sbi->s_itable_dirty)
+	    fs_free_table(sbi->s_itable_dirty, BITS_TO_LONGS(sbi->s_itable_blocks)*sizeof(long));
+	fs_bm_destroy(sbi);
+	if (sbi->s_inode_bm)
+	    fs_free_table(sbi->s_inode_bm, BITS_TO_LONGS(sbi->s_ndata)*sizeof(long));
+	if (sbi->s_free_pend)
+	    fs_free_table(sbi->s_free_pend, BITS_TO_LONGS(sbi->s_ndata)*sizeof(long));
+	if (sbi->s_win_bm)
+	    fs_free_table(sbi->s_win_bm, BITS_TO_LONGS(sbi->s_ndata)*sizeof(long));
+	kfree(sbi->s_jbh);
+	percpu_counter_destroy(&sbi->s_freeblocks_counter);
+	percpu_counter_destroy(&sbi->s_freeinodes_counter);
+	kfree(sbi);
+    }
+    s->s_fs_info = NULL;
+    d("-%s\n", fn);
+}
+
+
+
+/**********************************************************************************/
+void fs_write_super(struct super_block *s)
+{
+    d("*%s\n", fn);
+    fs_sync_super(s, 0);
+}
+
+
+
+/**********************************************************************************/
+int fs_sync_fs(struct super_block *s, int wait)
+{
+    d("*%s(wait: %i)\n", fn, wait);
+    return fs_sync_super(s, wait);
+}
+
+
+
+/**********************************************************************************/
+// Commits inode table blocks changed since last call, changed bitmap blocks and
+// superblock as one journal transaction, then writes them in place. Everything
+// changed meanwhile goes in together, commit is waited on whatever wait is.
+/**********************************************************************************/
+int fs_sync_super(struct super_block *s, int wait)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    struct buffer_head *bh;
+    int rc = 0, ret, i, blk, n = 0, len, size = sbi->s_ndata/8 + (sbi->s_ndata%8 ? 1 : 0);
+    int bsize = s->s_blocksize;
+
+    d("=%s(wait: %i)\n", fn, wait);
+    s->s_dirt = 0;
+    if (s->s_flags & MS_RDONLY)
+	goto out;
+
+    down_write(&sbi->s_jsem);
+    // Extent and name blocks reach disk before inodes referring to them are committed
+    rc = sync_blockdev(s->s_bdev);
+
+    // Reference taken by fs_dirty_slot() passes to transaction
+    for (blk = find_first_bit(sbi->s_itable_dirty, sbi->s_itable_blocks);
+	blk < sbi->s_itable_blocks;
+	blk = find_next_bit(sbi->s_itable_dirty, sbi->s_itable_blocks, blk + 1)) {
+	clear_bit(blk, sbi->s_itable_dirty);
+	bh = sb_find_get_block(s, FS_INO_BLK + blk);
+	if (!bh)
+	    continue;
+	put_bh(bh);
+	ret = fs_txn_add(s, bh, &n);
+	rc = rc ? rc : ret;
+    }
+
+    // Only bitmap blocks that differ from memory are taken
+    for (i=0; i*bsize < size; i++) {
+	bh = sb_getblk(s, sbi->s_bmap_blk + i);
+	if (!bh) {
+	    rc = -EIO;
+	    break;
+	}
+	len = min(size - i*bsize, bsize);
+	lock_buffer(bh);
+	if (!fs_bm_image(sbi, bh->b_data, i*bsize, len) && buffer_uptodate(bh)) {
+	    unlock_buffer(bh);
+	    brelse(bh);
+	    continue;
+	}
+	memset(bh->b_data + len, 0, bsize - len);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	ret = fs_txn_add(s, bh, &n);
+	rc = rc ? rc : ret;
+    }
+
+    // Superblock ends transaction, fs_txn_add() has left room for it
+    if (n >= 0 && (bh = fs_read_sb(s, sbi->s_state))) {
+	sbi->s_jbh[n++] = bh;
+	if (!fs_journal_commit(s, n)) {
+	    // Inodes that freed released blocks are committed, blocks can be reused
+	    fs_release_pending(s);
+	    for (i=0; i < n; i++)
+		mark_buffer_dirty(sbi->s_jbh[i]);
+	    ret = fs_write_bhs(sbi->s_jbh, n, 1);
+	    rc = rc ? rc : ret;
+	    goto unlock;
+	}
+	// Nothing is committed, blocks go to disk without journal
+	brelse(sbi->s_jbh[--n]);
+    }
+    if (n >= 0) {
+	ret = fs_journal_bypass(s, n);
+	rc = rc ? rc : ret;
+    }
+    // Superblock tells bitmap is valid again when the rest is on disk
+    ret = sync_blockdev(s->s_bdev);
+    rc = rc ? rc : ret;
+    ret = fs_write_sb(s, 1);
+    rc = rc ? rc : ret;
+    if (!rc)
+	fs_release_pending(s);
+
+unlock:
+    up_write(&sbi->s_jsem);
+out:
+    d("-%s rc: %i\n", fn, rc);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Reads superblock and puts free counters and state into it, buffer is not dirtied
+/**********************************************************************************/
+struct buffer_head *fs_read_sb(struct super_block *s, int state)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    struct buffer_head *bh;
+    struct d_sb *ds;
+
+    bh = sb_bread(s, FS_SB_BLK);
+    if (!bh) {
+	printk(KERN_ERR FS_NAME ": %s: unable to read superblock\n", s->s_id);
+	return NULL;
+    }
+    lock_buffer(bh);
+    ds = (struct d_sb *)bh->b_data;
+    // Bitmap on disk shows released blocks free already
+    ds->s_free_blocks = percpu_counter_sum(&sbi->s_freeblocks_counter) + sbi->s_npend;
+    ds->s_free_inodes = percpu_counter_sum(&sbi->s_freeinodes_counter);
+    ds->s_state = state;
+    ds->s_itable_init = sbi->s_itable_init;
+    unlock_buffer(bh);
+    return bh;
+}
+
+
+
+/**********************************************************************************/
+// Writes free counters and state to superblock in place
+/**********************************************************************************/
+int fs_write_sb(struct super_block *s, int wait)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    struct buffer_head *bh;
+
+    bh = fs_read_sb(s, sbi->s_state);
+    if (!bh)
+	return -EIO;
+    return fs_write_bhs(&bh, 1, wait);
+}
+
+
+
+/**********************************************************************************/
+// Adds block to transaction of fs_sync_super(), one place is kept for superblock.
+// Once transaction is full, blocks are written in place without journal and *n
+// becomes -1.
+/**********************************************************************************/
+int fs_txn_add(struct super_block *s, struct buffer_head *bh, int *n)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    int rc = 0;
+
+    if (*n >= 0 && *n < sbi->s_jmax - 1) {
+	sbi->s_jbh[(*n)++] = bh;
+	return 0;
+    }
+    if (*n >= 0) {
+	rc = fs_journal_bypass(s, *n);
+	*n = -1;
+    }
+    mark_buffer_dirty(bh);
+    brelse(bh);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Writes n blocks of s_jbh to journal and commits them. Caller holds s_jsem for
+// write, so the blocks do not change until they are written in place.
+/**********************************************************************************/
+int fs_journal_commit(struct super_block *s, int n)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    struct buffer_head *bh, *bhs[FS_SCAN_BATCH];
+    struct d_jblk *jb;
+    int rc = 0, ret, i, k = 0;
+
+    d("=%s(n: %i, seq: %u, head: %u)\n", fn, n, sbi->s_jseq, sbi->s_jhead);
+    // Transactions before head are all written in place, replay may skip them
+    if ((sbi->s_jhead + sbi->s_journal_len - sbi->s_jstart)%sbi->s_journal_len + n + 2 >= sbi->s_journal_len) {
+	rc = fs_journal_reset(s);
+	if (rc)
+	    goto out;
+    }
+
+    bh = fs_jblk_get(s, sbi->s_jhead, FS_JDESC, n);
+    if (!bh) {
+	rc = -EIO;
+	goto out;
+    }
+    jb = (struct d_jblk *)bh->b_data;
+    for (i=0; i < n; i++)
+	jb->j_blk[i] = sbi->s_jbh[i]->b_blocknr;
+    bhs[k++] = bh;
+    for (i=0; i < n; i++) {
+	bh = sb_getblk(s, fs_jblock(sbi, sbi->s_jhead + 1 + i));
+	if (!bh) {
+	    rc = -EIO;
+	    break;
+	}
+	lock_buffer(bh);
+	memcpy(bh->b_data, sbi->s_jbh[i]->b_data, s->s_blocksize);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	mark_buffer_dirty(bh);
+	bhs[k++] = bh;
+	if (k == FS_SCAN_BATCH) {
+	    ret = fs_write_bhs(bhs, k, 1);
+	    rc = rc ? rc : ret;
+	    k = 0;
+	}
+    }
+    ret = fs_write_bhs(bhs, k, 1);
+    rc = rc ? rc : ret;
+    if (rc)
+	goto out;
+
+    // Commit block is written after images are on disk, replay trusts them then
+    bh = fs_jblk_get(s, sbi->s_jhead + 1 + n, FS_JCOMMIT, n);
+    rc = bh ? fs_write_bhs(&bh, 1, 1) : -EIO;
+    if (rc)
+	goto out;
+    sbi->s_jhead = (sbi->s_jhead + n + 2)%sbi->s_journal_len;
+    sbi->s_jseq++;
+
+out:
+    if (rc)
+	printk(KERN_ERR FS_NAME ": %s: journal commit failed: %i\n", s->s_id, rc);
+    d("-%s rc: %i\n", fn, rc);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Returns buffer of journal block pos filled as descriptor or commit block of
+// next transaction, dirty and released by the caller
+/**********************************************************************************/
+struct buffer_head *fs_jblk_get(struct super_block *s, __u32 pos, int type, int n)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    struct buffer_head *bh;
+    struct d_jblk *jb;
+
+    bh = sb_getblk(s, fs_jblock(sbi, pos));
+    if (!bh)
+	return NULL;
+    lock_buffer(bh);
+    memset(bh->b_data, 0, s->s_blocksize);
+    jb = (struct d_jblk *)bh->b_data;
+    jb->j_magic = FS_JOURNAL_MAGIC;
+    jb->j_type = type;
+    jb->j_seq = sbi->s_jseq;
+    jb->j_count = n;
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    return bh;
+}
+
+
+
+/**********************************************************************************/
+// Block number of journal block pos, counted from the one after header
+/**********************************************************************************/
+__u32 fs_jblock(struct m_sb *sbi, __u32 pos)
+{
+    return sbi->s_journal_blk + 1 + pos%sbi->s_journal_len;
+}
+
+
+
+/**********************************************************************************/
+// Writes journal header, replay starts at next transaction then
+/**********************************************************************************/
+int fs_journal_reset(struct super_block *s)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    struct buffer_head *bh;
+    struct d_jhead *h;
+    int rc;
+
+    bh = sb_getblk(s, sbi->s_journal_blk);
+    if (!bh)
+	return -EIO;
+    lock_buffer(bh);
+    memset(bh->b_data, 0, s->s_blocksize);
+    h = (struct d_jhead *)bh->b_data;
+    h->j_magic = FS_JOURNAL_MAGIC;
+    h->j_seq = sbi->s_jseq;
+    h->j_start = sbi->s_jhead;
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    rc = fs_write_bhs(&bh, 1, 1);
+    if (!rc)
+	sbi->s_jstart = sbi->s_jhead;
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Blocks of a transaction too big for journal, or of a failed commit, are written
+// in place. Superblock says bitmap is not valid until fs_sync_super() is done with
+// them, so interrupted writes make next mount scan inode table. n blocks already
+// collected in s_jbh are dirtied and released.
+/**********************************************************************************/
+int fs_journal_bypass(struct super_block *s, int n)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    struct buffer_head *bh;
+    int rc, i;
+
+    d("%s: %i blocks collected\n", fn, n);
+    // Older transactions must not be replayed over blocks written now
+    rc = fs_journal_reset(s);
+    if (!rc) {
+	bh = fs_read_sb(s, 0);
+	rc = bh ? fs_write_bhs(&bh, 1, 1) : -EIO;
+    }
+    for (i=0; i < n; i++) {
+	mark_buffer_dirty(sbi->s_jbh[i]);
+	brelse(sbi->s_jbh[i]);
+    }
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Applies transactions committed to journal and makes replay start after them.
+// It takes time of journal size, not of file system one.
+/**********************************************************************************/
+int fs_journal_replay(struct super_block *s)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    struct buffer_head *bh, *cbh, *src, *dst;
+    struct d_jhead *h;
+    struct d_jblk *jb, *cb;
+    int rc = 0, i, n = 0, walked = 0;
+    unsigned long start = jiffies;
+
+    bh = sb_bread(s, sbi->s_journal_blk);
+    if (!bh) {
+	printk(KERN_ERR FS_NAME ": %s: unable to read journal header\n", s->s_id);
+	return -EIO;
+    }
+    h = (struct d_jhead *)bh->b_data;
+    if (FS_JOURNAL_MAGIC != h->j_magic || h->j_start >= sbi->s_journal_len) {
+	printk(KERN_ERR FS_NAME ": %s: bad journal header\n", s->s_id);
+	brelse(bh);
+	return -EINVAL;
+    }
+    sbi->s_jseq = h->j_seq;
+    sbi->s_jhead = sbi->s_jstart = h->j_start;
+    brelse(bh);
+
+    // Transaction without commit block, or left from a previous lap, ends the log
+    for (;;) {
+	bh = sb_bread(s, fs_jblock(sbi, sbi->s_jhead));
+	if (!bh) {
+	    rc = -EIO;
+	    break;
+	}
+	jb = (struct d_jblk *)bh->b_data;
+	if (FS_JOURNAL_MAGIC != jb->j_magic || FS_JDESC != jb->j_type || sbi->s_jseq != jb->j_seq
+	    || jb->j_count > FS_JBLK_MAX(s->s_blocksize) || walked + jb->j_count + 2 >= sbi->s_journal_len) {
+	    brelse(bh);
+	    break;
+	}
+	cbh = sb_bread(s, fs_jblock(sbi, sbi->s_jhead + 1 + jb->j_count));
+	cb = cbh ? (struct d_jblk *)cbh->b_data : NULL;
+	if (!cb || FS_JOURNAL_MAGIC != cb->j_magic || FS_JCOMMIT != cb->j_type
+	    || sbi->s_jseq != cb->j_seq || jb->j_count != cb->j_count) {
+	    brelse(cbh);
+	    brelse(bh);
+	    break;
+	}
+	brelse(cbh);
+	for (i=0; i < jb->j_count && !rc; i++) {
+	    if (jb->j_blk[i] >= sbi->s_journal_blk) {
+		printk(KERN_ERR FS_NAME ": %s: journal transaction %u has bad block %u\n",
+		    s->s_id, sbi->s_jseq, jb->j_blk[i]);
+		rc = -EINVAL;
+		break;
+	    }
+	    src = sb_bread(s, fs_jblock(sbi, sbi->s_jhead + 1 + i));
+	    dst = sb_getblk(s, jb->j_blk[i]);
+	    if (src && dst) {
+		lock_buffer(dst);
+		memcpy(dst->b_data, src->b_data, s->s_blocksize);
+		set_buffer_uptodate(dst);
+		unlock_buffer(dst);
+		mark_buffer_dirty(dst);
+	    } else
+		rc = -EIO;
+	    brelse(src);
+	    brelse(dst);
+	}
+	walked += jb->j_count + 2;
+	sbi->s_jhead = (sbi->s_jhead + jb->j_count + 2)%sbi->s_journal_len;
+	sbi->s_jseq++;
+	n++;
+	brelse(bh);
+	if (rc)
+	    break;
+    }
+
+    // Replayed blocks are on disk before journal forgets them
+    if (!rc && n) {
+	rc = sync_blockdev(s->s_bdev);
+	if (!rc)
+	    rc = fs_journal_reset(s);
+	printk(KERN_INFO FS_NAME ": %s: %i journal transactions replayed in %u ms\n",
+	    s->s_id, n, jiffies_to_msecs(jiffies - start));
+    }
+    if (rc)
+	printk(KERN_ERR FS_NAME ": %s: journal replay failed: %i\n", s->s_id, rc);
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Brings inode table blocks up to the one holding slot into use. Blocks past
+// s_itable_init were left unwritten by mkfs, they are cleared in cache instead of
+// being read and go to disk with the next commit, together with the superblock
+// recording them. Caller holds s_lock and s_jsem for read.
+/**********************************************************************************/
+int fs_itable_extend(struct super_block *s, int slot)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    struct buffer_head *bh;
+
+    while (slot/sbi->s_ino_per_blk >= sbi->s_itable_init) {
+	bh = sb_getblk(s, FS_INO_BLK + sbi->s_itable_init);
+	if (!bh)
+	    return -EIO;
+	lock_buffer(bh);
+	memset(bh->b_data, 0, bh->b_size);
+	set_buffer_uptodate(bh);
+	unlock_buffer(bh);
+	fs_dirty_slot(s, sbi->s_itable_init*sbi->s_ino_per_blk, bh);
+	brelse(bh);
+	sbi->s_itable_init++;
+    }
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Submits dirty buffers at once, waits for them if wait and releases them
+/**********************************************************************************/
+int fs_write_bhs(struct buffer_head **bhs, int n, int wait)
+{
+    int i, rc = 0;
+
+    if (!n)
+	return 0;
+    ll_rw_block(SWRITE, n, bhs);
+    for (i=0; i < n; i++) {
+	if (wait) {
+	    wait_on_buffer(bhs[i]);
+	    if (!buffer_uptodate(bhs[i]))
+		rc = -EIO;
+	}
+	brelse(bhs[i]);
+    }
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Marks inode table block of slot changed, caller holds s_jsem for read. Block is
+// not dirtied, it reaches disk through next journal commit only and the reference
+// taken here keeps it in cache till then.
+/**********************************************************************************/
+void fs_dirty_slot(struct super_block *s, int slot, struct buffer_head *bh)
+{
+    struct m_sb *sbi = s->s_fs_info;
+
+    if (!test_and_set_bit(slot/sbi->s_ino_per_blk, sbi->s_itable_dirty))
+	get_bh(bh);
+    s->s_dirt = 1;
+}
+
+
+
+/**********************************************************************************/
+// Reads block bitmap saved by fs_sync_super()
+/**********************************************************************************/
+int fs_load_bitmap(struct super_block *s)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    struct buffer_head *bh;
+    int i, len, size = sbi->s_ndata/8 + (sbi->s_ndata%8 ? 1 : 0);
+    int bsize = s->s_blocksize;
+
+    for (i=0; i*bsize < size; i++) {
+	bh = sb_bread(s, sbi->s_bmap_blk + i);
+	if (!bh) {
+	    printk(KERN_ERR FS_NAME ": %s: unable to read bitmap block %i\n", s->s_id, sbi->s_bmap_blk + i);
+	    return -EIO;
+	}
+	len = min(size - i*bsize, bsize);
+	memcpy(sbi->s_inode_bm + i*bsize, bh->b_data, len);
+	brelse(bh);
+    }
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+// Counts free data blocks in block bitmap
+/**********************************************************************************/
+int fs_count_free_blk(struct super_block *s)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    int i, rc = 0;
+
+    for (i=0; i < sbi->s_ngroups; i++)
+	rc += sbi->s_group_free[i];
+    return rc;
+}
+
+
+
+/**********************************************************************************/
+// Builds bitmap summaries and group counts from block bitmap at mount. Bits past
+// the end of every level are set, so searches never return them.
+/**********************************************************************************/
+int fs_bm_build(struct super_block *s)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    unsigned long *bm;
+    int i, lv, nbits;
+
+    sbi->s_bm[0] = (unsigned long *)sbi->s_inode_bm;
+    sbi->s_bm_bits[0] = sbi->s_ndata;
+    for (lv = 0; ; lv++) {
+	bm = sbi->s_bm[lv];
+	nbits = sbi->s_bm_bits[lv];
+	for (i = nbits; i < BITS_TO_LONGS(nbits)*BITS_PER_LONG; i++)
+	    __set_bit(i, bm);
+	if (nbits <= BITS_PER_LONG || lv + 1 == FS_BM_LEVELS)
+	    break;
+	nbits = BITS_TO_LONGS(nbits);
+	sbi->s_bm[lv + 1] = fs_alloc_table(BITS_TO_LONGS(nbits)*sizeof(long));
+	if (!sbi->s_bm[lv + 1])
+	    return -ENOMEM;
+	memset(sbi->s_bm[lv + 1], 0, BITS_TO_LONGS(nbits)*sizeof(long));
+	sbi->s_bm_bits[lv + 1] = nbits;
+	for (i=0; i < nbits; i++)
+	    if (!~bm[i])
+		__set_bit(i, sbi->s_bm[lv + 1]);
+    }
+    sbi->s_bm_levels = lv + 1;
+
+    sbi->s_group_bits = s->s_blocksize_bits + 3;
+    sbi->s_ngroups = (sbi->s_ndata >> sbi->s_group_bits) + 1;
+    sbi->s_group_free = fs_alloc_table(sbi->s_ngroups*sizeof(__u32));
+    if (!sbi->s_group_free)
+	return -ENOMEM;
+    memset(sbi->s_group_free, 0, sbi->s_ngroups*sizeof(__u32));
+    for (i = find_next_zero_bit(sbi->s_bm[0], sbi->s_ndata, 0); i < sbi->s_ndata;
+	    i = find_next_zero_bit(sbi->s_bm[0], sbi->s_ndata, i + 1))
+	sbi->s_group_free[i >> sbi->s_group_bits]++;
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+void fs_bm_destroy(struct m_sb *sbi)
+{
+    int lv;
+
+    for (lv = 1; lv < FS_BM_LEVELS && sbi->s_bm[lv]; lv++)
+	fs_free_table(sbi->s_bm[lv], BITS_TO_LONGS(sbi->s_bm_bits[lv])*sizeof(long));
+    if (sbi->s_group_free)
+	fs_free_table(sbi->s_group_free, sbi->s_ngroups*sizeof(__u32));
+}
+
+
+
+/**********************************************************************************/
+// Marks block bit used, word becoming full is marked in the level above, and so on
+/**********************************************************************************/
+void fs_bm_set(struct m_sb *sbi, int i)
+{
+    int lv;
+
+    sbi->s_group_free[i >> sbi->s_group_bits]--;
+    for (lv = 0; lv < sbi->s_bm_levels; lv++) {
+	__set_bit(i, sbi->s_bm[lv]);
+	i /= BITS_PER_LONG;
+	if (~sbi->s_bm[lv][i])
+	    break;
+    }
+}
+
+
+
+/**********************************************************************************/
+// Marks block bit free, full words above it stop being full
+/**********************************************************************************/
+void fs_bm_clear(struct m_sb *sbi, int i)
+{
+    int lv;
+
+    sbi->s_group_free[i >> sbi->s_group_bits]++;
+    for (lv = 0; lv < sbi->s_bm_levels; lv++) {
+	if (lv && !test_bit(i, sbi->s_bm[lv]))
+	    break;
+	__clear_bit(i, sbi->s_bm[lv]);
+	i /= BITS_PER_LONG;
+    }
+}
+
+
+
+/**********************************************************************************/
+// Copies len bytes of bitmap from byte off to dst, blocks waiting for commit and
+// unused blocks of reservation windows shown free: no inode owns them if replay
+// brings this bitmap back. Returns whether dst has changed.
+/**********************************************************************************/
+int fs_bm_image(struct m_sb *sbi, char *dst, int off, int len)
+{
+    char *src = sbi->s_inode_bm + off, *pend = (char *)sbi->s_free_pend + off, c;
+    char *win = (char *)sbi->s_win_bm + off;
+    int i, changed = 0;
+
+    if (!sbi->s_npend && !sbi->s_nwin) {
+	changed = memcmp(dst, src, len) != 0;
+	if (changed)
+	    memcpy(dst, src, len);
+	return changed;
+    }
+    for (i=0; i < len; i++) {
+	c = src[i] & ~pend[i] & ~win[i];
+	if (dst[i] != c) {
+	    dst[i] = c;
+	    changed = 1;
+	}
+    }
+    return changed;
+}
 
-    // Clearing inode bitmap
-    for (i=0; i < FS_IDATA; i++) {
-	//d("i_data[%i]: %i\n", i, fsi->i_data[i]);
-	if (fsi->i_data[i])
-	    clear_bit(fsi->i_data[i] - sbi->s_nnodes/FS_INO_PER_BLK - 1, (void *)sbi->s_inode_bm);    
+
+
+/**********************************************************************************/
+// Returns first free block bit at or after start, -1 if there is none. Search goes
+// up the summaries until a level has a not full word past start, then down to the
+// block bitmap, so it costs a few word reads per level.
+/**********************************************************************************/
+int fs_bm_find_free(struct m_sb *sbi, int start)
+{
+    unsigned long word;
+    int lv = 0, pos = start, w;
+
+    for (;;) {
+	if (pos >= sbi->s_bm_bits[lv])
+	    return -1;
+	w = pos/BITS_PER_LONG;
+	word = sbi->s_bm[lv][w] | ((1UL << (pos % BITS_PER_LONG)) - 1);
+	if (~word) {
+	    pos = w*BITS_PER_LONG + ffz(word);
+	    break;
+	}
+	// Top level is scanned word by word, it is a word or few long
+	if (lv + 1 == sbi->s_bm_levels)
+	    pos = (w + 1)*BITS_PER_LONG;
+	else {
+	    lv++;
+	    pos = w + 1;
+	}
     }
-out:
-    d("-%s\n", fn);
+    for (; lv > 0; lv--)
+	pos = pos*BITS_PER_LONG + ffz(sbi->s_bm[lv - 1][pos]);
+    return pos < sbi->s_ndata ? pos : -1;
 }
 
 
 
 /**********************************************************************************/
-void fs_put_super(struct super_block *s)
+// Looks for free run of max blocks (at most a group) starting at free bit i or in
+// next FS_RUN_GROUPS groups having that much free blocks. Returns start of run
+// found, i if there is none.
+/**********************************************************************************/
+int fs_bm_find_run(struct m_sb *sbi, int i, int max)
 {
-    struct m_sb *sbi;
-    int i;
+    unsigned long *bm = sbi->s_bm[0];
+    int g, j, e, gend, want = min_t(int, max, 1 << sbi->s_group_bits);
 
-    d("=%s\n", fn);
-    sbi = s->s_fs_info;
-    s->s_fs_info = NULL;
-    if (sbi) {
-	if (sbi->s_lookup) {
-	    for (i=0; i < sbi->s_nnodes; i++)
-		if (sbi->s_lookup[i])
-		    kfree(sbi->s_lookup[i]);
-	    kfree(sbi->s_lookup);
+    if (find_next_bit(bm, min_t(int, sbi->s_ndata, i + want), i) - i >= want)
+	return i;
+    for (g = i >> sbi->s_group_bits; g < sbi->s_ngroups && g < (i >> sbi->s_group_bits) + FS_RUN_GROUPS; g++) {
+	if (sbi->s_group_free[g] < want)
+	    continue;
+	gend = min_t(int, (g + 1) << sbi->s_group_bits, sbi->s_ndata);
+	for (j = max_t(int, g << sbi->s_group_bits, i); ; j = e) {
+	    j = find_next_zero_bit(bm, gend, j);
+	    if (j >= gend)
+		break;
+	    e = find_next_bit(bm, min_t(int, sbi->s_ndata, j + want), j);
+	    if (e - j >= want)
+		return j;
 	}
-	kfree(sbi);
     }
-    d("-%s\n", fn);
+    return i;
 }
 
 
@@ -444,29 +2500,26 @@ int fs_write_inode(struct inode *inode, int wait)
 {
     struct d_ino *di;
     struct buffer_head *bh;
-    int rc = 0, i;
+    int rc = 0;
     struct fs_inode_info *fsi = fs_i(inode);
-    char *fname0, fname1[FS_FNAME_LEN+1];
+    struct m_sb *sbi = inode->i_sb->s_fs_info;
 
     d("=%s(inode: %lu, wait: %i)\n", fn, inode->i_ino, wait);
     if (FS_ROOT_INO == inode->i_ino) {
 	d("inode %i is not a raw inode\n", FS_ROOT_INO);
 	goto out;
     }
-    i = inode->i_ino - FS_ROOT_INO - 1;
-    bh = sb_bread(inode->i_sb, FS_INO_BLK + i/FS_INO_PER_BLK);
-//d("i: %i, %i, bh: %p\n", i, FS_INO_BLK + i/FS_INO_PER_BLK, bh);
-    if (!bh)
+    if (!inode->i_nlink) {
+	d("inode %lu is unlinked, fs_delete_inode() will free it\n", inode->i_ino);
 	goto out;
-    di = (struct d_ino*)(bh->b_data) + i % FS_INO_PER_BLK;
-
-    fname0 = fs_inode_to_name(inode);
-    if (!fname0) {
-	d("Bug: unlinked inode (%lu) was found\n", inode->i_ino);
-	sprintf(fname1, "ufile%lu", inode->i_ino);
-	fname0 = fname1;
     }
-    strncpy(di->name, fname0, FS_FNAME_LEN);
+    di = fs_slot_bread(inode->i_sb, FS_INO_SLOT(inode->i_ino), &bh);
+    if (!di)
+	goto out;
+
+    // Name fields are written by fs_mknod() and fs_rename()
+    down_read(&sbi->s_jsem);
+    lock_buffer(bh);
     di->i_ino = inode->i_ino;
     di->i_mode = inode->i_mode;
     di->i_uid = inode->i_uid;
@@ -474,9 +2527,19 @@ int fs_write_inode(struct inode *inode, int wait)
     di->i_size = inode->i_size;
     di->i_nlinks = 1;
     di->i_time = inode->i_mtime.tv_sec;
-    for (i=0; i<FS_IDATA; i++)
-        di->i_data[i] = fsi->i_data[i];
-    mark_buffer_dirty(bh);
+    // Writeback may be adding extents meanwhile, lock order is buffer, i_map_lock
+    mutex_lock(&fsi->i_map_lock);
+    di->i_nextents = fsi->i_nextents;
+    di->i_ind = fsi->i_ind;
+    di->i_dind = fsi->i_dind;
+    di->i_flags = fsi->i_flags;
+    memcpy(di->i_ext, fsi->i_ext, sizeof(di->i_ext));
+    mutex_unlock(&fsi->i_map_lock);
+    unlock_buffer(bh);
+    // Table block goes to disk with others at next commit, sync(2) waits for it
+    // in fs_sync_fs()
+    fs_dirty_slot(inode->i_sb, FS_INO_SLOT(inode->i_ino), bh);
+    up_read(&sbi->s_jsem);
     brelse(bh);
 
 out:
@@ -507,7 +2570,6 @@ void fs_read_inode(struct inode *inode)
 	struct buffer_head *bh;
 	struct d_ino *di;
 	struct fs_inode_info *fsi = fs_i(inode);
-	int i;
     
 	inode->i_op = &fs_file_inops;
 	inode->i_fop = &fs_file_ops;
@@ -519,6 +2581,7 @@ void fs_read_inode(struct inode *inode)
 	    return;
 	}
 
+	lock_buffer(bh);
         inode->i_size = di->i_size;
         //inode->u.generic_ip = (void *)di->st;
         inode->i_mode = di->i_mode;
@@ -527,13 +2590,15 @@ void fs_read_inode(struct inode *inode)
 	inode->i_gid = di->i_gid;	
 	inode->i_atime.tv_sec = inode->i_mtime.tv_sec = inode->i_ctime.tv_sec = di->i_time;
 
-	int blk0_off = 1 + sbi->s_nnodes/FS_INO_PER_BLK + (sbi->s_nnodes%FS_INO_PER_BLK ? 1 : 0);
-d("blk0_off: %i\n", blk0_off);
-	for (i=0; i < FS_IDATA; i++) {
-	    fsi->i_data[i] = di->i_data[i];
-	    if (fsi->i_data[i])
-		set_bit(fsi->i_data[i] - blk0_off, (void *)sbi->s_inode_bm);
-	}
+	// Block bitmap has been filled by fs_scan_inodes() at mount
+	fsi->i_nextents = min_t(__u32, di->i_nextents, sbi->s_max_extents);
+	fsi->i_ind = di->i_ind;
+	fsi->i_dind = di->i_dind;
+	fsi->i_flags = di->i_flags;
+	if (fsi->i_flags & FS_INLINE_DATA)
+	    fsi->i_nextents = 0;
+	memcpy(fsi->i_ext, di->i_ext, sizeof(fsi->i_ext));
+	unlock_buffer(bh);
         brelse(bh);
     }
 
@@ -548,21 +2613,19 @@ d("blk0_off: %i\n", blk0_off);
 /**********************************************************************************/
 ino_t fs_name_to_inode(struct super_block *s, struct dentry *de)
 {
-    ino_t rc = 0;
-    int i; 
+    ino_t rc;
+    int slot;
     struct m_sb *sbi = s->s_fs_info;
-    struct lookup_entry *le;
+    unsigned seq;
     
     d("=%s(dentry: %s)\n", fn, de->d_name.name);    
-    for (i=0; i < sbi->s_nnodes; i++) {
-	le = sbi->s_lookup[i];
-	if (!le)
-	    continue;
-	if (!strncmp(le->name, de->d_name.name, FS_FNAME_LEN)) {
-	    rc = le->i_ino;
-	    break;
-	}
-    }
+    rcu_read_lock();
+    do {
+	seq = read_seqcount_begin(&sbi->s_name_seq);
+	slot = fs_lookup_find(s, de->d_name.name, de->d_name.len);
+	rc = slot < 0 ? 0 : sbi->s_name_ino[slot];
+    } while (read_seqcount_retry(&sbi->s_name_seq, seq));
+    rcu_read_unlock();
     
     d("-%s rc: %lu\n", fn, rc);
     return rc;
@@ -578,18 +2641,19 @@ struct dentry *fs_lookup(struct inode *dir, struct dentry *dentry, struct nameid
     struct dentry *rc = NULL;
 
     d("=%s(dentry: %s)\n", fn, dentry->d_name.name);
+    if (dentry->d_name.len > FS_NAME_MAX) {
+	rc = ERR_PTR(-ENAMETOOLONG);
+	goto l_end;
+    }
     ino = fs_name_to_inode(dir->i_sb, dentry);
     
-    lock_kernel();
     if (ino) {
 	p_ino = iget(dir->i_sb, ino);
 	if (!p_ino) { 
 	    rc = ERR_PTR(-EACCES);
-	    unlock_kernel();
 	    goto l_end;
 	}
     }
-    unlock_kernel();
     d_add(dentry, p_ino);
 
 l_end:
@@ -599,61 +2663,59 @@ l_end:
 
 
 
+/**********************************************************************************/
+// Directory is listed from name cache. f_pos is 0 for ".", 1 for ".." and
+// slot + 2 for files, so a listing resumes at the slot it stopped on.
 /**********************************************************************************/
 int fs_readdir(struct file *f, void *dirent, filldir_t filldir)
 {
     struct inode *dir = f->f_dentry->d_inode;
     struct super_block *s = dir->i_sb;
-    int rc = 0;
-    struct d_ino *di;
-    int i, j;
-    struct buffer_head *bh;
+    int rc = 0, slot, len, named;
     struct m_sb *sbi = (struct m_sb *)s->s_fs_info;
-    struct lookup_entry *le;
-    char fname[FS_FNAME_LEN+1];
+    char fname[FS_NAME_MAX+1];
+    ino_t ino;
+    unsigned seq;
 
     d("=%s\n", fn);
     d("dir->i_ino: %lu, dir->i_size: %lli, f->f_pos: %lli\n", dir->i_ino, dir->i_size, f->f_pos);
 
-    lock_kernel();
-    if (f->f_pos)
+    if (f->f_pos == 0) {
+	if (filldir(dirent, ".", 1, f->f_pos, FS_ROOT_INO, DT_DIR) < 0)
+	    goto out;
+	f->f_pos++;
+    }
+    if (f->f_pos == 1) {
+	if (filldir(dirent, "..", 2, f->f_pos, FS_ROOT_INO, DT_DIR) < 0)
+	    goto out;
+	f->f_pos++;
+    }
+    if (f->f_pos - 2 >= sbi->s_nnodes)
 	goto out;
-        
-    rc = filldir(dirent, ".", 1, f->f_pos++, FS_ROOT_INO, DT_UNKNOWN);
-    rc = filldir(dirent, "..", 2, f->f_pos++, FS_ROOT_INO, DT_UNKNOWN);
 
-    for (i=0; i < sbi->s_nnodes/FS_INO_PER_BLK; i++) {
-	bh = sb_bread(s, FS_INO_BLK + i);
-	if (!bh) {
-	    d("unable to read i-node table's block %i\n", FS_INO_BLK + 1);
-	    goto out;
-	}
-	di = (struct d_ino*)bh->b_data;
-	for (j=0; j < FS_INO_PER_BLK; j++) {
-//d("di[%i].i_nlinks: %i\n", j, di[j].i_nlinks);
-	    if (di[j].i_nlinks) {
-		int size = strnlen(di[j].name, FS_FNAME_LEN);
-		rc = filldir(dirent, di[j].name, size, f->f_pos++, di[j].i_ino, DT_UNKNOWN);
-		strncpy(fname, di[j].name, FS_FNAME_LEN);
-		fname[FS_FNAME_LEN] = 0;
-		d("di[%i].name: %s, f->f_pos: %llu, filldir: %i\n", j, fname, f->f_pos, rc);
-		
-		// Inserting new name into name cache
-		le = kmalloc(sizeof(*le), GFP_KERNEL);
-		if (!le)
-		    continue;
-		if (sbi->s_lookup[i*FS_INO_PER_BLK+j])
-		    kfree(sbi->s_lookup[i*FS_INO_PER_BLK+j]);
-		sbi->s_lookup[i*FS_INO_PER_BLK+j] = le;
-		strncpy(le->name, di[j].name, FS_FNAME_LEN);
-		le->i_ino = di[j].i_ino;
-	    }
-	}
-	brelse(bh);
+    for (slot = f->f_pos - 2; slot < sbi->s_nnodes; slot++) {
+	slot = find_next_bit(sbi->s_slot_named, sbi->s_nnodes, slot);
+	if (slot >= sbi->s_nnodes)
+	    break;
+	// Name is copied out, filldir() may sleep on user buffer
+	rcu_read_lock();
+	do {
+	    seq = read_seqcount_begin(&sbi->s_name_seq);
+	    named = test_bit(slot, sbi->s_slot_named);
+	    len = fs_name_copy(sbi, slot, fname);
+	    ino = sbi->s_name_ino[slot];
+	} while (read_seqcount_retry(&sbi->s_name_seq, seq));
+	rcu_read_unlock();
+	if (!named)
+	    continue;
+	fname[len] = 0;
+	if (filldir(dirent, fname, len, slot + 2, ino, DT_UNKNOWN) < 0)
+	    break;
+	d("slot: %i, name: %s\n", slot, fname);
     }
+    f->f_pos = slot + 2;
 
 out:
-    unlock_kernel();
     d("-%s rc: %i\n", fn, rc);
     return rc;
 }
@@ -663,27 +2725,22 @@ out:
 /**********************************************************************************/
 struct d_ino *fs_raw_inode(struct super_block *s, ino_t ino, struct buffer_head **bh)
 {
+    struct m_sb *sbi = s->s_fs_info;
     struct d_ino *rc = NULL;
     int i;
-    struct m_sb *sbi = s->s_fs_info;
-    struct lookup_entry *le;
 
     d("=%s(ino: %lu)\n", fn, ino);
     
-    for (i=0; i < sbi->s_nnodes; i++) {
-	le = sbi->s_lookup[i];
-	if (!le)
-	    continue;
-	if (le->i_ino == ino) {
-	    *bh = sb_bread(s, FS_INO_BLK + i/FS_INO_PER_BLK);
-	    if (!*bh) {
-		d("unable to read inode %i\n", i);
-		rc = NULL;
-		goto out;
-	    }
-	    rc = (struct d_ino*)((*bh)->b_data) + i % FS_INO_PER_BLK;
-	    break;
-	}
+    i = fs_ino_to_slot(s, ino);
+    if (i < 0 || i/sbi->s_ino_per_blk >= sbi->s_itable_init)
+	goto out;
+    rc = fs_slot_bread(s, i, bh);
+    if (!rc)
+	goto out;
+    if (!rc->i_nlinks || rc->i_ino != ino) {
+	d("slot %i does not hold inode %lu\n", i, ino);
+	brelse(*bh);
+	rc = NULL;
     }
     
 out:
@@ -693,6 +2750,23 @@ out:
 
 
 
+/**********************************************************************************/
+// Reads inode table block holding slot, returns pointer to the slot in it
+/**********************************************************************************/
+struct d_ino *fs_slot_bread(struct super_block *s, int slot, struct buffer_head **bh)
+{
+    struct m_sb *sbi = s->s_fs_info;
+
+    *bh = sb_bread(s, FS_INO_BLK + slot/sbi->s_ino_per_blk);
+    if (!*bh) {
+	d("unable to read inode table slot %i\n", slot);
+	return NULL;
+    }
+    return (struct d_ino *)((*bh)->b_data) + slot % sbi->s_ino_per_blk;
+}
+
+
+
 /**********************************************************************************/
 int fs_create(struct inode *dir, struct dentry *dentry, int mode, struct nameidata *nd)
 {
@@ -708,16 +2782,21 @@ int fs_mknod(struct inode *dir, struct dentry *dentry, int mode, dev_t rdev)
     struct super_block *s = dir->i_sb;
     struct inode *inode;
     struct buffer_head *bh;
-    struct lookup_entry *le;
     struct m_sb *sbi = s->s_fs_info;
+    const char *name = dentry->d_name.name;
+    int len = dentry->d_name.len, name_blk;
  
     d("=%s(dir->i_ino: %lu)\n", fn, dir->i_ino);
+    if (len > FS_NAME_MAX)
+	return -ENAMETOOLONG;
+    name_blk = fs_write_name(s, name, len);
+    if (name_blk < 0)
+	return name_blk;
     inode = new_inode(s);
     if (!inode) {
 	rc = -ENOSPC;
-	goto out;
+	goto out_name;
     }
-    lock_kernel();
     
     inode->i_uid = current->fsuid;
     inode->i_gid = (dir->i_mode & S_ISGID) ? dir->i_gid : current->fsgid;
@@ -727,48 +2806,76 @@ int fs_mknod(struct inode *dir, struct dentry *dentry, int mode, dev_t rdev)
     inode->i_fop = &fs_file_ops;
     inode->i_mapping->a_ops = &fs_aops;
     inode->i_mode = mode;
-    i = fs_find_free_inode(s);
+    // New file starts inline, first write past FS_INLINE_LEN moves it to blocks
+    fs_i(inode)->i_flags = FS_INLINE_DATA;
+
+    // Name check and slot claim are done under one lock, name cache entry
+    // is what marks slot as taken. Table block of a slot past s_itable_init is
+    // brought into use in the same transaction.
+    down_read(&sbi->s_jsem);
+    mutex_lock(&sbi->s_lock);
+    if (fs_lookup_find(s, name, len) >= 0)
+	rc = -EEXIST;
+    else {
+	i = fs_find_free_inode(s);
 d("New inode %i\n", i);
-    if (FS_ROOT_INO == i) {
-	rc = -ENFILE;
-	unlock_kernel();
-	goto out;
+	if (FS_ROOT_INO == i)
+	    rc = -ENFILE;
+	else
+	    rc = fs_itable_extend(s, FS_INO_SLOT(i));
+	if (!rc)
+	    rc = fs_lookup_add(s, FS_INO_SLOT(i), name, len, fs_name_hash(name, len), i);
+    }
+    mutex_unlock(&sbi->s_lock);
+    up_read(&sbi->s_jsem);
+    if (rc) {
+	iput(inode);
+	goto out_name;
     }
     inode->i_ino = i;
+    percpu_counter_mod(&sbi->s_freeinodes_counter, -1);
     //inode->u.generic_ip = (void *)(i_ino + 1);
     
     insert_inode_hash(inode);
     mark_inode_dirty(inode);
 
     // Writing new inode to disk
-    i = inode->i_ino - FS_ROOT_INO - 1;
-    bh = sb_bread(inode->i_sb, FS_INO_BLK + i/FS_INO_PER_BLK);
-    if (!bh) {
-	unlock_kernel();
-	goto out;
+    struct d_ino *di = fs_slot_bread(inode->i_sb, FS_INO_SLOT(inode->i_ino), &bh);
+    if (!di) {
+	// Claim is undone here, deletion of a bad inode leaves slot alone
+	mutex_lock(&sbi->s_lock);
+	fs_lookup_del(s, FS_INO_SLOT(inode->i_ino));
+	mutex_unlock(&sbi->s_lock);
+	percpu_counter_mod(&sbi->s_freeinodes_counter, 1);
+	make_bad_inode(inode);
+	inode->i_nlink = 0;
+	iput(inode);
+	rc = -EIO;
+	goto out_name;
     }
-    struct d_ino *di = (struct d_ino*)(bh->b_data) + i % FS_INO_PER_BLK;
-    strncpy(di->name, dentry->d_name.name, FS_FNAME_LEN);
+    down_read(&sbi->s_jsem);
+    lock_buffer(bh);
+    fs_set_dname(di, name, len, name_blk);
     di->i_ino = inode->i_ino;
     di->i_mode = inode->i_mode;
     di->i_size = inode->i_size;
     di->i_nlinks = 1;
-    di->i_data[0] = di->i_data[1] = di->i_data[2] = 0;
-    mark_buffer_dirty(bh);
+    di->i_nextents = 0;
+    di->i_ind = di->i_dind = 0;
+    di->i_flags = FS_INLINE_DATA;
+    memset(di->i_ext, 0, sizeof(di->i_ext));
+    unlock_buffer(bh);
+    fs_dirty_slot(s, FS_INO_SLOT(inode->i_ino), bh);
+    up_read(&sbi->s_jsem);
     brelse(bh);
 
-    // Adding inode to our cache
-    le = kmalloc(sizeof(*le), GFP_KERNEL);
-    if (le) {
-	le->i_ino = inode->i_ino;
-	strncpy(le->name, dentry->d_name.name, FS_FNAME_LEN); 
-        sbi->s_lookup[i] = le;
-    } else
-	d("ERR: Unable to allocate memory for lookup_entry\n");
     // Adding inode to dcache
-    unlock_kernel();
     d_instantiate(dentry, inode);
-    
+    goto out;
+
+out_name:
+    if (name_blk)
+	fs_free_blk(s, name_blk, 1);
 out:
     d("-%s rc: %i\n", fn, rc);
     return rc;
@@ -782,22 +2889,31 @@ int fs_find_free_inode(struct super_block *s)
     int rc = FS_ROOT_INO;
     int i;
     struct m_sb *sbi = s->s_fs_info;
-    struct lookup_entry *le;
     
     d("=%s\n", fn);
-    for (i=0; i < sbi->s_nnodes; i++) {
-	le = sbi->s_lookup[i];
-	if (!le) {
-	    rc = FS_ROOT_INO + i + 1;
-	    break;
-	}
-    }
+    i = find_first_zero_bit(sbi->s_slot_used, sbi->s_nnodes);
+    if (i < sbi->s_nnodes)
+	rc = FS_SLOT_INO(i);
     d("-%s rc: %i\n", fn, rc);    
     return rc;
 }
 
 
 
+/**********************************************************************************/
+// Inode numbers map directly to inode table slots, returns -1 for foreign numbers
+/**********************************************************************************/
+int fs_ino_to_slot(struct super_block *s, ino_t ino)
+{
+    struct m_sb *sbi = s->s_fs_info;
+
+    if (ino <= FS_ROOT_INO || ino > FS_SLOT_INO(sbi->s_nnodes - 1))
+	return -1;
+    return FS_INO_SLOT(ino);
+}
+
+
+
 /**********************************************************************************/
 int fs_unlink(struct inode *dir, struct dentry *dentry)
 {
@@ -820,25 +2936,17 @@ int fs_unlink(struct inode *dir, struct dentry *dentry)
 int fs_statfs(struct super_block *s, struct kstatfs *buf)
 {
     struct m_sb *sbi = s->s_fs_info;
-    int i, bfree = 0, ffree = 0;
 
 d("* %s\n", fn);
-    for (i=0; i < sbi->s_nnodes; i++) {
-	bfree += test_bit(i, (void *)sbi->s_inode_bm)*(-1);
-	if (sbi->s_lookup[i])
-	    ffree++;
-    }
-    bfree = sbi->s_nnodes - bfree;
-    ffree = sbi->s_nnodes - ffree;
 
     buf->f_type = s->s_magic;
     buf->f_bsize = s->s_blocksize;
-    buf->f_namelen = FS_FNAME_LEN;
-    buf->f_blocks = sbi->s_nnodes;
-    buf->f_bfree = bfree;
+    buf->f_namelen = FS_NAME_MAX;
+    buf->f_blocks = sbi->s_ndata;
+    buf->f_bfree = percpu_counter_read_positive(&sbi->s_freeblocks_counter);
     buf->f_bavail = buf->f_bfree;
     buf->f_files = sbi->s_nnodes;
-    buf->f_ffree = ffree;
+    buf->f_ffree = percpu_counter_read_positive(&sbi->s_freeinodes_counter);
 
     return 0;
 }
@@ -854,7 +2962,15 @@ struct inode *fs_alloc_inode(struct super_block *s)
     fi = (struct fs_inode_info *)kmem_cache_alloc(fs_inode_cachep, SLAB_KERNEL);
     if (!fi)
 	goto out;
-    fi->i_data[0] = fi->i_data[1] = fi->i_data[2] = 0;
+    memset(fi->i_ext, 0, sizeof(fi->i_ext));
+    fi->i_ind = fi->i_dind = 0;
+    fi->i_nextents = 0;
+    fi->i_flags = 0;
+    fi->i_cache_idx = 0;
+    fi->i_cache_lblk = 0;
+    fi->i_goal = 0;
+    fi->i_delayed = 0;
+    fi->i_win_len = fi->i_win_resv = 0;
     rc = &fi->vfs_inode;
 
 out:
@@ -912,33 +3028,328 @@ void init_once(void *foo, kmem_cache_t *cachep, unsigned long flags)
     struct fs_inode_info *fi = (struct fs_inode_info *)foo;
 
 d("=%s\n", fn);
-    if ((flags & (SLAB_CTOR_VERIFY|SLAB_CTOR_CONSTRUCTOR)) == SLAB_CTOR_CONSTRUCTOR)
+    if ((flags & (SLAB_CTOR_VERIFY|SLAB_CTOR_CONSTRUCTOR)) == SLAB_CTOR_CONSTRUCTOR) {
 	inode_init_once(&fi->vfs_inode);
+	mutex_init(&fi->i_map_lock);
+    }
 }
 
 
 
 /**********************************************************************************/
-char *fs_inode_to_name(struct inode *inode)
+// Name as name cache key, first len bytes of name zero padded to FS_FNAME_LEN
+/**********************************************************************************/
+void fs_name_key(const char *name, int len, __u64 *lo, __u16 *hi)
 {
-    char *rc = NULL;
-    int i; 
-    struct m_sb *sbi = inode->i_sb->s_fs_info;
-    struct lookup_entry *le;
-    
-    d("=%s(inode: %lu)\n", fn, inode->i_ino);    
-    for (i=0; i < sbi->s_nnodes; i++) {
-	le = sbi->s_lookup[i];
-	if (!le)
+    char key[FS_FNAME_LEN];
+
+    memset(key, 0, FS_FNAME_LEN);
+    memcpy(key, name, len);
+    memcpy(lo, key, 8);
+    memcpy(hi, key + 8, 2);
+}
+
+
+
+/**********************************************************************************/
+// Name cache hash chain head for name hash
+/**********************************************************************************/
+__u32 *fs_name_bucket(struct m_sb *sbi, __u32 hval)
+{
+    return sbi->s_name_hash + hash_long(hval, sbi->s_name_hash_bits);
+}
+
+
+
+/**********************************************************************************/
+// Finds name in name cache, returns slot or -1. Caller holds s_lock, or
+// rcu_read_lock() and retries on s_name_seq; a chain seen mid update is walked
+// at most s_nnodes steps.
+/**********************************************************************************/
+int fs_lookup_find(struct super_block *s, const char *name, int len)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    struct fs_name_tail *tail;
+    __u32 hval = fs_name_hash(name, len), n, steps;
+    __u64 lo;
+    __u16 hi;
+
+    fs_name_key(name, min(len, FS_FNAME_LEN), &lo, &hi);
+    n = *fs_name_bucket(sbi, hval);
+    for (steps = 0; n && steps < sbi->s_nnodes; steps++, n = sbi->s_name_next[n - 1]) {
+	// Hash and first FS_FNAME_LEN bytes are compared as words, name bytes
+	// beyond them only for a likely match
+	if (sbi->s_name_hval[n - 1] != hval || sbi->s_key_lo[n - 1] != lo ||
+	    sbi->s_key_hi[n - 1] != hi || sbi->s_name_len[n - 1] != len)
 	    continue;
-	if (inode->i_ino == le->i_ino) {
-	    rc = le->name;
-	    break;
-	}
+	if (len <= FS_FNAME_LEN)
+	    return n - 1;
+	// Length and tail are published apart, a reader may pair new length with old tail
+	tail = rcu_dereference(sbi->s_name_tail[n - 1]);
+	if (tail && tail->len == len - FS_FNAME_LEN
+	    && !memcmp(tail->name, name + FS_FNAME_LEN, tail->len))
+	    return n - 1;
     }
-    
-    d("-%s rc: %p\n", fn, rc);
-    return rc;
+    return -1;
+}
+
+
+
+/**********************************************************************************/
+// Copies name of slot to buf, returns its length. Caller is as for fs_lookup_find().
+/**********************************************************************************/
+int fs_name_copy(struct m_sb *sbi, int slot, char *buf)
+{
+    struct fs_name_tail *tail;
+    int len = sbi->s_name_len[slot];
+
+    memcpy(buf, &sbi->s_key_lo[slot], 8);
+    memcpy(buf + 8, &sbi->s_key_hi[slot], 2);
+    if (len <= FS_FNAME_LEN)
+	return len;
+    tail = rcu_dereference(sbi->s_name_tail[slot]);
+    if (!tail)
+	return FS_FNAME_LEN;
+    memcpy(buf + FS_FNAME_LEN, tail->name, tail->len);
+    return FS_FNAME_LEN + tail->len;
+}
+
+
+
+/**********************************************************************************/
+void fs_name_tail_free(struct rcu_head *head)
+{
+    kfree(container_of(head, struct fs_name_tail, rcu));
+}
+
+
+
+/**********************************************************************************/
+// Takes slot out of its hash chain, caller is inside write section of s_name_seq
+/**********************************************************************************/
+void fs_name_unlink(struct m_sb *sbi, int slot)
+{
+    __u32 *p = fs_name_bucket(sbi, sbi->s_name_hval[slot]);
+
+    while (*p && *p != slot + 1)
+	p = &sbi->s_name_next[*p - 1];
+    if (*p)
+	*p = sbi->s_name_next[slot];
+    sbi->s_name_next[slot] = 0;
+    __clear_bit(slot, sbi->s_slot_named);
+}
+
+
+
+/**********************************************************************************/
+// Puts name of inode table slot into name cache, replacing old name of the slot.
+// hval is fs_name_hash() of name. Name cache updaters hold s_lock.
+/**********************************************************************************/
+int fs_lookup_add(struct super_block *s, int slot, const char *name, int len, __u32 hval, ino_t ino)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    struct fs_name_tail *tail = NULL, *old;
+    __u32 *head;
+
+    if (len > FS_FNAME_LEN) {
+	tail = kmalloc(sizeof(*tail) + len - FS_FNAME_LEN, GFP_KERNEL);
+	if (!tail)
+	    return -ENOMEM;
+	tail->len = len - FS_FNAME_LEN;
+	memcpy(tail->name, name + FS_FNAME_LEN, tail->len);
+    }
+    old = sbi->s_name_tail[slot];
+
+    write_seqcount_begin(&sbi->s_name_seq);
+    if (test_bit(slot, sbi->s_slot_named))
+	fs_name_unlink(sbi, slot);
+    sbi->s_name_hval[slot] = hval;
+    sbi->s_name_len[slot] = len;
+    fs_name_key(name, min(len, FS_FNAME_LEN), &sbi->s_key_lo[slot], &sbi->s_key_hi[slot]);
+    rcu_assign_pointer(sbi->s_name_tail[slot], tail);
+    sbi->s_name_ino[slot] = ino;
+    head = fs_name_bucket(sbi, hval);
+    sbi->s_name_next[slot] = *head;
+    *head = slot + 1;
+    __set_bit(slot, sbi->s_slot_used);
+    __set_bit(slot, sbi->s_slot_named);
+    write_seqcount_end(&sbi->s_name_seq);
+
+    if (old)
+	call_rcu(&old->rcu, fs_name_tail_free);
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+void fs_lookup_del(struct super_block *s, int slot)
+{
+    struct m_sb *sbi = s->s_fs_info;
+    struct fs_name_tail *old = sbi->s_name_tail[slot];
+
+    write_seqcount_begin(&sbi->s_name_seq);
+    if (test_bit(slot, sbi->s_slot_named))
+	fs_name_unlink(sbi, slot);
+    __clear_bit(slot, sbi->s_slot_used);
+    rcu_assign_pointer(sbi->s_name_tail[slot], NULL);
+    write_seqcount_end(&sbi->s_name_seq);
+
+    if (old)
+	call_rcu(&old->rcu, fs_name_tail_free);
+}
+
+
+
+/**********************************************************************************/
+// Name of slot can not be found any more, but slot stays taken until
+// fs_lookup_del()
+/**********************************************************************************/
+void fs_lookup_unhash(struct super_block *s, int slot)
+{
+    struct m_sb *sbi = s->s_fs_info;
+
+    if (!test_bit(slot, sbi->s_slot_named))
+	return;
+    write_seqcount_begin(&sbi->s_name_seq);
+    fs_name_unlink(sbi, slot);
+    write_seqcount_end(&sbi->s_name_seq);
+}
+
+
+
+/**********************************************************************************/
+// Allocates name cache for s_nnodes slots and its hash table, about one chain
+// per inode
+/**********************************************************************************/
+int fs_lookup_init(struct m_sb *sbi)
+{
+    int i, n = sbi->s_nnodes, bm = BITS_TO_LONGS(n)*sizeof(long);
+
+    seqcount_init(&sbi->s_name_seq);
+    for (i=1; i < FS_HASH_BITS_MAX && (1 << i) < n; i++);
+    sbi->s_name_hash_bits = i;
+    sbi->s_name_hval = fs_alloc_table(n*sizeof(__u32));
+    sbi->s_name_len = fs_alloc_table(n);
+    sbi->s_key_lo = fs_alloc_table(n*sizeof(__u64));
+    sbi->s_key_hi = fs_alloc_table(n*sizeof(__u16));
+    sbi->s_name_tail = fs_alloc_table(n*sizeof(*sbi->s_name_tail));
+    sbi->s_name_ino = fs_alloc_table(n*sizeof(__u32));
+    sbi->s_name_next = fs_alloc_table(n*sizeof(__u32));
+    sbi->s_slot_used = fs_alloc_table(bm);
+    sbi->s_slot_named = fs_alloc_table(bm);
+    sbi->s_name_hash = fs_alloc_table(sizeof(__u32) << i);
+    if (!sbi->s_name_hval || !sbi->s_name_len || !sbi->s_key_lo || !sbi->s_key_hi ||
+	!sbi->s_name_tail || !sbi->s_name_ino || !sbi->s_name_next ||
+	!sbi->s_slot_used || !sbi->s_slot_named || !sbi->s_name_hash)
+	return -ENOMEM;
+    memset(sbi->s_name_tail, 0, n*sizeof(*sbi->s_name_tail));
+    memset(sbi->s_name_next, 0, n*sizeof(__u32));
+    memset(sbi->s_slot_used, 0, bm);
+    memset(sbi->s_slot_named, 0, bm);
+    memset(sbi->s_name_hash, 0, sizeof(__u32) << i);
+    return 0;
+}
+
+
+
+/**********************************************************************************/
+void fs_lookup_destroy(struct m_sb *sbi)
+{
+    int i, n = sbi->s_nnodes, bm = BITS_TO_LONGS(n)*sizeof(long);
+
+    if (sbi->s_name_tail) {
+	// No readers are left
+	for (i=0; i < n; i++)
+	    kfree(sbi->s_name_tail[i]);
+	fs_free_table(sbi->s_name_tail, n*sizeof(*sbi->s_name_tail));
+    }
+    if (sbi->s_name_hval)
+	fs_free_table(sbi->s_name_hval, n*sizeof(__u32));
+    if (sbi->s_name_len)
+	fs_free_table(sbi->s_name_len, n);
+    if (sbi->s_key_lo)
+	fs_free_table(sbi->s_key_lo, n*sizeof(__u64));
+    if (sbi->s_key_hi)
+	fs_free_table(sbi->s_key_hi, n*sizeof(__u16));
+    if (sbi->s_name_ino)
+	fs_free_table(sbi->s_name_ino, n*sizeof(__u32));
+    if (sbi->s_name_next)
+	fs_free_table(sbi->s_name_next, n*sizeof(__u32));
+    if (sbi->s_slot_used)
+	fs_free_table(sbi->s_slot_used, bm);
+    if (sbi->s_slot_named)
+	fs_free_table(sbi->s_slot_named, bm);
+    if (sbi->s_name_hash)
+	fs_free_table(sbi->s_name_hash, sizeof(__u32) << sbi->s_name_hash_bits);
+}
+
+
+
+/**********************************************************************************/
+// Writes name longer than FS_FNAME_LEN to a new name block. Returns the block,
+// 0 for short names or error.
+/**********************************************************************************/
+int fs_write_name(struct super_block *s, const char *name, int len)
+{
+    struct buffer_head *bh;
+    int blk;
+
+    if (len <= FS_FNAME_LEN)
+	return 0;
+    blk = fs_alloc_blk(s, 0);
+    if (!blk)
+	return -ENOSPC;
+    bh = sb_getblk(s, blk);
+    if (!bh) {
+	fs_free_blk(s, blk, 1);
+	return -EIO;
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, s->s_blocksize);
+    memcpy(bh->b_data, name, len);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    brelse(bh);
+    return blk;
+}
+
+
+
+/**********************************************************************************/
+// Fills name fields of on-disk inode, name_blk is from fs_write_name()
+/**********************************************************************************/
+void fs_set_dname(struct d_ino *di, const char *name, int len, __u32 name_blk)
+{
+    memset(di->name, 0, FS_FNAME_LEN);
+    memcpy(di->name, name, min(len, FS_FNAME_LEN));
+    di->i_name_len = len;
+    di->i_name_hash = fs_name_hash(name, len);
+    di->i_name_blk = name_blk;
+}
+
+
+
+/**********************************************************************************/
+// Large tables (a few pages and more) are taken from vmalloc area
+/**********************************************************************************/
+void *fs_alloc_table(unsigned long size)
+{
+    if (size <= PAGE_SIZE)
+	return kmalloc(size, GFP_KERNEL);
+    return vmalloc(size);
+}
+
+
+
+/**********************************************************************************/
+void fs_free_table(void *p, unsigned long size)
+{
+    if (size <= PAGE_SIZE)
+	kfree(p);
+    else
+	vfree(p);
 }
 
 
@@ -949,21 +3360,60 @@ int fs_rename(struct inode *old_dir, struct dentry *old_dentry,
 {
 d("=%s(dold: %s, dnew: %s)\n", fn, old_dentry->d_name.name, new_dentry->d_name.name);
     struct inode *inode = old_dentry->d_inode;
+    struct inode *victim = new_dentry->d_inode;
+    struct m_sb *sbi = inode ? inode->i_sb->s_fs_info : NULL;
+    const char *name = new_dentry->d_name.name;
+    int len = new_dentry->d_name.len, name_blk;
     struct d_ino *di;
     struct buffer_head *bh;
-    int rc = -ENOENT, i;
+    __u32 old_blk;
+    int rc = -ENOENT;
     
     if (!inode)
 	goto out;
-    i = inode->i_ino - FS_ROOT_INO - 1;
-    bh = sb_bread(inode->i_sb, FS_INO_BLK + i/FS_INO_PER_BLK);
-    if (!bh)
+    rc = -ENAMETOOLONG;
+    if (len > FS_NAME_MAX)
 	goto out;
-    di = (struct d_ino*)(bh->b_data) + i % FS_INO_PER_BLK;
-    strncpy(di->name, new_dentry->d_name.name, FS_FNAME_LEN);
-    mark_buffer_dirty(bh);
+    rc = -EIO;
+    di = fs_slot_bread(inode->i_sb, FS_INO_SLOT(inode->i_ino), &bh);
+    if (!di)
+	goto out;
+    name_blk = fs_write_name(inode->i_sb, name, len);
+    if (name_blk < 0) {
+	brelse(bh);
+	rc = name_blk;
+	goto out;
+    }
+
+    // Replaced file loses its name, its slot is freed by fs_delete_inode() on
+    // last iput
+    mutex_lock(&sbi->s_lock);
+    rc = fs_lookup_add(inode->i_sb, FS_INO_SLOT(inode->i_ino), name, len, fs_name_hash(name, len), inode->i_ino);
+    if (!rc && victim && victim != inode)
+	fs_lookup_unhash(inode->i_sb, FS_INO_SLOT(victim->i_ino));
+    mutex_unlock(&sbi->s_lock);
+    if (rc) {
+	brelse(bh);
+	if (name_blk)
+	    fs_free_blk(inode->i_sb, name_blk, 1);
+	goto out;
+    }
+
+    down_read(&sbi->s_jsem);
+    lock_buffer(bh);
+    old_blk = di->i_name_blk;
+    fs_set_dname(di, name, len, name_blk);
+    unlock_buffer(bh);
+    fs_dirty_slot(inode->i_sb, FS_INO_SLOT(inode->i_ino), bh);
     brelse(bh);
-    rc = 0;
+    if (old_blk)
+	fs_release_blk(inode->i_sb, old_blk, 1);
+    up_read(&sbi->s_jsem);
+    if (victim && victim != inode) {
+	victim->i_nlink--;
+	victim->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(victim);
+    }
 
 out:
 d("-%s rc: %i\n", fn, rc);
@@ -1000,20 +3450,3 @@ void fs_print_ibitmap(struct super_block *s)
 out:
 d("-%s\n", fn);
 }
-
-
-
-/**********************************************************************************/
-// fs_hash truncates file name to FS_FNAME_LEN bytes
-/**********************************************************************************/
-int fs_hash(struct dentry *dentry, struct qstr *qstr)
-{
-    d("*%s(dentry: %s, qstr: %s)\n", fn, dentry->d_name.name, qstr->name);
-
-    if (strlen(qstr->name) > FS_FNAME_LEN) {
-	qstr->hash = full_name_hash(qstr->name, FS_FNAME_LEN);
-	qstr->len = FS_FNAME_LEN;
-    }
-
-    return 0;
-}
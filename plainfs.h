@@ -11,56 +11,205 @@
 // Common definitions
 #define FS_NAME		"plainfs"
 #define FS_MOD_VER	"0.2.1"
-#define FS_BSIZE_BITS	9
+#define FS_BSIZE_BITS	9	// smallest block size, superblock is read with it
 #define FS_BSIZE	(1<<FS_BSIZE_BITS)
+#define FS_MAX_BSIZE_BITS 12	// largest block size
 #define FS_ROOT_INO	1
 //#define FS_SB_SIZE	512
 //#define FS_MAGIC	0x25850101
-#define FS_FNAME_LEN	10
+#define FS_MAGIC_STR	"plainfs superblock"
+#define FS_REV		5	// on-disk format revision
+#define FS_FNAME_LEN	10	// name bytes kept in d_ino, longer names go to a name block
+#define FS_NAME_MAX	255	// file name limit
+#define FS_INLINE_DATA	0x1	// d_ino.i_flags: i_ext holds file data, not extents
+#define FS_INLINE_LEN	(FS_NEXTENT*sizeof(struct d_extent))	// data bytes kept in inode
 #define fn		__func__
 #define FS_BOOT_BLK	0
 #define FS_SB_BLK	0
 #define FS_INO_BLK	1
 #define FS_INODE_CACHE	FS_NAME"_inode_cache"
-#define FS_INO_PER_BLK  ((FS_BSIZE)/(sizeof(struct d_ino)))
-#define FS_IDATA	3
+#define FS_INO_PER_BLK(bsize)	((bsize)/(sizeof(struct d_ino)))
+#define FS_NEXTENT	9	// extents kept in inode, the rest go to extent blocks
+#define FS_EXT_PER_BLK(bsize)	((bsize)/(sizeof(struct d_extent)))
+#define FS_PTR_PER_BLK(bsize)	((bsize)/(sizeof(__u32)))
+#define FS_MAX_EXTENTS(bsize)	(FS_NEXTENT + FS_EXT_PER_BLK(bsize) + FS_PTR_PER_BLK(bsize)*FS_EXT_PER_BLK(bsize))
+#define FS_HASH_BITS_MAX 16	// upper limit for name hash table size
+#define FS_STATE_CLEAN	1	// d_sb.s_state: bitmap and free counters on disk are valid
+#define FS_STATE_JOURNAL 2	// d_sb.s_state: bitmap on disk is valid once journal is replayed
+#define FS_BMAP_VALID(state)	((state) == FS_STATE_CLEAN || (state) == FS_STATE_JOURNAL)
+#define FS_JOURNAL_MAGIC 0x4c4e4a50	// "PJNL", header, descriptor and commit blocks of journal
+#define FS_JDESC	1	// d_jblk.j_type: descriptor, block images follow it
+#define FS_JCOMMIT	2	// d_jblk.j_type: commit, ends transaction
+#define FS_JOURNAL_MIN	8	// smallest journal, blocks including header
+#define FS_SCAN_BATCH	32	// inode table blocks read per request by mount-time scan
+#define FS_RESV_WINDOW	64	// blocks a file may take ahead of its dirty data at writeback
+#define FS_META_RESERVE	16	// free blocks delayed writes leave for extent blocks
+#define FS_BM_LEVELS	8	// block bitmap and its summaries, enough for 32 bit block numbers
+#define FS_RUN_GROUPS	8	// bitmap groups searched for a free run of requested length
+#define FS_INO_SLOT(ino)	((ino) - FS_ROOT_INO - 1)	// inode number to inode table slot
+#define FS_SLOT_INO(slot)	((slot) + FS_ROOT_INO + 1)	// inode table slot to inode number
 //#define DEBUG		// switches a lot of debug messages from module
 
+/*
+ * run of blocks on disk, extents of a file follow in logical order
+ */
+struct d_extent {
+    __u32 e_start;		// first block of run, 0 - hole
+    __u32 e_len;		// number of blocks in run
+};
+
 /*
  * inode data on disk
+ * Extents 0..FS_NEXTENT-1 are kept in inode, next FS_EXT_PER_BLK() ones in block
+ * i_ind, the rest in blocks whose numbers are listed in block i_dind.
+ * Files with FS_INLINE_DATA keep up to FS_INLINE_LEN bytes of data in i_ext and
+ * have no extents.
  */
 struct d_ino {
-    char name[FS_FNAME_LEN];    // file name
-    __u16 i_ino;         	// inode number
+    char name[FS_FNAME_LEN];    // file name, its first FS_FNAME_LEN bytes if longer
     __u16 i_mode;
-    __u16 i_size;		// size in bytes
+    __u32 i_ino;         	// inode number
     __u8  i_nlinks;		// number of file's links, 0 - inode is free
     __u8 i_uid;
     __u8 i_gid;
+    __u8 i_name_len;		// name length, 1..FS_NAME_MAX
     __u32 i_time;
-    __u16 i_data[FS_IDATA];
+    __u64 i_size;		// size in bytes
+    __u32 i_nextents;		// extents in use
+    __u32 i_ind;		// extent block, 0 - none
+    __u32 i_dind;		// block of extent block numbers, 0 - none
+    __u32 i_name_hash;		// fs_name_hash() of name
+    __u32 i_name_blk;		// block holding whole name if longer than FS_FNAME_LEN
+    __u32 i_flags;		// FS_INLINE_DATA
+    struct d_extent i_ext[FS_NEXTENT];
 };
 
+/*
+ * hash of file name kept in d_ino (32 bit FNV-1a), same for module and tools
+ */
+static inline __u32 fs_name_hash(const char *name, int len)
+{
+    __u32 h = 2166136261U;
+
+    while (len-- > 0) {
+	h ^= (unsigned char)*name++;
+	h *= 16777619U;
+    }
+    return h;
+}
+
 /*
  * super-block data on disk
  */
 struct d_sb {
-	char s_magic[30];
-	__u16 s_nnodes;  // amount of blocks for inode table
-	__u16 s_nblocks; // total number of blocks
+	char s_magic[30];	// FS_MAGIC_STR
+	__u16 s_rev;		// FS_REV
+	__u32 s_nnodes;  	// number of inodes
+	__u32 s_nblocks; 	// total number of blocks
+	__u32 s_bmap_blk;	// first block of data zone bitmap
+	__u32 s_data_blk;	// first block of data zone
+	__u32 s_ndata;		// blocks in data zone
+	__u32 s_free_blocks;	// free data blocks, valid if FS_STATE_CLEAN
+	__u32 s_free_inodes;	// free inodes, valid if FS_STATE_CLEAN
+	__u16 s_state;		// FS_STATE_CLEAN after clean unmount
+	__u16 s_bsize_bits;	// log2 of block size, FS_BSIZE_BITS..FS_MAX_BSIZE_BITS
+	__u32 s_journal_blk;	// first block of journal, its header
+	__u32 s_journal_len;	// blocks in journal including header
+	__u32 s_itable_init;	// inode table blocks written, slots past them are free
 };
 
+/*
+ * journal header, first block of journal
+ * Blocks after header form a circular log of transactions. Transaction is a
+ * descriptor, images of the blocks it lists and a commit block, all with the same
+ * sequence number. Replay starts at j_start and applies transactions while their
+ * sequence numbers go on and commit blocks are found.
+ */
+struct d_jhead {
+	__u32 j_magic;		// FS_JOURNAL_MAGIC
+	__u32 j_seq;		// sequence number of transaction at j_start
+	__u32 j_start;		// block of oldest transaction, counted from header + 1
+};
+
+/*
+ * descriptor and commit blocks of journal
+ */
+struct d_jblk {
+	__u32 j_magic;		// FS_JOURNAL_MAGIC
+	__u32 j_type;		// FS_JDESC or FS_JCOMMIT
+	__u32 j_seq;
+	__u32 j_count;		// block images in transaction
+	__u32 j_blk[0];		// descriptor: where images go on replay
+};
+#define FS_JBLK_MAX(bsize)	(((bsize) - sizeof(struct d_jblk))/sizeof(__u32))
+
+#ifdef __KERNEL__
 /*
  * super-block data in memory
  */
 struct m_sb {
-	__u16 s_nnodes;
-	__u16 s_nblocks;
-	struct lookup_entry **s_lookup;
+	__u32 s_nnodes;
+	__u32 s_nblocks;
+	__u32 s_data_blk;		// first block of data zone
+	__u32 s_ndata;			// blocks in data zone, bits in s_inode_bm
+	__u32 s_bmap_blk;		// first block of on-disk bitmap
+	__u32 s_alloc_rotor;		// bit where blocks of new files are searched from
+	__u16 s_state;			// state written to d_sb on sync
+	__u32 s_ino_per_blk;		// layout values for block size of this fs
+	__u32 s_ext_per_blk;
+	__u32 s_ptr_per_blk;
+	__u32 s_max_extents;
+	struct percpu_counter s_freeblocks_counter;
+	struct percpu_counter s_freeinodes_counter;
+	struct mutex s_lock;		// serializes name cache and inode table slot updates
+	seqcount_t s_name_seq;		// name cache readers retry when it changes
+	// Name cache, one entry per inode table slot kept in parallel arrays
+	__u32 *s_name_hval;		// fs_name_hash() of name, compared first
+	__u8 *s_name_len;
+	__u64 *s_key_lo;		// name bytes 0-7, zero padded
+	__u16 *s_key_hi;		// name bytes 8-9
+	struct fs_name_tail **s_name_tail;	// rest of long names, RCU
+	__u32 *s_name_ino;
+	__u32 *s_name_next;		// hash chain, slot + 1 of next entry, 0 ends it
+	unsigned long *s_slot_used;	// slot taken, by live inode or one being deleted
+	unsigned long *s_slot_named;	// slot's name can be looked up
+	__u32 *s_name_hash;		// chain heads, slot + 1
+	unsigned int s_name_hash_bits;
+	unsigned long *s_itable_dirty;	// inode table blocks changed since last flush, pinned
+	__u32 s_itable_blocks;
+	__u32 s_itable_init;		// table blocks in use, see d_sb, grows under s_lock
+	// Journal, blocks are counted from header + 1 except s_journal_blk
+	__u32 s_journal_blk;
+	__u32 s_journal_len;		// blocks after header
+	__u32 s_jstart;			// oldest transaction replay would apply
+	__u32 s_jhead;			// where next transaction is written
+	__u32 s_jseq;			// sequence number of next transaction
+	struct rw_semaphore s_jsem;	// taken for write by commit, for read by inode table updates
+	struct buffer_head **s_jbh;	// blocks of transaction being committed
+	int s_jmax;			// transaction size limit
 	char *s_inode_bm;
+	unsigned long *s_free_pend;	// blocks freed since last commit, see fs_release_blk()
+	__u32 s_npend;			// bits set in s_free_pend
+	unsigned long *s_win_bm;	// blocks of reservation windows, see fs_alloc_delayed()
+	__u32 s_nwin;			// bits set in s_win_bm
+	// Summary level n+1 has one bit per word of level n, set when the word is full.
+	// Level 0 is s_inode_bm, the top level fits in one word.
+	unsigned long *s_bm[FS_BM_LEVELS];
+	__u32 s_bm_bits[FS_BM_LEVELS];
+	int s_bm_levels;
+	__u32 *s_group_free;		// free blocks per group, group is one on-disk bitmap block
+	__u32 s_ngroups;
+	int s_group_bits;		// log2 of blocks per group
+	spinlock_t s_bm_lock;		// protects bitmap, summaries and group counts
 };
 
-struct lookup_entry {
-    char name[FS_FNAME_LEN];
-    __u16 i_ino;
+/*
+ * bytes of name beyond FS_FNAME_LEN, allocated to its length
+ */
+struct fs_name_tail {
+    struct rcu_head rcu;
+    __u8 len;			// bytes in name, readers bound by it, not by s_name_len
+    char name[0];
 };
+
+#endif
@@ -0,0 +1,413 @@
+/*
+ * stress - multithreaded create/lookup/write/unlink test for a mounted PlainFS.
+ *
+ * This file is released under the GPL.
+ *
+ * Threads work on files of their own (create with data, read back, unlink) and
+ * look up files of the others, so name cache, inode table and block allocator
+ * are hit from all threads at once. Afterwards every file left is read back,
+ * the directory is listed and, once the files are removed, free counts must be
+ * where they started. One CSV line is printed per thread count.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+
+#define STRESS_VER "0.1"
+#define STRESS_NAME "stress"
+#define THREADS_MAX 64
+#define SIZE_MAX_DEF 16384	// largest file written, default
+#define NAME_FMT "stress%02d_%04d"
+
+/*
+ * file of a thread, data is derived from seed
+ */
+struct sfile {
+    int live;
+    unsigned int seed;
+    unsigned int size;
+};
+
+void die(const char *, ...);
+void show_usage();
+unsigned long long now_ns();
+void run(int);
+void *stress_thread(void *);
+void file_name(int, int, char *);
+void fill(char *, unsigned int, unsigned int);
+int write_file(int, int, unsigned int);
+int check_file(int, int);
+void do_lookup(int, unsigned int *);
+void do_readdir();
+void fail(const char *, ...);
+int verify(int);
+
+char *target;			// mounted directory
+int nops = 2000;		// -n option, operations per thread
+int nfiles = 64;		// -f option, files per thread
+unsigned int max_size = SIZE_MAX_DEF;	// -s option
+struct sfile **files;		// per thread
+char **bufs;			// per thread, two files long
+int nthreads;
+int errors;
+pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+/***********************************************************/
+int main(int argc, char *argv[])
+{
+    char *counts = "1,2,4,8", *p;
+    int rc, t;
+
+    while ((rc = getopt(argc, argv, "t:n:f:s:")) != -1) {
+	switch (rc) {
+	case 't':
+	    counts = optarg;
+	    break;
+	case 'n':
+	    nops = atoi(optarg);
+	    break;
+	case 'f':
+	    nfiles = atoi(optarg);
+	    break;
+	case 's':
+	    max_size = atoi(optarg);
+	    break;
+	default:
+	    show_usage();
+	    return 1;
+	}
+    }
+    if (optind != argc - 1 || nops < 1 || nfiles < 1 || nfiles > 10000 || !max_size) {
+	show_usage();
+	return 1;
+    }
+    target = argv[optind];
+
+    printf("threads,ops,seconds,ops_per_sec,errors\n");
+    for (p = counts; *p; p += strcspn(p, ","), p += (*p == ',')) {
+	t = atoi(p);
+	if (t < 1 || t > THREADS_MAX)
+	    die("bad thread count '%s'", p);
+	run(t);
+    }
+    if (errors)
+	fprintf(stderr, STRESS_NAME": %d errors\n", errors);
+    return errors ? 1 : 0;
+}
+
+
+
+/***********************************************************/
+void die(const char *format, ...)
+{
+    va_list arg;
+
+    va_start(arg, format);
+    fprintf(stderr, STRESS_NAME": ");
+    vfprintf(stderr, format, arg);
+    fprintf(stderr, "\n");
+    va_end(arg);
+    exit(1);
+}
+
+
+
+/***********************************************************/
+void show_usage()
+{
+    printf(STRESS_NAME " (version "STRESS_VER")\n");
+    printf("Usage: " STRESS_NAME " [-t threads,...] [-n ops] [-f files] [-s size] directory\n");
+    printf("  -t  comma separated thread counts, each is a run (1,2,4,8)\n");
+    printf("  -n  operations per thread (2000)\n");
+    printf("  -f  files per thread at most (64)\n");
+    printf("  -s  largest file in bytes (%d)\n", SIZE_MAX_DEF);
+}
+
+
+
+/***********************************************************/
+unsigned long long now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+
+
+/***********************************************************/
+// Runs threads, checks what they left and removes it
+void run(int n)
+{
+    pthread_t threads[THREADS_MAX];
+    struct statvfs before, after;
+    unsigned long long t;
+    int before_errors = errors;
+    long i;
+
+    nthreads = n;
+    files = calloc(n, sizeof(*files));
+    bufs = calloc(n, sizeof(*bufs));
+    if (!files || !bufs)
+	die("out of memory");
+    for (i=0; i < n; i++) {
+	files[i] = calloc(nfiles, sizeof(struct sfile));
+	bufs[i] = malloc(2*max_size);
+	if (!files[i] || !bufs[i])
+	    die("out of memory");
+    }
+    sync();
+    if (statvfs(target, &before) < 0)
+	die("unable to stat '%s'", target);
+
+    t = now_ns();
+    for (i=0; i < n; i++)
+	if (pthread_create(&threads[i], NULL, stress_thread, (void *)i))
+	    die("unable to start threads");
+    for (i=0; i < n; i++)
+	pthread_join(threads[i], NULL);
+    t = now_ns() - t;
+
+    verify(n);
+    // Blocks of deleted files may come back only when journal commits
+    sync();
+    if (statvfs(target, &after) < 0)
+	die("unable to stat '%s'", target);
+    if (after.f_ffree != before.f_ffree || after.f_bfree != before.f_bfree)
+	fail("free counts %lu/%lu, were %lu/%lu", (unsigned long)after.f_ffree,
+	    (unsigned long)after.f_bfree, (unsigned long)before.f_ffree, (unsigned long)before.f_bfree);
+
+    printf("%d,%d,%.6f,%.0f,%d\n", n, n*nops, t/1e9, n*nops/(t/1e9), errors - before_errors);
+    fflush(stdout);
+    for (i=0; i < n; i++) {
+	free(files[i]);
+	free(bufs[i]);
+    }
+    free(files);
+    free(bufs);
+}
+
+
+
+/***********************************************************/
+// Random mix: (re)write own file, read one back, look up any
+// file, unlink own file, list directory
+void *stress_thread(void *arg)
+{
+    int th = (long)arg, i, f, op;
+    unsigned int seed = th*7919 + 1;
+    char name[PATH_MAX];
+
+    for (i=0; i < nops; i++) {
+	f = rand_r(&seed)%nfiles;
+	op = rand_r(&seed)%100;
+	if (op < 30)
+	    write_file(th, f, rand_r(&seed));
+	else if (op < 60) {
+	    if (files[th][f].live)
+		check_file(th, f);
+	    else
+		do_lookup(th, &seed);
+	} else if (op < 80)
+	    do_lookup(th, &seed);
+	else if (op < 97) {
+	    if (!files[th][f].live)
+		continue;
+	    file_name(th, f, name);
+	    if (unlink(name) < 0)
+		fail("unlink %s: %s", name, strerror(errno));
+	    files[th][f].live = 0;
+	} else
+	    do_readdir();
+    }
+    return NULL;
+}
+
+
+
+/***********************************************************/
+void file_name(int th, int f, char *name)
+{
+    sprintf(name, "%s/"NAME_FMT, target, th, f);
+}
+
+
+
+/***********************************************************/
+void fill(char *buf, unsigned int seed, unsigned int size)
+{
+    unsigned int i;
+
+    for (i=0; i < size; i++)
+	buf[i] = (seed >> (i%4*8)) + i*31;
+}
+
+
+
+/***********************************************************/
+// Replaces file of thread with new one, data and size come from seed
+int write_file(int th, int f, unsigned int seed)
+{
+    struct sfile *sf = &files[th][f];
+    char name[PATH_MAX], *buf = bufs[th];
+    unsigned int size = seed%(max_size + 1);
+    int fd;
+
+    file_name(th, f, name);
+    if (sf->live && unlink(name) < 0) {
+	fail("unlink %s: %s", name, strerror(errno));
+	return -1;
+    }
+    sf->live = 0;
+    fd = open(name, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd < 0) {
+	fail("create %s: %s", name, strerror(errno));
+	return -1;
+    }
+    fill(buf, seed, size);
+    if (write(fd, buf, size) != size)
+	fail("write %s: %s", name, strerror(errno));
+    if (close(fd) < 0)
+	fail("close %s: %s", name, strerror(errno));
+    sf->live = 1;
+    sf->seed = seed;
+    sf->size = size;
+    return 0;
+}
+
+
+
+/***********************************************************/
+// Reads file back, compares size and data
+int check_file(int th, int f)
+{
+    struct sfile *sf = &files[th][f];
+    char name[PATH_MAX], *buf = bufs[th], *want = bufs[th] + max_size;
+    ssize_t n = 0, r;
+    int fd;
+
+    file_name(th, f, name);
+    fd = open(name, O_RDONLY);
+    if (fd < 0) {
+	fail("open %s: %s", name, strerror(errno));
+	return -1;
+    }
+    while (n < max_size && (r = read(fd, buf + n, max_size - n)) > 0)
+	n += r;
+    close(fd);
+    fill(want, sf->seed, sf->size);
+    if (n != sf->size || memcmp(buf, want, sf->size)) {
+	fail("%s: %zd bytes read, %u written, data %s", name, n, sf->size,
+	    n == sf->size ? "differs" : "not compared");
+	return -1;
+    }
+    return 0;
+}
+
+
+
+/***********************************************************/
+// Looks up file of any thread, it may come and go meanwhile
+void do_lookup(int th, unsigned int *seed)
+{
+    char name[PATH_MAX];
+    struct stat st;
+    int other = rand_r(seed)%nthreads, f = rand_r(seed)%nfiles;
+
+    file_name(other, f, name);
+    if (stat(name, &st) < 0) {
+	if (errno != ENOENT)
+	    fail("stat %s: %s", name, strerror(errno));
+    } else if (other == th && !files[th][f].live)
+	fail("%s: found after unlink", name);
+}
+
+
+
+/***********************************************************/
+void do_readdir()
+{
+    DIR *dir = opendir(target);
+
+    if (!dir) {
+	fail("opendir %s: %s", target, strerror(errno));
+	return;
+    }
+    while (readdir(dir))
+	;
+    closedir(dir);
+}
+
+
+
+/***********************************************************/
+void fail(const char *format, ...)
+{
+    va_list arg;
+
+    pthread_mutex_lock(&out_lock);
+    va_start(arg, format);
+    fprintf(stderr, STRESS_NAME": ");
+    vfprintf(stderr, format, arg);
+    fprintf(stderr, "\n");
+    va_end(arg);
+    errors++;
+    pthread_mutex_unlock(&out_lock);
+}
+
+
+
+/***********************************************************/
+// Reads back files left, compares directory with them and
+// removes them. Returns number of files found.
+int verify(int n)
+{
+    char name[PATH_MAX];
+    struct dirent *de;
+    DIR *dir;
+    int th, f, live = 0, listed = 0;
+
+    for (th=0; th < n; th++)
+	for (f=0; f < nfiles; f++)
+	    if (files[th][f].live) {
+		check_file(th, f);
+		live++;
+	    }
+    dir = opendir(target);
+    if (!dir)
+	die("unable to open '%s'", target);
+    while ((de = readdir(dir)) != NULL)
+	if (sscanf(de->d_name, NAME_FMT, &th, &f) == 2) {
+	    listed++;
+	    if (th >= n || f >= nfiles || !files[th][f].live)
+		fail("%s: listed, but not created", de->d_name);
+	}
+    closedir(dir);
+    if (listed != live)
+	fail("%d files listed, %d expected", listed, live);
+
+    for (th=0; th < n; th++)
+	for (f=0; f < nfiles; f++)
+	    if (files[th][f].live) {
+		file_name(th, f, name);
+		if (unlink(name) < 0)
+		    fail("unlink %s: %s", name, strerror(errno));
+		files[th][f].live = 0;
+	    }
+    return live;
+}